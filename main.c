@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include "api.h"
 
 void vm_register_builtins(vm_t *vm);
@@ -12,42 +13,11 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    // If arguments provided, execute scripts and exit
+    // If arguments provided, execute scripts and exit; "-" reads stdin
     if (argc > 1) {
         for (int i = 1; i < argc; i++) {
-            FILE *f = fopen(argv[i], "r");
-            if (!f) {
-                fprintf(stderr, "Failed to open file: %s\n", argv[i]);
-                scheme_destroy(vm);
-                return 1;
-            }
-
-            fseek(f, 0, SEEK_END);
-            long size = ftell(f);
-            fseek(f, 0, SEEK_SET);
-
-            char *code = malloc(size + 1);
-            if (!code) {
-                fprintf(stderr, "Failed to allocate memory\n");
-                fclose(f);
-                scheme_destroy(vm);
-                return 1;
-            }
-
-            if (fread(code, 1, size, f) != (size_t)size) {
-                fprintf(stderr, "Failed to read file: %s\n", argv[i]);
-                free(code);
-                fclose(f);
-                scheme_destroy(vm);
-                return 1;
-            }
-            code[size] = '\0';
-            fclose(f);
-
-            value_t *result;
-            int ret = scheme_eval_string(vm, code, &result);
-            free(code);
-
+            int ret = strcmp(argv[i], "-") == 0 ? scheme_eval_fd(vm, STDIN_FILENO, NULL)
+                                                : scheme_eval_file(vm, argv[i], NULL);
             if (ret == 0) {
                 fprintf(stderr, "Error in %s: %s\n", argv[i], scheme_error_message(vm));
                 scheme_clear_error(vm);
@@ -100,6 +70,7 @@ int main(int argc, char *argv[]) {
             } else {
                 printf("#<value>\n");
             }
+            scheme_release(vm, result);
         }
     }
 
@@ -1,10 +1,13 @@
 #include "reader.h"
+#include "number.h"
 #include "value.h"
 #include "vm.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 typedef struct {
     int use_spaces;
@@ -57,25 +60,30 @@ static void print_value(value_t *v, formatter_t *fmt) {
         case VTYPE_BOOL:
             fputs(v->as.boolean ? "#t" : "#f", stdout);
             break;
-        case VTYPE_NUMBER:
-            printf("%llu", (unsigned long long)v->as.number);
+        case VTYPE_NUMBER: {
+            char num[NUMBER_TEXT_MAX];
+            size_t len = v->flags & VALUE_DOUBLE ? number_format_double(v->as.floating, num)
+                                                 : number_format_uint(v->as.number, num);
+            fwrite(num, 1, len, stdout);
             break;
+        }
         case VTYPE_STRING:
             putchar('"');
-            for (char *s = v->as.string; *s; s++) {
-                switch (*s) {
+            for (size_t i = 0; i < v->as.string.len; i++) {
+                char c = v->as.string.data[i];
+                switch (c) {
                     case '\n': fputs("\\n", stdout); break;
                     case '\r': fputs("\\r", stdout); break;
                     case '\t': fputs("\\t", stdout); break;
                     case '\\': fputs("\\\\", stdout); break;
                     case '"': fputs("\\\"", stdout); break;
-                    default: putchar(*s); break;
+                    default: putchar(c); break;
                 }
             }
             putchar('"');
             break;
         case VTYPE_SYMBOL:
-            fputs(v->as.symbol, stdout);
+            fputs(v->as.symbol.name, stdout);
             break;
         case VTYPE_PAIR: {
             int fits = should_fit_on_one_line(v);
@@ -145,15 +153,17 @@ static void print_value(value_t *v, formatter_t *fmt) {
             fmt->current_indent += fmt->indent_count;
             
             int first = 1;
-            for (size_t i = 0; i < v->as.hash.size; i++) {
+            size_t iter = 0;
+            value_t *key, *val;
+            while (hash_next(v, &iter, &key, &val)) {
                 if (!first) {
                     putchar('\n');
                     print_indent(fmt);
                 }
                 first = 0;
-                print_value(v->as.hash.keys[i], fmt);
+                print_value(key, fmt);
                 putchar(' ');
-                print_value(v->as.hash.values[i], fmt);
+                print_value(val, fmt);
             }
             
             fmt->current_indent -= fmt->indent_count;
@@ -166,37 +176,25 @@ static void print_value(value_t *v, formatter_t *fmt) {
         case VTYPE_NATIVE:
             fputs("#<native>", stdout);
             break;
+        case VTYPE_RECORD:
+            printf("#<%s>", v->as.record.type->as.record_type.name->as.symbol.name);
+            break;
+        case VTYPE_RECORD_TYPE:
+            fputs("#<record-type>", stdout);
+            break;
+        case VTYPE_RECORD_PROC:
+            fputs("#<record-procedure>", stdout);
+            break;
+        case VTYPE_LAZY:
+            if (v->as.lazy.value) print_value(v->as.lazy.value, fmt);
+            else fputs("#<lazy>", stdout);
+            break;
+        case VTYPE_PATH:
+            fputs("#<json-path>", stdout);
+            break;
     }
 }
 
-static char *read_file_contents(const char *filename) {
-    FILE *f = fopen(filename, "r");
-    if (!f) {
-        perror("Failed to open file");
-        return NULL;
-    }
-
-    fseek(f, 0, SEEK_END);
-    long size = ftell(f);
-    fseek(f, 0, SEEK_SET);
-
-    char *buf = malloc(size + 1);
-    if (!buf) {
-        fclose(f);
-        return NULL;
-    }
-
-    if (fread(buf, 1, size, f) != (size_t)size) {
-        free(buf);
-        fclose(f);
-        return NULL;
-    }
-    buf[size] = '\0';
-    fclose(f);
-
-    return buf;
-}
-
 static void print_usage(const char *prog) {
     fprintf(stderr, "Usage: %s [OPTIONS] [FILE]\n", prog);
     fprintf(stderr, "Options:\n");
@@ -242,61 +240,29 @@ int main(int argc, char *argv[]) {
         filename = argv[optind];
     }
 
-    char *input = NULL;
+    int fd = STDIN_FILENO;
     if (filename) {
-        input = read_file_contents(filename);
-        if (!input) return 1;
-    } else {
-        FILE *f = fopen("/dev/stdin", "r");
-        if (!f) {
-            perror("Failed to open stdin");
-            return 1;
-        }
-
-        fseek(f, 0, SEEK_END);
-        long size = ftell(f);
-        fseek(f, 0, SEEK_SET);
-
-        input = malloc(size + 1);
-        if (!input) {
-            fclose(f);
-            return 1;
-        }
-
-        if (fread(input, 1, size, f) != (size_t)size) {
-            free(input);
-            fclose(f);
+        fd = open(filename, O_RDONLY);
+        if (fd < 0) {
+            perror("Failed to open file");
             return 1;
         }
-        input[size] = '\0';
-        fclose(f);
     }
 
     vm_t *vm = vm_create();
-    if (!vm) {
-        free(input);
-        return 1;
-    }
-
-    reader_t *reader = reader_create(vm, input);
+    reader_stream_t *reader = vm ? reader_stream_create(vm, fd) : NULL;
     if (!reader) {
         vm_destroy(vm);
-        free(input);
+        if (filename) close(fd);
         return 1;
     }
 
     int first = 1;
     while (1) {
-        value_t *v = reader_read(reader);
+        value_t *v = reader_stream_read(reader);
         if (!v) {
-            if (reader_peek(reader) == -1) break;
-            
-            const char *err = vm_error_message(vm);
-            if (err) {
-                fprintf(stderr, "Error: %s\n", err);
-            } else {
-                fprintf(stderr, "Parse error\n");
-            }
+            if (vm_error_code(vm) == VERR_NONE) break;
+            fprintf(stderr, "Error: %s\n", vm_error_message(vm));
             break;
         }
 
@@ -307,11 +273,12 @@ int main(int argc, char *argv[]) {
         first = 0;
 
         print_value(v, &fmt);
+        value_release(vm, v);
     }
 
-    reader_destroy(reader);
+    reader_stream_destroy(reader);
     vm_destroy(vm);
-    free(input);
+    if (filename) close(fd);
 
     putchar('\n');
     return 0;
@@ -1,8 +1,12 @@
 #include "api.h"
 #include "reader.h"
 #include "json.h"
+#include "pack.h"
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 vm_t *scheme_create(void) {
     vm_t *vm = vm_create();
@@ -10,10 +14,6 @@ vm_t *scheme_create(void) {
 
     vm_register_builtins(vm);
 
-    vm_register_native(vm, "json-parse", (value_t *(*)(vm_t *, value_t *))json_parse);
-    vm_register_native(vm, "json-stringify", (value_t *(*)(vm_t *, value_t *))json_stringify);
-    vm_register_native(vm, "json-select", (value_t *(*)(vm_t *, value_t *))json_select);
-
     return vm;
 }
 
@@ -29,25 +29,94 @@ int scheme_eval_string(vm_t *vm, const char *code, value_t **result) {
 
     scheme_clear_error(vm);
 
-    reader_t *r = reader_create(vm, code);
+    value_t *source = value_string(vm, code);
+    reader_t *r = source ? reader_create_value(vm, source) : NULL;
+    value_release(vm, source);
     if (!r) {
         vm_set_error(vm, VERR_RUNTIME, "failed to create reader");
         return 0;
     }
 
-    value_t *expr = reader_read(r);
+    // Every form is evaluated in turn; the last one's value is the result.
+    value_t *val = value_null(vm);
+    value_t *expr;
+    while ((expr = reader_read(r))) {
+        value_release(vm, val);
+        val = vm_eval(vm, expr, vm->global_env);
+        value_release(vm, expr);
+        if (vm_error_code(vm) != VERR_NONE) break;
+    }
     reader_destroy(r);
 
-    if (!expr) {
+    if (vm_error_code(vm) != VERR_NONE) {
+        value_release(vm, val);
+        return 0;
+    }
+
+    if (result) {
+        *result = val;
+    } else {
+        value_release(vm, val);
+    }
+    return 1;
+}
+
+// Reads and evaluates the forms of a file or pipe one at a time, so output
+// starts with the first form and the reader holds only the current one.
+int scheme_eval_fd(vm_t *vm, int fd, value_t **result) {
+    if (!vm) return 0;
+    scheme_clear_error(vm);
+
+    value_t *val = reader_eval_fd(vm, fd);
+    if (!val && vm_error_code(vm) != VERR_NONE) return 0;
+
+    if (result) {
+        *result = val;
+    } else {
+        value_release(vm, val);
+    }
+    return 1;
+}
+
+int scheme_eval_file(vm_t *vm, const char *path, value_t **result) {
+    if (!vm || !path) {
+        if (vm) vm_set_error(vm, VERR_RUNTIME, "invalid arguments to eval_file");
         return 0;
     }
 
-    value_t *val = vm_eval(vm, expr, vm->global_env);
-    if (!val && vm_error_code(vm) != VERR_NONE) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        vm_set_error(vm, VERR_RUNTIME, "cannot open %s: %s", path, strerror(errno));
         return 0;
     }
+    int ok = scheme_eval_fd(vm, fd, result);
+    close(fd);
+    return ok;
+}
+
+// Reads every form of a file, unevaluated, into a vector of read-only
+// values; large files are read on several threads.
+int scheme_load_data(vm_t *vm, const char *path, value_t **result) {
+    if (!vm || !path) {
+        if (vm) vm_set_error(vm, VERR_RUNTIME, "invalid arguments to load_data");
+        return 0;
+    }
+    scheme_clear_error(vm);
 
-    if (result) *result = val;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        vm_set_error(vm, VERR_RUNTIME, "cannot open %s: %s", path, strerror(errno));
+        return 0;
+    }
+    value_t *val = reader_load_data(vm, fd);
+    close(fd);
+    if (!val) return 0;
+
+    if (result) {
+        *result = val;
+    } else {
+        value_release(vm, val);
+    }
     return 1;
 }
 
@@ -67,6 +136,68 @@ void scheme_interrupt(vm_t *vm) {
     vm_interrupt(vm);
 }
 
+size_t scheme_collect_cycles(vm_t *vm) {
+    if (!vm) return 0;
+    return gc_collect(vm);
+}
+
+void scheme_set_gc_threshold(vm_t *vm, size_t roots) {
+    if (vm) vm->gc.threshold = roots;
+}
+
+void scheme_gc_stats(vm_t *vm, gc_stats_t *out) {
+    if (vm && out) *out = vm->gc.stats;
+}
+
+void scheme_set_reclaim_budget(vm_t *vm, size_t budget) {
+    if (!vm) return;
+    vm->gc.budget = budget;
+    if (!budget) gc_reclaim(vm, 0);
+}
+
+size_t scheme_reclaim(vm_t *vm, size_t budget) {
+    if (!vm) return 0;
+    return gc_reclaim(vm, budget);
+}
+
+int scheme_set_reclaim_thread(vm_t *vm, int enable) {
+    if (!vm) return 0;
+    return gc_set_reclaimer(vm, enable);
+}
+
+// Routes the VM's memory through the host's allocator; NULL functions
+// restore the C library. This resets the VM, so call it right after
+// scheme_create(). With a NULL free_fn nothing is freed one block at a
+// time: the host drops its arena after scheme_destroy().
+int scheme_set_allocator(vm_t *vm,
+                         void *(*malloc_fn)(void *ctx, size_t size),
+                         void *(*realloc_fn)(void *ctx, void *p, size_t old_size, size_t new_size),
+                         void (*free_fn)(void *ctx, void *p),
+                         void *ctx) {
+    if (!vm) return 0;
+    gc_allocator_t alloc = { malloc_fn, realloc_fn, free_fn, ctx };
+    int ok = vm_set_allocator(vm, &alloc);
+    vm_register_builtins(vm);
+    return ok;
+}
+
+// Caps the threads used to parse and serialise very large JSON documents
+// and to load large data files; 1 keeps everything on the calling thread
+// and 0 uses one per CPU.
+void scheme_set_threads(vm_t *vm, int threads) {
+    if (vm) vm->threads = threads;
+}
+
+// Allocations that would take the VM's values past bytes fail with a
+// VERR_RUNTIME error; 0 removes the limit.
+void scheme_set_memory_limit(vm_t *vm, size_t bytes) {
+    if (vm) vm->mem.limit = bytes;
+}
+
+void scheme_memory_stats(vm_t *vm, vm_mem_stats_t *out) {
+    if (vm && out) *out = vm->mem;
+}
+
 value_t *scheme_make_null(vm_t *vm) {
     return value_null(vm);
 }
@@ -104,7 +235,10 @@ value_t *scheme_make_vector(vm_t *vm, value_t **items, size_t n) {
     if (!vec) return NULL;
 
     for (size_t i = 0; i < n; i++) {
-        vector_push(vm, vec, items[i]);
+        if (!vector_push(vm, vec, items[i])) {
+            value_release(vm, vec);
+            return NULL;
+        }
     }
 
     return vec;
@@ -151,14 +285,15 @@ int scheme_to_double(value_t *v, double *out) {
     return value_to_double(v, out);
 }
 
-int scheme_to_string(value_t *v, const char **out) {
-    return value_to_string(v, out);
+int scheme_to_string(vm_t *vm, value_t *v, const char **out) {
+    return value_to_string(vm, v, out);
 }
 
 int scheme_to_string_copy(value_t *v, char *buf, size_t len) {
-    if (!value_is_string(v)) return 0;
-    if (len > 0) strncpy(buf, v->as.string, len - 1);
-    buf[len - 1] = '\0';
+    if (!value_is_string(v) || len == 0) return 0;
+    size_t n = v->as.string.len < len - 1 ? v->as.string.len : len - 1;
+    memcpy(buf, v->as.string.data, n);
+    buf[n] = '\0';
     return 1;
 }
 
@@ -191,15 +326,21 @@ size_t scheme_vector_len(value_t *v) {
 }
 
 value_t *scheme_vector_get(vm_t *vm, value_t *v, size_t index) {
-    return vector_get(vm, v, index);
+    return vector_get(vm, value_force(vm, v), index);
 }
 
 value_t *scheme_hash_get(vm_t *vm, value_t *hash, value_t *key) {
-    return hash_get(vm, hash, key);
+    return hash_get(vm, value_force(vm, hash), key);
 }
 
 value_t *scheme_hash_set(vm_t *vm, value_t *hash, value_t *key, value_t *val) {
-    return hash_set(vm, hash, key, val);
+    return hash_set(vm, value_force(vm, hash), key, val);
+}
+
+// Values from json-open stand in for vectors and hashes until first used;
+// this returns the value one stands for (borrowed), building it if needed.
+value_t *scheme_force(vm_t *vm, value_t *v) {
+    return value_force(vm, v);
 }
 
 int scheme_register_native(vm_t *vm, const char *name, scheme_native_func func) {
@@ -217,6 +358,7 @@ value_t *scheme_call(vm_t *vm, const char *func_name, value_t **args, size_t nar
 
     value_t *sym = value_symbol(vm, func_name);
     value_t *func = vm_env_lookup(vm, vm->global_env, sym);
+    value_release(vm, sym);
 
     if (!func) {
         vm_set_error(vm, VERR_UNBOUND, "function not found: %s", func_name);
@@ -231,7 +373,11 @@ value_t *scheme_call(vm_t *vm, const char *func_name, value_t **args, size_t nar
         tail = &((*tail)->as.pair.cdr);
     }
 
-    return vm_eval(vm, value_pair(vm, func, arg_list), vm->global_env);
+    value_t *call = value_pair(vm, func, arg_list);
+    value_release(vm, arg_list);
+    value_t *result = vm_eval(vm, call, vm->global_env);
+    value_release(vm, call);
+    return result;
 }
 
 int scheme_json_parse(vm_t *vm, const char *json_str, value_t **result) {
@@ -251,6 +397,25 @@ int scheme_json_parse(vm_t *vm, const char *json_str, value_t **result) {
     return 1;
 }
 
+// Like scheme_json_parse, but the document lives in one arena that is freed
+// when *result is released.
+int scheme_json_parse_arena(vm_t *vm, const char *json_str, value_t **result) {
+    if (!vm || !json_str || !result) {
+        if (vm) vm_set_error(vm, VERR_RUNTIME, "invalid arguments to json_parse_arena");
+        return 0;
+    }
+
+    scheme_clear_error(vm);
+    value_t *val = json_parse_arena(vm, json_str, strlen(json_str));
+
+    if (!val) {
+        return 0;
+    }
+
+    *result = val;
+    return 1;
+}
+
 int scheme_json_stringify(vm_t *vm, value_t *val, char *buf, size_t len) {
     if (!vm || !val || !buf || len == 0) {
         if (vm) vm_set_error(vm, VERR_RUNTIME, "invalid arguments to json_stringify");
@@ -265,8 +430,7 @@ int scheme_json_stringify(vm_t *vm, value_t *val, char *buf, size_t len) {
     }
 
     if (value_is_string(str_val)) {
-        strncpy(buf, str_val->as.string, len - 1);
-        buf[len - 1] = '\0';
+        scheme_to_string_copy(str_val, buf, len);
         value_release(vm, str_val);
         return 1;
     }
@@ -274,4 +438,119 @@ int scheme_json_stringify(vm_t *vm, value_t *val, char *buf, size_t len) {
     value_release(vm, str_val);
     vm_set_error(vm, VERR_RUNTIME, "json_stringify returned non-string");
     return 0;
+}
+
+// Streams val as JSON to fd, flushing every 64 KB.
+int scheme_json_write_fd(vm_t *vm, value_t *val, int fd) {
+    if (!vm || !val || fd < 0) {
+        if (vm) vm_set_error(vm, VERR_RUNTIME, "invalid arguments to json_write");
+        return 0;
+    }
+
+    scheme_clear_error(vm);
+    json_writer_t w;
+    json_writer_init_fd(&w, vm, fd);
+    int ok = json_write(&w, val);
+    json_writer_free(&w);
+    return ok;
+}
+
+// Streams val as JSON through write(ctx, data, len), mostly in 64 KB chunks;
+// write returns 0 to stop with an error.
+int scheme_json_write(vm_t *vm, value_t *val, int (*write)(void *ctx, const char *data, size_t len), void *ctx) {
+    if (!vm || !val || !write) {
+        if (vm) vm_set_error(vm, VERR_RUNTIME, "invalid arguments to json_write");
+        return 0;
+    }
+
+    scheme_clear_error(vm);
+    json_writer_t w;
+    json_writer_init_sink(&w, vm, write, ctx);
+    int ok = json_write(&w, val);
+    json_writer_free(&w);
+    return ok;
+}
+
+// Starts a push parse; see json_push_new() for the events and build_depth.
+json_push_t *scheme_json_push_create(vm_t *vm, json_event_fn handler, void *ctx, long build_depth) {
+    if (!vm || !handler) {
+        if (vm) vm_set_error(vm, VERR_RUNTIME, "invalid arguments to json_push_create");
+        return NULL;
+    }
+    scheme_clear_error(vm);
+    return json_push_new(vm, handler, ctx, build_depth);
+}
+
+int scheme_json_push_feed(json_push_t *ps, const char *data, size_t len) {
+    return ps && (len == 0 || data) ? json_push_feed(ps, data, len) : 0;
+}
+
+int scheme_json_push_finish(json_push_t *ps) {
+    return ps ? json_push_finish(ps) : 0;
+}
+
+void scheme_json_push_destroy(json_push_t *ps) {
+    json_push_free(ps);
+}
+
+// Binary encodings. Decoding copies data once into a string that the
+// decoded strings then share.
+static int scheme_pack_encode(vm_t *vm, pack_format_t format, value_t *val, value_t **result) {
+    if (!vm || !val || !result) {
+        if (vm) vm_set_error(vm, VERR_RUNTIME, "invalid arguments to %s", format == PACK_CBOR ? "cbor_encode" : "msgpack_encode");
+        return 0;
+    }
+    scheme_clear_error(vm);
+    *result = pack_encode(vm, format, val);
+    return *result != NULL;
+}
+
+static int scheme_pack_write(vm_t *vm, pack_format_t format, value_t *val,
+                             int (*write)(void *ctx, const char *data, size_t len), void *ctx) {
+    if (!vm || !val || !write) {
+        if (vm) vm_set_error(vm, VERR_RUNTIME, "invalid arguments to %s", format == PACK_CBOR ? "cbor_write" : "msgpack_write");
+        return 0;
+    }
+    scheme_clear_error(vm);
+    json_writer_t w;
+    json_writer_init_sink(&w, vm, write, ctx);
+    int ok = pack_write(&w, format, val);
+    json_writer_free(&w);
+    return ok;
+}
+
+static int scheme_pack_decode(vm_t *vm, pack_format_t format, const char *data, size_t len, value_t **result) {
+    if (!vm || (!data && len) || !result) {
+        if (vm) vm_set_error(vm, VERR_RUNTIME, "invalid arguments to %s", format == PACK_CBOR ? "cbor_decode" : "msgpack_decode");
+        return 0;
+    }
+    scheme_clear_error(vm);
+    value_t *source = value_string_n(vm, data ? data : "", len);
+    *result = source ? pack_decode(vm, format, source) : NULL;
+    value_release(vm, source);
+    return *result != NULL;
+}
+
+int scheme_cbor_encode(vm_t *vm, value_t *val, value_t **result) {
+    return scheme_pack_encode(vm, PACK_CBOR, val, result);
+}
+
+int scheme_cbor_write(vm_t *vm, value_t *val, int (*write)(void *ctx, const char *data, size_t len), void *ctx) {
+    return scheme_pack_write(vm, PACK_CBOR, val, write, ctx);
+}
+
+int scheme_cbor_decode(vm_t *vm, const char *data, size_t len, value_t **result) {
+    return scheme_pack_decode(vm, PACK_CBOR, data, len, result);
+}
+
+int scheme_msgpack_encode(vm_t *vm, value_t *val, value_t **result) {
+    return scheme_pack_encode(vm, PACK_MSGPACK, val, result);
+}
+
+int scheme_msgpack_write(vm_t *vm, value_t *val, int (*write)(void *ctx, const char *data, size_t len), void *ctx) {
+    return scheme_pack_write(vm, PACK_MSGPACK, val, write, ctx);
+}
+
+int scheme_msgpack_decode(vm_t *vm, const char *data, size_t len, value_t **result) {
+    return scheme_pack_decode(vm, PACK_MSGPACK, data, len, result);
 }
\ No newline at end of file
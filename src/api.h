@@ -3,11 +3,15 @@
 
 #include "vm.h"
 #include "value.h"
+#include "json.h"
 
 vm_t *scheme_create(void);
 void scheme_destroy(vm_t *vm);
 
 int scheme_eval_string(vm_t *vm, const char *code, value_t **result);
+int scheme_eval_fd(vm_t *vm, int fd, value_t **result);
+int scheme_eval_file(vm_t *vm, const char *path, value_t **result);
+int scheme_load_data(vm_t *vm, const char *path, value_t **result);
 
 int scheme_has_error(vm_t *vm);
 const char *scheme_error_message(vm_t *vm);
@@ -15,6 +19,25 @@ void scheme_clear_error(vm_t *vm);
 
 void scheme_interrupt(vm_t *vm);
 
+size_t scheme_collect_cycles(vm_t *vm);
+void scheme_set_gc_threshold(vm_t *vm, size_t roots);
+void scheme_gc_stats(vm_t *vm, gc_stats_t *out);
+
+void scheme_set_reclaim_budget(vm_t *vm, size_t budget);
+size_t scheme_reclaim(vm_t *vm, size_t budget);
+int scheme_set_reclaim_thread(vm_t *vm, int enable);
+
+int scheme_set_allocator(vm_t *vm,
+                         void *(*malloc_fn)(void *ctx, size_t size),
+                         void *(*realloc_fn)(void *ctx, void *p, size_t old_size, size_t new_size),
+                         void (*free_fn)(void *ctx, void *p),
+                         void *ctx);
+
+void scheme_set_threads(vm_t *vm, int threads);
+
+void scheme_set_memory_limit(vm_t *vm, size_t bytes);
+void scheme_memory_stats(vm_t *vm, vm_mem_stats_t *out);
+
 value_t *scheme_make_null(vm_t *vm);
 value_t *scheme_make_bool(vm_t *vm, int b);
 value_t *scheme_make_number(vm_t *vm, uint64_t n);
@@ -39,7 +62,7 @@ int scheme_is_pair(value_t *v);
 int scheme_to_bool(value_t *v);
 int scheme_to_number(value_t *v, uint64_t *out);
 int scheme_to_double(value_t *v, double *out);
-int scheme_to_string(value_t *v, const char **out);
+int scheme_to_string(vm_t *vm, value_t *v, const char **out);
 int scheme_to_string_copy(value_t *v, char *buf, size_t len);
 
 value_t *scheme_list_car(value_t *v);
@@ -50,6 +73,7 @@ size_t scheme_vector_len(value_t *v);
 value_t *scheme_vector_get(vm_t *vm, value_t *v, size_t index);
 
 value_t *scheme_hash_get(vm_t *vm, value_t *hash, value_t *key);
+value_t *scheme_force(vm_t *vm, value_t *v);
 value_t *scheme_hash_set(vm_t *vm, value_t *hash, value_t *key, value_t *val);
 
 typedef value_t *(*scheme_native_func)(vm_t *vm, value_t *args);
@@ -58,6 +82,21 @@ int scheme_register_native(vm_t *vm, const char *name, scheme_native_func func);
 value_t *scheme_call(vm_t *vm, const char *func_name, value_t **args, size_t nargs);
 
 int scheme_json_parse(vm_t *vm, const char *json_str, value_t **result);
+int scheme_json_parse_arena(vm_t *vm, const char *json_str, value_t **result);
 int scheme_json_stringify(vm_t *vm, value_t *val, char *buf, size_t len);
+int scheme_json_write_fd(vm_t *vm, value_t *val, int fd);
+int scheme_json_write(vm_t *vm, value_t *val, int (*write)(void *ctx, const char *data, size_t len), void *ctx);
+
+json_push_t *scheme_json_push_create(vm_t *vm, json_event_fn handler, void *ctx, long build_depth);
+int scheme_json_push_feed(json_push_t *ps, const char *data, size_t len);
+int scheme_json_push_finish(json_push_t *ps);
+void scheme_json_push_destroy(json_push_t *ps);
+
+int scheme_cbor_encode(vm_t *vm, value_t *val, value_t **result);
+int scheme_cbor_write(vm_t *vm, value_t *val, int (*write)(void *ctx, const char *data, size_t len), void *ctx);
+int scheme_cbor_decode(vm_t *vm, const char *data, size_t len, value_t **result);
+int scheme_msgpack_encode(vm_t *vm, value_t *val, value_t **result);
+int scheme_msgpack_write(vm_t *vm, value_t *val, int (*write)(void *ctx, const char *data, size_t len), void *ctx);
+int scheme_msgpack_decode(vm_t *vm, const char *data, size_t len, value_t **result);
 
 #endif
\ No newline at end of file
@@ -1,9 +1,16 @@
 #include "vm.h"
 #include "value.h"
 #include "json.h"
+#include "jsonpath.h"
+#include "pack.h"
+#include "reader.h"
+#include "number.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
 
 static value_t *builtin_add(vm_t *vm, value_t *args) {
     uint64_t result = 0;
@@ -234,6 +241,7 @@ static value_t *builtin_car(vm_t *vm, value_t *args) {
         vm_set_error(vm, VERR_TYPE, "car: expected pair");
         return NULL;
     }
+    value_retain(pair->as.pair.car);
     return pair->as.pair.car;
 }
 
@@ -247,10 +255,12 @@ static value_t *builtin_cdr(vm_t *vm, value_t *args) {
         vm_set_error(vm, VERR_TYPE, "cdr: expected pair");
         return NULL;
     }
+    value_retain(pair->as.pair.cdr);
     return pair->as.pair.cdr;
 }
 
 static value_t *builtin_list(vm_t *vm, value_t *args) {
+    value_retain(args);
     return args;
 }
 
@@ -299,7 +309,7 @@ static value_t *builtin_vector_p(vm_t *vm, value_t *args) {
         vm_set_error(vm, VERR_ARGS, "vector?: expected 1 argument");
         return NULL;
     }
-    return value_bool(vm, value_is_vector(args->as.pair.car));
+    return value_bool(vm, value_is_vector(value_force(vm, args->as.pair.car)));
 }
 
 static value_t *builtin_hash_p(vm_t *vm, value_t *args) {
@@ -307,14 +317,24 @@ static value_t *builtin_hash_p(vm_t *vm, value_t *args) {
         vm_set_error(vm, VERR_ARGS, "hash?: expected 1 argument");
         return NULL;
     }
-    return value_bool(vm, value_is_hash(args->as.pair.car));
+    return value_bool(vm, value_is_hash(value_force(vm, args->as.pair.car)));
+}
+
+// Keys of other types are ignored by hash_set(); for these a failure means
+// memory ran out, and the allocator has already set the error.
+static int hash_key_valid(value_t *key) {
+    return value_is_string(key) || value_is_symbol(key) || value_is_number(key);
 }
 
 static value_t *builtin_vector(vm_t *vm, value_t *args) {
     value_t *vec = value_vector(vm);
+    if (!vec) return NULL;
     value_t *arg = args;
     while (!value_is_null(arg)) {
-        vector_push(vm, vec, arg->as.pair.car);
+        if (!vector_push(vm, vec, arg->as.pair.car)) {
+            value_release(vm, vec);
+            return NULL;
+        }
         arg = arg->as.pair.cdr;
     }
     return vec;
@@ -322,6 +342,7 @@ static value_t *builtin_vector(vm_t *vm, value_t *args) {
 
 static value_t *builtin_hash(vm_t *vm, value_t *args) {
     value_t *hash = value_hash(vm);
+    if (!hash) return NULL;
     value_t *arg = args;
     while (!value_is_null(arg)) {
         value_t *pair = arg->as.pair.car;
@@ -330,7 +351,10 @@ static value_t *builtin_hash(vm_t *vm, value_t *args) {
             value_release(vm, hash);
             return NULL;
         }
-        hash_set(vm, hash, pair->as.pair.car, pair->as.pair.cdr->as.pair.car);
+        if (!hash_set(vm, hash, pair->as.pair.car, pair->as.pair.cdr->as.pair.car) && hash_key_valid(pair->as.pair.car)) {
+            value_release(vm, hash);
+            return NULL;
+        }
         arg = arg->as.pair.cdr;
     }
     return hash;
@@ -341,7 +365,8 @@ static value_t *builtin_hash_set(vm_t *vm, value_t *args) {
         vm_set_error(vm, VERR_ARGS, "hash-set!: expected 3 arguments");
         return NULL;
     }
-    value_t *hash = args->as.pair.car;
+    value_t *hash = value_force(vm, args->as.pair.car);
+    if (!hash) return NULL;
     value_t *key = args->as.pair.cdr->as.pair.car;
     value_t *val = args->as.pair.cdr->as.pair.cdr->as.pair.car;
 
@@ -349,8 +374,49 @@ static value_t *builtin_hash_set(vm_t *vm, value_t *args) {
         vm_set_error(vm, VERR_TYPE, "hash-set!: expected hash");
         return NULL;
     }
+    if (value_in_arena(hash)) {
+        vm_set_error(vm, VERR_RUNTIME, "hash-set!: hash is read-only");
+        return NULL;
+    }
+
+    if (!hash_set(vm, hash, key, val) && hash_key_valid(key)) return NULL;
+    value_retain(hash);
+    return hash;
+}
+
+// (hash-set h key val) returns h with key bound to val, leaving h itself
+// alone. When the argument is the only reference to h nobody can observe
+// the difference, so the update happens in place instead of on a copy.
+static value_t *builtin_hash_set_copy(vm_t *vm, value_t *args) {
+    if (value_is_null(args) || value_is_null(args->as.pair.cdr) || value_is_null(args->as.pair.cdr->as.pair.cdr)) {
+        vm_set_error(vm, VERR_ARGS, "hash-set: expected 3 arguments");
+        return NULL;
+    }
+    value_t *hash = value_force(vm, args->as.pair.car);
+    if (!hash) return NULL;
+    value_t *key = args->as.pair.cdr->as.pair.car;
+    value_t *val = args->as.pair.cdr->as.pair.cdr->as.pair.car;
+
+    if (!value_is_hash(hash)) {
+        vm_set_error(vm, VERR_TYPE, "hash-set: expected hash");
+        return NULL;
+    }
 
-    return hash_set(vm, hash, key, val);
+    value_t *result;
+    // A forced value belongs to its lazy value, so it is never reused.
+    if (value_is_unique(hash) && hash == args->as.pair.car) {
+        result = hash;
+        value_retain(result);
+    } else {
+        result = hash_copy(vm, hash);
+    }
+    if (!result) return NULL;
+    if (!hash_set(vm, result, key, val)) {
+        value_release(vm, result);
+        if (!hash_key_valid(key)) vm_set_error(vm, VERR_TYPE, "hash-set: key must be a string, symbol or number");
+        return NULL;
+    }
+    return result;
 }
 
 static value_t *builtin_hash_ref(vm_t *vm, value_t *args) {
@@ -358,7 +424,8 @@ static value_t *builtin_hash_ref(vm_t *vm, value_t *args) {
         vm_set_error(vm, VERR_ARGS, "hash-ref: expected 2 arguments");
         return NULL;
     }
-    value_t *hash = args->as.pair.car;
+    value_t *hash = value_force(vm, args->as.pair.car);
+    if (!hash) return NULL;
     value_t *key = args->as.pair.cdr->as.pair.car;
 
     if (!value_is_hash(hash)) {
@@ -370,15 +437,38 @@ static value_t *builtin_hash_ref(vm_t *vm, value_t *args) {
     if (!val) {
         return value_null(vm);
     }
+    value_retain(val);
     return val;
 }
 
+static value_t *builtin_hash_remove(vm_t *vm, value_t *args) {
+    if (value_is_null(args) || value_is_null(args->as.pair.cdr)) {
+        vm_set_error(vm, VERR_ARGS, "hash-remove!: expected 2 arguments");
+        return NULL;
+    }
+    value_t *hash = value_force(vm, args->as.pair.car);
+    if (!hash) return NULL;
+    value_t *key = args->as.pair.cdr->as.pair.car;
+
+    if (!value_is_hash(hash)) {
+        vm_set_error(vm, VERR_TYPE, "hash-remove!: expected hash");
+        return NULL;
+    }
+    if (value_in_arena(hash)) {
+        vm_set_error(vm, VERR_RUNTIME, "hash-remove!: hash is read-only");
+        return NULL;
+    }
+
+    return value_bool(vm, hash_remove(vm, hash, key));
+}
+
 static value_t *builtin_vector_ref(vm_t *vm, value_t *args) {
     if (value_is_null(args) || value_is_null(args->as.pair.cdr)) {
         vm_set_error(vm, VERR_ARGS, "vector-ref: expected 2 arguments");
         return NULL;
     }
-    value_t *vec = args->as.pair.car;
+    value_t *vec = value_force(vm, args->as.pair.car);
+    if (!vec) return NULL;
     value_t *index = args->as.pair.cdr->as.pair.car;
 
     if (!value_is_vector(vec)) {
@@ -395,6 +485,7 @@ static value_t *builtin_vector_ref(vm_t *vm, value_t *args) {
         vm_set_error(vm, VERR_RUNTIME, "vector-ref: index out of bounds");
         return NULL;
     }
+    value_retain(val);
     return val;
 }
 
@@ -403,7 +494,8 @@ static value_t *builtin_vector_set(vm_t *vm, value_t *args) {
         vm_set_error(vm, VERR_ARGS, "vector-set!: expected 3 arguments");
         return NULL;
     }
-    value_t *vec = args->as.pair.car;
+    value_t *vec = value_force(vm, args->as.pair.car);
+    if (!vec) return NULL;
     value_t *index = args->as.pair.cdr->as.pair.car;
     value_t *val = args->as.pair.cdr->as.pair.cdr->as.pair.car;
 
@@ -411,6 +503,10 @@ static value_t *builtin_vector_set(vm_t *vm, value_t *args) {
         vm_set_error(vm, VERR_TYPE, "vector-set!: expected vector");
         return NULL;
     }
+    if (value_in_arena(vec)) {
+        vm_set_error(vm, VERR_RUNTIME, "vector-set!: vector is read-only");
+        return NULL;
+    }
     if (!value_is_number(index)) {
         vm_set_error(vm, VERR_TYPE, "vector-set!: expected number index");
         return NULL;
@@ -421,12 +517,53 @@ static value_t *builtin_vector_set(vm_t *vm, value_t *args) {
         return NULL;
     }
 
+    value_retain(val);
     value_release(vm, vec->as.vector.elements[index->as.number]);
     vec->as.vector.elements[index->as.number] = val;
     value_retain(val);
     return val;
 }
 
+// (vector-set vec index val) is the functional counterpart of vector-set!,
+// reusing vec in place when the argument is its only reference.
+static value_t *builtin_vector_set_copy(vm_t *vm, value_t *args) {
+    if (value_is_null(args) || value_is_null(args->as.pair.cdr) || value_is_null(args->as.pair.cdr->as.pair.cdr)) {
+        vm_set_error(vm, VERR_ARGS, "vector-set: expected 3 arguments");
+        return NULL;
+    }
+    value_t *vec = value_force(vm, args->as.pair.car);
+    if (!vec) return NULL;
+    value_t *index = args->as.pair.cdr->as.pair.car;
+    value_t *val = args->as.pair.cdr->as.pair.cdr->as.pair.car;
+
+    if (!value_is_vector(vec)) {
+        vm_set_error(vm, VERR_TYPE, "vector-set: expected vector");
+        return NULL;
+    }
+    if (!value_is_number(index)) {
+        vm_set_error(vm, VERR_TYPE, "vector-set: expected number index");
+        return NULL;
+    }
+    if (index->as.number >= vec->as.vector.size) {
+        vm_set_error(vm, VERR_RUNTIME, "vector-set: index out of bounds");
+        return NULL;
+    }
+
+    value_t *result;
+    if (value_is_unique(vec) && vec == args->as.pair.car) {
+        result = vec;
+        value_retain(result);
+    } else {
+        result = vector_copy(vm, vec);
+        if (!result) return NULL;
+    }
+
+    value_retain(val);
+    value_release(vm, result->as.vector.elements[index->as.number]);
+    result->as.vector.elements[index->as.number] = val;
+    return result;
+}
+
 static value_t *builtin_print(vm_t *vm, value_t *args) {
     if (value_is_null(args)) {
         printf("\n");
@@ -440,19 +577,21 @@ static value_t *builtin_print(vm_t *vm, value_t *args) {
     } else if (value_is_bool(arg)) {
         printf("%s\n", arg->as.boolean ? "#t" : "#f");
     } else if (value_is_number(arg)) {
-        if (arg->as.number == (double)arg->as.number) {
-            printf("%llu\n", (unsigned long long)arg->as.number);
-        } else {
-            printf("%g\n", arg->as.floating);
-        }
+        char num[NUMBER_TEXT_MAX];
+        size_t len = arg->flags & VALUE_DOUBLE ? number_format_double(arg->as.floating, num)
+                                                : number_format_uint(arg->as.number, num);
+        num[len] = '\n';
+        fwrite(num, 1, len + 1, stdout);
     } else if (value_is_string(arg)) {
-        printf("%s\n", arg->as.string);
+        fwrite(arg->as.string.data, 1, arg->as.string.len, stdout);
+        putchar('\n');
     } else if (value_is_symbol(arg)) {
-        printf("%s\n", arg->as.symbol);
+        printf("%s\n", arg->as.symbol.name);
     } else {
         printf("#<value>\n");
     }
 
+    value_retain(arg);
     return arg;
 }
 
@@ -467,7 +606,13 @@ static value_t *builtin_shell(vm_t *vm, value_t *args) {
         return NULL;
     }
 
-    FILE *fp = popen(cmd->as.string, "r");
+    const char *cmd_str = value_cstr(vm, cmd);
+    if (!cmd_str) {
+        vm_set_error(vm, VERR_RUNTIME, "shell: memory allocation failed");
+        return NULL;
+    }
+
+    FILE *fp = popen(cmd_str, "r");
     if (!fp) {
         vm_set_error(vm, VERR_RUNTIME, "shell: failed to execute command");
         return NULL;
@@ -476,7 +621,7 @@ static value_t *builtin_shell(vm_t *vm, value_t *args) {
     char buffer[4096];
     size_t total_size = 0;
     size_t capacity = 4096;
-    char *output = malloc(capacity);
+    char *output = gc_malloc(vm, capacity);
     if (!output) {
         pclose(fp);
         vm_set_error(vm, VERR_RUNTIME, "shell: memory allocation failed");
@@ -486,15 +631,15 @@ static value_t *builtin_shell(vm_t *vm, value_t *args) {
     size_t n;
     while ((n = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
         if (total_size + n >= capacity) {
-            capacity *= 2;
-            char *new_output = realloc(output, capacity);
+            char *new_output = gc_realloc(vm, output, capacity, capacity * 2);
             if (!new_output) {
-                free(output);
+                gc_free(vm, output);
                 pclose(fp);
                 vm_set_error(vm, VERR_RUNTIME, "shell: memory allocation failed");
                 return NULL;
             }
             output = new_output;
+            capacity *= 2;
         }
         memcpy(output + total_size, buffer, n);
         total_size += n;
@@ -503,8 +648,8 @@ static value_t *builtin_shell(vm_t *vm, value_t *args) {
     output[total_size] = '\0';
     pclose(fp);
 
-    value_t *result = value_string(vm, output);
-    free(output);
+    value_t *result = value_string_take(vm, output, total_size);
+    if (!result) gc_free(vm, output);
     return result;
 }
 
@@ -520,7 +665,7 @@ static value_t *builtin_curl_json(vm_t *vm, value_t *args) {
     }
 
     char cmd[1024];
-    snprintf(cmd, sizeof(cmd), "curl -s '%s'", url->as.string);
+    snprintf(cmd, sizeof(cmd), "curl -s '%.*s'", (int)url->as.string.len, url->as.string.data);
 
     FILE *fp = popen(cmd, "r");
     if (!fp) {
@@ -531,7 +676,7 @@ static value_t *builtin_curl_json(vm_t *vm, value_t *args) {
     char buffer[4096];
     size_t total_size = 0;
     size_t capacity = 4096;
-    char *output = malloc(capacity);
+    char *output = gc_malloc(vm, capacity);
     if (!output) {
         pclose(fp);
         vm_set_error(vm, VERR_RUNTIME, "curl-json: memory allocation failed");
@@ -541,15 +686,15 @@ static value_t *builtin_curl_json(vm_t *vm, value_t *args) {
     size_t n;
     while ((n = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
         if (total_size + n >= capacity) {
-            capacity *= 2;
-            char *new_output = realloc(output, capacity);
+            char *new_output = gc_realloc(vm, output, capacity, capacity * 2);
             if (!new_output) {
-                free(output);
+                gc_free(vm, output);
                 pclose(fp);
                 vm_set_error(vm, VERR_RUNTIME, "curl-json: memory allocation failed");
                 return NULL;
             }
             output = new_output;
+            capacity *= 2;
         }
         memcpy(output + total_size, buffer, n);
         total_size += n;
@@ -558,8 +703,15 @@ static value_t *builtin_curl_json(vm_t *vm, value_t *args) {
     output[total_size] = '\0';
     pclose(fp);
 
-    value_t *json_val = json_parse(vm, output);
-    free(output);
+    value_t *source = value_string_take(vm, output, total_size);
+    if (!source) {
+        gc_free(vm, output);
+        vm_set_error(vm, VERR_RUNTIME, "curl-json: memory allocation failed");
+        return NULL;
+    }
+
+    value_t *json_val = json_parse_source(vm, source);
+    value_release(vm, source);
     return json_val;
 }
 
@@ -573,7 +725,35 @@ static value_t *builtin_json_parse(vm_t *vm, value_t *args) {
         vm_set_error(vm, VERR_TYPE, "json-parse: expected string");
         return NULL;
     }
-    return json_parse(vm, str->as.string);
+    return json_parse_source(vm, str);
+}
+
+// (json-open path) maps a JSON file; containers are built on first use.
+static value_t *builtin_json_open(vm_t *vm, value_t *args) {
+    if (value_is_null(args)) {
+        vm_set_error(vm, VERR_ARGS, "json-open: expected 1 argument");
+        return NULL;
+    }
+    value_t *path = args->as.pair.car;
+    if (!value_is_string(path)) {
+        vm_set_error(vm, VERR_TYPE, "json-open: expected string path");
+        return NULL;
+    }
+    return json_open(vm, value_cstr(vm, path));
+}
+
+// (json-parse-arena str) parses into one arena freed with the document.
+static value_t *builtin_json_parse_arena(vm_t *vm, value_t *args) {
+    if (value_is_null(args)) {
+        vm_set_error(vm, VERR_ARGS, "json-parse-arena: expected 1 argument");
+        return NULL;
+    }
+    value_t *str = args->as.pair.car;
+    if (!value_is_string(str)) {
+        vm_set_error(vm, VERR_TYPE, "json-parse-arena: expected string");
+        return NULL;
+    }
+    return json_parse_arena(vm, str->as.string.data, str->as.string.len);
 }
 
 static value_t *builtin_json_stringify(vm_t *vm, value_t *args) {
@@ -585,6 +765,342 @@ static value_t *builtin_json_stringify(vm_t *vm, value_t *args) {
     return json_stringify(vm, val);
 }
 
+// (json-write value [fd-or-path]) streams value as JSON to an fd, a file
+// it creates, or standard output, without building the text first.
+static value_t *builtin_json_write(vm_t *vm, value_t *args) {
+    if (value_is_null(args)) {
+        vm_set_error(vm, VERR_ARGS, "json-write: expected 1 or 2 arguments");
+        return NULL;
+    }
+    value_t *val = args->as.pair.car;
+    value_t *target = value_is_null(args->as.pair.cdr) ? NULL : args->as.pair.cdr->as.pair.car;
+
+    int fd = 1;
+    if (target && value_is_string(target)) {
+        fd = open(value_cstr(vm, target), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (fd < 0) {
+            vm_set_error(vm, VERR_RUNTIME, "json-write: cannot open file");
+            return NULL;
+        }
+    } else if (target && value_is_number(target) && target->as.number == (double)target->as.number) {
+        fd = (int)target->as.number;
+    } else if (target) {
+        vm_set_error(vm, VERR_TYPE, "json-write: expected fd or path");
+        return NULL;
+    }
+    if (fd == 1) fflush(stdout);
+
+    json_writer_t w;
+    json_writer_init_fd(&w, vm, fd);
+    int ok = json_write(&w, val);
+    json_writer_free(&w);
+    if (target && value_is_string(target)) close(fd);
+    return ok ? value_bool(vm, 1) : NULL;
+}
+
+// Encodes to a string, or streams to an fd or a file it creates when given
+// one, like json-write.
+static value_t *pack_encode_args(vm_t *vm, value_t *args, pack_format_t format, const char *name) {
+    if (value_is_null(args) || (!value_is_null(args->as.pair.cdr) && !value_is_null(args->as.pair.cdr->as.pair.cdr))) {
+        vm_set_error(vm, VERR_ARGS, "%s: expected 1 or 2 arguments", name);
+        return NULL;
+    }
+    value_t *val = args->as.pair.car;
+    value_t *target = value_is_null(args->as.pair.cdr) ? NULL : args->as.pair.cdr->as.pair.car;
+    if (!target) return pack_encode(vm, format, val);
+
+    int fd;
+    if (value_is_string(target)) {
+        fd = open(value_cstr(vm, target), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (fd < 0) {
+            vm_set_error(vm, VERR_RUNTIME, "%s: cannot open file", name);
+            return NULL;
+        }
+    } else if (value_is_number(target)) {
+        fd = (int)target->as.number;
+    } else {
+        vm_set_error(vm, VERR_TYPE, "%s: expected fd or path", name);
+        return NULL;
+    }
+    if (fd == 1) fflush(stdout);
+
+    json_writer_t w;
+    json_writer_init_fd(&w, vm, fd);
+    int ok = pack_write(&w, format, val);
+    json_writer_free(&w);
+    if (value_is_string(target)) close(fd);
+    return ok ? value_bool(vm, 1) : NULL;
+}
+
+static value_t *pack_decode_args(vm_t *vm, value_t *args, pack_format_t format, const char *name) {
+    if (value_is_null(args) || !value_is_null(args->as.pair.cdr)) {
+        vm_set_error(vm, VERR_ARGS, "%s: expected 1 argument", name);
+        return NULL;
+    }
+    return pack_decode(vm, format, args->as.pair.car);
+}
+
+// (cbor-encode value [fd-or-path]) and (msgpack-encode value [fd-or-path])
+static value_t *builtin_cbor_encode(vm_t *vm, value_t *args) {
+    return pack_encode_args(vm, args, PACK_CBOR, "cbor-encode");
+}
+
+static value_t *builtin_msgpack_encode(vm_t *vm, value_t *args) {
+    return pack_encode_args(vm, args, PACK_MSGPACK, "msgpack-encode");
+}
+
+// (cbor-decode str) and (msgpack-decode str); strings in the result share
+// str's bytes.
+static value_t *builtin_cbor_decode(vm_t *vm, value_t *args) {
+    return pack_decode_args(vm, args, PACK_CBOR, "cbor-decode");
+}
+
+static value_t *builtin_msgpack_decode(vm_t *vm, value_t *args) {
+    return pack_decode_args(vm, args, PACK_MSGPACK, "msgpack-decode");
+}
+
+// (load source) evaluates every form of a file or fd as it is read and
+// returns the last value.
+static value_t *builtin_load(vm_t *vm, value_t *args) {
+    if (value_is_null(args)) {
+        vm_set_error(vm, VERR_ARGS, "load: expected 1 argument");
+        return NULL;
+    }
+    value_t *source = args->as.pair.car;
+
+    int fd;
+    if (value_is_string(source)) {
+        fd = open(value_cstr(vm, source), O_RDONLY);
+        if (fd < 0) {
+            vm_set_error(vm, VERR_RUNTIME, "load: cannot open file");
+            return NULL;
+        }
+    } else if (value_is_number(source)) {
+        fd = (int)source->as.number;
+    } else {
+        vm_set_error(vm, VERR_TYPE, "load: expected fd or path");
+        return NULL;
+    }
+
+    value_t *result = reader_eval_fd(vm, fd);
+    if (value_is_string(source)) close(fd);
+    return result;
+}
+
+// (load-data source) reads every form of a file or fd without evaluating
+// it and returns them, read-only, as a vector.
+static value_t *builtin_load_data(vm_t *vm, value_t *args) {
+    if (value_is_null(args)) {
+        vm_set_error(vm, VERR_ARGS, "load-data: expected 1 argument");
+        return NULL;
+    }
+    value_t *source = args->as.pair.car;
+
+    int fd;
+    if (value_is_string(source)) {
+        fd = open(value_cstr(vm, source), O_RDONLY);
+        if (fd < 0) {
+            vm_set_error(vm, VERR_RUNTIME, "load-data: cannot open file");
+            return NULL;
+        }
+    } else if (value_is_number(source)) {
+        fd = (int)source->as.number;
+    } else {
+        vm_set_error(vm, VERR_TYPE, "load-data: expected fd or path");
+        return NULL;
+    }
+
+    value_t *result = reader_load_data(vm, fd);
+    if (value_is_string(source)) close(fd);
+    return result;
+}
+
+typedef struct json_stream {
+    vm_t *vm;
+    value_t *handler;
+    value_t *events[JSON_EVENT_VALUE + 1];  // event names, as symbols
+} json_stream_t;
+
+static int json_stream_event(void *ctx, json_event_t event, value_t *value) {
+    json_stream_t *st = ctx;
+    vm_t *vm = st->vm;
+    value_t *rest = value_pair(vm, value ? value : value_null(vm), value_null(vm));
+    value_t *args = rest ? value_pair(vm, st->events[event], rest) : NULL;
+    value_release(vm, rest);
+    if (!args) return 0;
+    value_t *result = vm_apply(vm, st->handler, args);
+    value_release(vm, args);
+    if (!result) return 0;
+    value_release(vm, result);
+    return 1;
+}
+
+// (json-stream source handler [depth]) reads JSON from an fd or file in
+// 64 KB chunks and calls (handler event value) for each parse event:
+// start-object, end-object, start-array, end-array, key or value.
+// Containers nested depth deep are passed whole as value events, so
+// depth 1 yields each element of a top-level array in turn.
+static value_t *builtin_json_stream(vm_t *vm, value_t *args) {
+    if (value_is_null(args) || value_is_null(args->as.pair.cdr)) {
+        vm_set_error(vm, VERR_ARGS, "json-stream: expected 2 or 3 arguments");
+        return NULL;
+    }
+    value_t *source = args->as.pair.car;
+    value_t *handler = args->as.pair.cdr->as.pair.car;
+    value_t *rest = args->as.pair.cdr->as.pair.cdr;
+    value_t *depth = value_is_null(rest) ? NULL : rest->as.pair.car;
+
+    if (!value_is_callable(handler)) {
+        vm_set_error(vm, VERR_TYPE, "json-stream: expected procedure");
+        return NULL;
+    }
+    if (depth && !value_is_number(depth)) {
+        vm_set_error(vm, VERR_TYPE, "json-stream: expected number depth");
+        return NULL;
+    }
+
+    int fd;
+    if (value_is_string(source)) {
+        fd = open(value_cstr(vm, source), O_RDONLY);
+        if (fd < 0) {
+            vm_set_error(vm, VERR_RUNTIME, "json-stream: cannot open file");
+            return NULL;
+        }
+    } else if (value_is_number(source)) {
+        fd = (int)source->as.number;
+    } else {
+        vm_set_error(vm, VERR_TYPE, "json-stream: expected fd or path");
+        return NULL;
+    }
+
+    static const char *names[] = { "start-object", "end-object", "start-array", "end-array", "key", "value" };
+    json_stream_t st = { vm, handler };
+    for (int i = 0; i <= JSON_EVENT_VALUE; i++) st.events[i] = value_symbol(vm, names[i]);
+
+    json_push_t *ps = json_push_new(vm, json_stream_event, &st, depth ? (long)depth->as.number : -1);
+    char *buf = gc_malloc(vm, 65536);
+    int ok = ps && buf;
+    if (ps && !buf) vm_set_error(vm, VERR_RUNTIME, "out of memory");
+    while (ok) {
+        ssize_t n = read(fd, buf, 65536);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            vm_set_error(vm, VERR_RUNTIME, "json-stream: %s", strerror(errno));
+            ok = 0;
+        } else if (n == 0) {
+            ok = json_push_finish(ps);
+            break;
+        } else {
+            ok = json_push_feed(ps, buf, (size_t)n);
+        }
+    }
+
+    gc_free(vm, buf);
+    json_push_free(ps);
+    for (int i = 0; i <= JSON_EVENT_VALUE; i++) value_release(vm, st.events[i]);
+    if (value_is_string(source)) close(fd);
+    return ok ? value_bool(vm, 1) : NULL;
+}
+
+typedef struct ndjson_call {
+    vm_t *vm;
+    value_t *proc;
+    value_t *acc;     // ndjson-fold's accumulator, or NULL
+    uint64_t count;
+} ndjson_call_t;
+
+static int ndjson_record(void *ctx, value_t *record) {
+    ndjson_call_t *c = ctx;
+    vm_t *vm = c->vm;
+    value_t *rest = c->acc ? value_pair(vm, c->acc, value_null(vm)) : value_null(vm);
+    value_t *args = rest ? value_pair(vm, record, rest) : NULL;
+    value_release(vm, rest);
+    if (!args) return 0;
+    value_t *result = vm_apply(vm, c->proc, args);
+    value_release(vm, args);
+    if (!result) return 0;
+    if (c->acc) {
+        value_release(vm, c->acc);
+        c->acc = result;
+    } else {
+        value_release(vm, result);
+    }
+    c->count++;
+    return 1;
+}
+
+// Reads records from a path, an fd or (shell "command") output.
+static int ndjson_run(vm_t *vm, const char *name, value_t *source, ndjson_call_t *c) {
+    if (!value_is_callable(c->proc)) {
+        vm_set_error(vm, VERR_TYPE, "%s: expected procedure", name);
+        return 0;
+    }
+
+    FILE *pipe = NULL;
+    int fd;
+    if (value_is_string(source)) {
+        fd = open(value_cstr(vm, source), O_RDONLY);
+        if (fd < 0) {
+            vm_set_error(vm, VERR_RUNTIME, "%s: cannot open file", name);
+            return 0;
+        }
+    } else if (value_is_number(source)) {
+        fd = (int)source->as.number;
+    } else if (value_is_pair(source) && value_is_symbol(source->as.pair.car) &&
+               strcmp(source->as.pair.car->as.symbol.name, "shell") == 0 &&
+               value_is_pair(source->as.pair.cdr) && value_is_string(source->as.pair.cdr->as.pair.car)) {
+        fflush(stdout);
+        pipe = popen(value_cstr(vm, source->as.pair.cdr->as.pair.car), "r");
+        if (!pipe) {
+            vm_set_error(vm, VERR_RUNTIME, "%s: failed to execute command", name);
+            return 0;
+        }
+        fd = fileno(pipe);
+    } else {
+        vm_set_error(vm, VERR_TYPE, "%s: expected path, fd or (shell command)", name);
+        return 0;
+    }
+
+    int ok = json_read_lines(vm, fd, ndjson_record, c);
+    if (pipe) {
+        pclose(pipe);
+    } else if (value_is_string(source)) {
+        close(fd);
+    }
+    return ok;
+}
+
+// (ndjson-for-each source proc) calls (proc record) for each line of
+// newline-delimited JSON and returns the number of records. Records are
+// freed as soon as proc returns unless it keeps them.
+static value_t *builtin_ndjson_for_each(vm_t *vm, value_t *args) {
+    if (value_is_null(args) || value_is_null(args->as.pair.cdr) || !value_is_null(args->as.pair.cdr->as.pair.cdr)) {
+        vm_set_error(vm, VERR_ARGS, "ndjson-for-each: expected 2 arguments");
+        return NULL;
+    }
+    ndjson_call_t c = { vm, args->as.pair.cdr->as.pair.car, NULL, 0 };
+    if (!ndjson_run(vm, "ndjson-for-each", args->as.pair.car, &c)) return NULL;
+    return value_number(vm, c.count);
+}
+
+// (ndjson-fold source proc init) threads (proc record acc) through the
+// records like SRFI-1 fold and returns the final accumulator.
+static value_t *builtin_ndjson_fold(vm_t *vm, value_t *args) {
+    if (value_is_null(args) || value_is_null(args->as.pair.cdr) || value_is_null(args->as.pair.cdr->as.pair.cdr) ||
+        !value_is_null(args->as.pair.cdr->as.pair.cdr->as.pair.cdr)) {
+        vm_set_error(vm, VERR_ARGS, "ndjson-fold: expected 3 arguments");
+        return NULL;
+    }
+    ndjson_call_t c = { vm, args->as.pair.cdr->as.pair.car, args->as.pair.cdr->as.pair.cdr->as.pair.car, 0 };
+    value_retain(c.acc);
+    int ok = ndjson_run(vm, "ndjson-fold", args->as.pair.car, &c);
+    if (!ok) {
+        value_release(vm, c.acc);
+        return NULL;
+    }
+    return c.acc;
+}
+
 static value_t *builtin_json_select(vm_t *vm, value_t *args) {
     if (value_is_null(args) || value_is_null(args->as.pair.cdr)) {
         vm_set_error(vm, VERR_ARGS, "json-select: expected 2 arguments");
@@ -592,7 +1108,56 @@ static value_t *builtin_json_select(vm_t *vm, value_t *args) {
     }
     value_t *obj = args->as.pair.car;
     value_t *path = args->as.pair.cdr->as.pair.car;
-    return json_select(vm, obj, path);
+    value_t *result = json_select(vm, obj, path);
+    value_retain(result);
+    return result;
+}
+
+// (json-path-compile expr) compiles a JSONPath selector for reuse.
+static value_t *builtin_json_path_compile(vm_t *vm, value_t *args) {
+    if (value_is_null(args) || !value_is_null(args->as.pair.cdr)) {
+        vm_set_error(vm, VERR_ARGS, "json-path-compile: expected 1 argument");
+        return NULL;
+    }
+    value_t *expr = args->as.pair.car;
+    if (!value_is_string(expr)) {
+        vm_set_error(vm, VERR_TYPE, "json-path-compile: expected string");
+        return NULL;
+    }
+    return json_path_compile(vm, expr->as.string.data, expr->as.string.len);
+}
+
+// Takes a compiled path, or compiles a string expression for one use.
+static value_t *json_path_arg(vm_t *vm, value_t *path) {
+    if (value_is_string(path)) return json_path_compile(vm, path->as.string.data, path->as.string.len);
+    value_retain(path);
+    return path;
+}
+
+// (json-path-apply path doc) returns a vector of the matches in doc.
+static value_t *builtin_json_path_apply(vm_t *vm, value_t *args) {
+    if (value_is_null(args) || value_is_null(args->as.pair.cdr) || !value_is_null(args->as.pair.cdr->as.pair.cdr)) {
+        vm_set_error(vm, VERR_ARGS, "json-path-apply: expected 2 arguments");
+        return NULL;
+    }
+    value_t *path = json_path_arg(vm, args->as.pair.car);
+    if (!path) return NULL;
+    value_t *result = json_path_apply(vm, path, args->as.pair.cdr->as.pair.car);
+    value_release(vm, path);
+    return result;
+}
+
+// (json-path-apply-each path docs) applies path to each document in a vector.
+static value_t *builtin_json_path_apply_each(vm_t *vm, value_t *args) {
+    if (value_is_null(args) || value_is_null(args->as.pair.cdr) || !value_is_null(args->as.pair.cdr->as.pair.cdr)) {
+        vm_set_error(vm, VERR_ARGS, "json-path-apply-each: expected 2 arguments");
+        return NULL;
+    }
+    value_t *path = json_path_arg(vm, args->as.pair.car);
+    if (!path) return NULL;
+    value_t *result = json_path_apply_each(vm, path, args->as.pair.cdr->as.pair.car);
+    value_release(vm, path);
+    return result;
 }
 
 static value_t *builtin_string_append(vm_t *vm, value_t *args) {
@@ -604,29 +1169,163 @@ static value_t *builtin_string_append(vm_t *vm, value_t *args) {
             vm_set_error(vm, VERR_TYPE, "string-append: expected strings");
             return NULL;
         }
-        total_len += strlen(str->as.string);
+        total_len += str->as.string.len;
         arg = arg->as.pair.cdr;
     }
 
-    char *result = malloc(total_len + 1);
+    // A first string nobody else can see, owning its buffer, is extended
+    // in place rather than copied.
+    value_t *first = value_is_null(args) ? NULL : args->as.pair.car;
+    if (first && value_is_unique(first) && !first->as.string.parent) {
+        char *buf = vm_realloc(vm, VTYPE_STRING, first->as.string.data, first->as.string.len + 1, total_len + 1);
+        if (!buf) return NULL;
+        first->as.string.data = buf;
+        size_t pos = first->as.string.len;
+        for (arg = args->as.pair.cdr; !value_is_null(arg); arg = arg->as.pair.cdr) {
+            value_t *str = arg->as.pair.car;
+            memcpy(buf + pos, str->as.string.data, str->as.string.len);
+            pos += str->as.string.len;
+        }
+        buf[pos] = '\0';
+        first->as.string.len = pos;
+        value_retain(first);
+        return first;
+    }
+
+    char *result = gc_malloc(vm, total_len + 1);
     if (!result) {
         vm_set_error(vm, VERR_RUNTIME, "string-append: memory allocation failed");
         return NULL;
     }
 
-    result[0] = '\0';
+    size_t pos = 0;
     arg = args;
     while (!value_is_null(arg)) {
         value_t *str = arg->as.pair.car;
-        strcat(result, str->as.string);
+        memcpy(result + pos, str->as.string.data, str->as.string.len);
+        pos += str->as.string.len;
         arg = arg->as.pair.cdr;
     }
+    result[pos] = '\0';
 
-    value_t *val = value_string(vm, result);
-    free(result);
+    value_t *val = value_string_take(vm, result, total_len);
+    if (!val) gc_free(vm, result);
     return val;
 }
 
+static value_t *builtin_string_length(vm_t *vm, value_t *args) {
+    if (value_is_null(args)) {
+        vm_set_error(vm, VERR_ARGS, "string-length: expected 1 argument");
+        return NULL;
+    }
+    value_t *str = args->as.pair.car;
+    if (!value_is_string(str)) {
+        vm_set_error(vm, VERR_TYPE, "string-length: expected string");
+        return NULL;
+    }
+    return value_number(vm, str->as.string.len);
+}
+
+static value_t *builtin_substring(vm_t *vm, value_t *args) {
+    if (value_is_null(args) || value_is_null(args->as.pair.cdr)) {
+        vm_set_error(vm, VERR_ARGS, "substring: expected 2 or 3 arguments");
+        return NULL;
+    }
+    value_t *str = args->as.pair.car;
+    value_t *start = args->as.pair.cdr->as.pair.car;
+    value_t *rest = args->as.pair.cdr->as.pair.cdr;
+
+    if (!value_is_string(str)) {
+        vm_set_error(vm, VERR_TYPE, "substring: expected string");
+        return NULL;
+    }
+    if (!value_is_number(start)) {
+        vm_set_error(vm, VERR_TYPE, "substring: expected number start");
+        return NULL;
+    }
+
+    uint64_t end = str->as.string.len;
+    if (!value_is_null(rest)) {
+        if (!value_is_number(rest->as.pair.car)) {
+            vm_set_error(vm, VERR_TYPE, "substring: expected number end");
+            return NULL;
+        }
+        end = rest->as.pair.car->as.number;
+    }
+
+    if (start->as.number > end || end > str->as.string.len) {
+        vm_set_error(vm, VERR_RUNTIME, "substring: index out of bounds");
+        return NULL;
+    }
+
+    return value_string_slice(vm, str, (size_t)start->as.number, (size_t)(end - start->as.number));
+}
+
+static int is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static value_t *builtin_string_split(vm_t *vm, value_t *args) {
+    if (value_is_null(args)) {
+        vm_set_error(vm, VERR_ARGS, "string-split: expected 1 or 2 arguments");
+        return NULL;
+    }
+    value_t *str = args->as.pair.car;
+    value_t *sep = value_is_null(args->as.pair.cdr) ? NULL : args->as.pair.cdr->as.pair.car;
+
+    if (!value_is_string(str)) {
+        vm_set_error(vm, VERR_TYPE, "string-split: expected string");
+        return NULL;
+    }
+    if (sep && (!value_is_string(sep) || sep->as.string.len == 0)) {
+        vm_set_error(vm, VERR_TYPE, "string-split: expected non-empty string separator");
+        return NULL;
+    }
+
+    value_t *vec = value_vector(vm);
+    if (!vec) return NULL;
+
+    const char *data = str->as.string.data;
+    size_t len = str->as.string.len;
+    size_t pos = 0;
+
+    while (pos <= len) {
+        size_t start, end;
+        if (sep) {
+            // Split on every occurrence of sep, keeping empty fields.
+            const char *hit = NULL;
+            if (len - pos >= sep->as.string.len) {
+                hit = memmem(data + pos, len - pos, sep->as.string.data, sep->as.string.len);
+            }
+            start = pos;
+            end = hit ? (size_t)(hit - data) : len;
+            pos = hit ? end + sep->as.string.len : len + 1;
+        } else {
+            // Split on runs of whitespace, dropping empty fields.
+            while (pos < len && is_space(data[pos])) pos++;
+            if (pos == len) break;
+            start = pos;
+            while (pos < len && !is_space(data[pos])) pos++;
+            end = pos;
+        }
+
+        value_t *field = value_string_slice(vm, str, start, end - start);
+        if (!field || !vector_push(vm, vec, field)) {
+            value_release(vm, field);
+            value_release(vm, vec);
+            vm_set_error(vm, VERR_RUNTIME, "string-split: memory allocation failed");
+            return NULL;
+        }
+        value_release(vm, field);
+    }
+
+    return vec;
+}
+
+static value_t *builtin_gc(vm_t *vm, value_t *args) {
+    return value_number(vm, gc_collect(vm));
+}
+
 void vm_register_builtins(vm_t *vm) {
     vm_register_native(vm, "+", builtin_add);
     vm_register_native(vm, "-", builtin_sub);
@@ -649,14 +1348,36 @@ void vm_register_builtins(vm_t *vm) {
     vm_register_native(vm, "vector", builtin_vector);
     vm_register_native(vm, "hash", builtin_hash);
     vm_register_native(vm, "hash-set!", builtin_hash_set);
+    vm_register_native(vm, "hash-set", builtin_hash_set_copy);
     vm_register_native(vm, "hash-ref", builtin_hash_ref);
+    vm_register_native(vm, "hash-remove!", builtin_hash_remove);
     vm_register_native(vm, "vector-ref", builtin_vector_ref);
     vm_register_native(vm, "vector-set!", builtin_vector_set);
+    vm_register_native(vm, "vector-set", builtin_vector_set_copy);
     vm_register_native(vm, "print", builtin_print);
     vm_register_native(vm, "shell", builtin_shell);
     vm_register_native(vm, "curl-json", builtin_curl_json);
     vm_register_native(vm, "json-parse", builtin_json_parse);
+    vm_register_native(vm, "json-parse-arena", builtin_json_parse_arena);
+    vm_register_native(vm, "json-open", builtin_json_open);
     vm_register_native(vm, "json-stringify", builtin_json_stringify);
+    vm_register_native(vm, "json-write", builtin_json_write);
+    vm_register_native(vm, "json-stream", builtin_json_stream);
     vm_register_native(vm, "json-select", builtin_json_select);
+    vm_register_native(vm, "ndjson-for-each", builtin_ndjson_for_each);
+    vm_register_native(vm, "ndjson-fold", builtin_ndjson_fold);
+    vm_register_native(vm, "cbor-encode", builtin_cbor_encode);
+    vm_register_native(vm, "cbor-decode", builtin_cbor_decode);
+    vm_register_native(vm, "msgpack-encode", builtin_msgpack_encode);
+    vm_register_native(vm, "msgpack-decode", builtin_msgpack_decode);
+    vm_register_native(vm, "load", builtin_load);
+    vm_register_native(vm, "load-data", builtin_load_data);
+    vm_register_native(vm, "json-path-compile", builtin_json_path_compile);
+    vm_register_native(vm, "json-path-apply", builtin_json_path_apply);
+    vm_register_native(vm, "json-path-apply-each", builtin_json_path_apply_each);
     vm_register_native(vm, "string-append", builtin_string_append);
+    vm_register_native(vm, "string-length", builtin_string_length);
+    vm_register_native(vm, "substring", builtin_substring);
+    vm_register_native(vm, "string-split", builtin_string_split);
+    vm_register_native(vm, "gc", builtin_gc);
 }
\ No newline at end of file
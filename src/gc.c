@@ -0,0 +1,442 @@
+#include "gc.h"
+#include "vm.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+
+/*
+ * Reference counting frees everything except cycles, such as a closure
+ * stored in the environment it captured. The collector is the synchronous
+ * algorithm of Bacon and Rajan: a container whose count drops to a nonzero
+ * value is buffered as a possible root (purple). A collection then
+ * subtracts the references internal to the subgraphs below the roots
+ * (gray); anything left with a nonzero count is reachable from outside and
+ * is restored (black), and the rest is a garbage cycle (white) and freed.
+ *
+ * Every reference held from C must be counted, since the collector cannot
+ * see the C stack. Automatic collections only run between evaluations,
+ * where the evaluator holds nothing borrowed.
+ */
+
+static void reclaimer_flush(gc_reclaimer_t *r);
+
+static void *mem_malloc(gc_allocator_t *a, size_t size) {
+    return a->malloc_fn ? a->malloc_fn(a->ctx, size) : malloc(size);
+}
+
+static void *mem_realloc(gc_allocator_t *a, void *p, size_t old_size, size_t new_size) {
+    return a->malloc_fn ? a->realloc_fn(a->ctx, p, old_size, new_size) : realloc(p, new_size);
+}
+
+static void mem_free(gc_allocator_t *a, void *p) {
+    if (!a->malloc_fn) {
+        free(p);
+    } else if (a->free_fn && p) {
+        a->free_fn(a->ctx, p);
+    }
+}
+
+// Allocates from the VM's allocator; a NULL vm uses the C library.
+void *gc_malloc(vm_t *vm, size_t size) {
+    return vm ? mem_malloc(&vm->gc.alloc, size) : malloc(size);
+}
+
+void *gc_realloc(vm_t *vm, void *p, size_t old_size, size_t new_size) {
+    return vm ? mem_realloc(&vm->gc.alloc, p, old_size, new_size) : realloc(p, new_size);
+}
+
+static void gc_grow(gc_t *gc, value_t ***items, size_t *cap) {
+    size_t new_cap = *cap ? *cap * 2 : 256;
+    value_t **new_items = mem_realloc(&gc->alloc, *items, *cap * sizeof(value_t *), new_cap * sizeof(value_t *));
+    if (!new_items) {
+        // Counts are inconsistent mid-collection; there is no way back.
+        fprintf(stderr, "pscm: out of memory in cycle collector\n");
+        abort();
+    }
+    *items = new_items;
+    *cap = new_cap;
+}
+
+static inline void gc_push(gc_t *gc, value_t *v) {
+    if (gc->nstack == gc->stack_cap) gc_grow(gc, &gc->stack, &gc->stack_cap);
+    gc->stack[gc->nstack++] = v;
+}
+
+void gc_init(gc_t *gc) {
+    gc->roots = NULL;
+    gc->nroots = 0;
+    gc->roots_cap = 0;
+    gc->threshold = GC_DEFAULT_THRESHOLD;
+    gc->stack = NULL;
+    gc->nstack = 0;
+    gc->stack_cap = 0;
+    gc->garbage = NULL;
+    gc->ngarbage = 0;
+    gc->garbage_cap = 0;
+    gc->stats = (gc_stats_t){0};
+    gc->pending = NULL;
+    gc->npending = 0;
+    gc->pending_cap = 0;
+    gc->budget = 0;
+    gc->draining = 0;
+    gc->depth = 0;
+    gc->destroyed = 0;
+    gc->pool_free = NULL;
+    gc->pool_next = NULL;
+    gc->pool_end = NULL;
+    gc->chunks = NULL;
+    gc->reclaimer = NULL;
+    gc->alloc = (gc_allocator_t){0};
+}
+
+void gc_buffer(vm_t *vm, value_t *v) {
+    gc_t *gc = &vm->gc;
+    if (gc->nroots == gc->roots_cap) {
+        size_t new_cap = gc->roots_cap ? gc->roots_cap * 2 : 256;
+        value_t **new_roots = mem_realloc(&gc->alloc, gc->roots, gc->roots_cap * sizeof(value_t *),
+                                          new_cap * sizeof(value_t *));
+        // Without room the value is simply not considered this time.
+        if (!new_roots) return;
+        gc->roots = new_roots;
+        gc->roots_cap = new_cap;
+    }
+    v->flags |= VALUE_BUFFERED;
+    gc->roots[gc->nroots++] = v;
+}
+
+// Trial deletion: remove the counts contributed by internal references.
+static void mark_gray_child(value_t *child, void *ctx) {
+    child->refcount--;
+    if (child->color != GC_GRAY) {
+        child->color = GC_GRAY;
+        gc_push(ctx, child);
+    }
+}
+
+static void mark_gray(gc_t *gc, value_t *v) {
+    if (v->color == GC_GRAY) return;
+    v->color = GC_GRAY;
+    gc_push(gc, v);
+    while (gc->nstack) {
+        value_children(gc->stack[--gc->nstack], mark_gray_child, gc);
+    }
+}
+
+// Restores the counts below a value that turned out to be reachable.
+static void scan_black_child(value_t *child, void *ctx) {
+    child->refcount++;
+    if (child->color != GC_BLACK) {
+        child->color = GC_BLACK;
+        gc_push(ctx, child);
+    }
+}
+
+static void scan_black(gc_t *gc, value_t *v) {
+    size_t base = gc->nstack;
+    v->color = GC_BLACK;
+    gc_push(gc, v);
+    while (gc->nstack > base) {
+        value_children(gc->stack[--gc->nstack], scan_black_child, gc);
+    }
+}
+
+static void scan_child(value_t *child, void *ctx) {
+    gc_push(ctx, child);
+}
+
+static void scan(gc_t *gc, value_t *v) {
+    gc_push(gc, v);
+    while (gc->nstack) {
+        value_t *s = gc->stack[--gc->nstack];
+        if (s->color != GC_GRAY) continue;
+        if (s->refcount > 0) {
+            scan_black(gc, s);
+        } else {
+            s->color = GC_WHITE;
+            value_children(s, scan_child, gc);
+        }
+    }
+}
+
+// Gathers a garbage cycle. Freeing waits until every white value has been
+// visited, since members of one cycle point at each other.
+static void collect_white_child(value_t *child, void *ctx) {
+    if (child->color == GC_WHITE && !(child->flags & VALUE_BUFFERED)) {
+        child->color = GC_BLACK;
+        gc_push(ctx, child);
+    }
+}
+
+static void collect_white(vm_t *vm, value_t *v) {
+    gc_t *gc = &vm->gc;
+    if (v->color != GC_WHITE) return;
+    v->color = GC_BLACK;
+    gc_push(gc, v);
+    while (gc->nstack) {
+        value_t *s = gc->stack[--gc->nstack];
+        value_children(s, collect_white_child, gc);
+        value_release_arena_children(vm, s);
+        if (gc->ngarbage == gc->garbage_cap) gc_grow(gc, &gc->garbage, &gc->garbage_cap);
+        gc->garbage[gc->ngarbage++] = s;
+    }
+}
+
+static uint64_t gc_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// Frees every garbage cycle reachable from the buffered roots and returns
+// the number of values freed.
+size_t gc_collect(vm_t *vm) {
+    gc_t *gc = &vm->gc;
+    uint64_t start = gc_now_ns();
+
+    // Drop roots that were retained or freed since they were buffered.
+    size_t n = 0;
+    for (size_t i = 0; i < gc->nroots; i++) {
+        value_t *v = gc->roots[i];
+        if (v->color == GC_PURPLE && v->refcount > 0) {
+            mark_gray(gc, v);
+            gc->roots[n++] = v;
+        } else {
+            v->flags &= ~VALUE_BUFFERED;
+            // Dead values still pending are freed by gc_reclaim().
+            if (v->color == GC_BLACK && v->refcount == 0 && !(v->flags & VALUE_PENDING)) {
+                value_free(vm, v);
+            }
+        }
+    }
+    gc->nroots = n;
+
+    for (size_t i = 0; i < gc->nroots; i++) {
+        scan(gc, gc->roots[i]);
+    }
+
+    for (size_t i = 0; i < gc->nroots; i++) {
+        gc->roots[i]->flags &= ~VALUE_BUFFERED;
+        collect_white(vm, gc->roots[i]);
+    }
+    gc->nroots = 0;
+
+    size_t freed = gc->ngarbage;
+    for (size_t i = 0; i < gc->ngarbage; i++) {
+        value_free(vm, gc->garbage[i]);
+    }
+    gc->ngarbage = 0;
+    if (gc->reclaimer) reclaimer_flush(gc->reclaimer);
+
+    uint64_t pause = gc_now_ns() - start;
+    gc->stats.collections++;
+    gc->stats.freed += freed;
+    gc->stats.total_ns += pause;
+    gc->stats.last_pause_ns = pause;
+    if (pause > gc->stats.max_pause_ns) gc->stats.max_pause_ns = pause;
+    return freed;
+}
+
+/*
+ * Values whose count reaches zero go on a work list instead of releasing
+ * their children recursively, so dropping a deep list does not overflow
+ * the C stack. By default the list is drained before value_release()
+ * returns. With a budget, release only queues and each evaluation step
+ * frees at most that many values, spreading the cost of dropping a large
+ * document over the steps that follow; scheme_reclaim() finishes the job at
+ * a convenient point. Counts are not atomic, so the graph walk always runs
+ * on the VM's thread, but with a reclaimer the free() calls themselves are
+ * handed to a background thread in batches.
+ */
+
+#define GC_RELEASE_DEPTH 64
+#define GC_BATCH_SIZE 4096
+
+typedef struct gc_batch {
+    struct gc_batch *next;
+    size_t n;
+    void *blocks[GC_BATCH_SIZE];
+} gc_batch_t;
+
+struct gc_reclaimer {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    gc_batch_t *queue;       // full batches waiting for the thread
+    gc_batch_t *spare;       // emptied batches handed back for reuse
+    gc_batch_t *current;     // batch being filled by the VM thread
+    gc_allocator_t alloc;    // frees blocks the way the VM allocated them
+    int stop;
+};
+
+void gc_defer(vm_t *vm, value_t *v) {
+    gc_t *gc = &vm->gc;
+
+    // Shallow graphs are still freed depth first, which keeps each value
+    // in cache between its decrement and its free.
+    if ((!gc->budget || gc->draining) && gc->depth < GC_RELEASE_DEPTH) {
+        gc->depth++;
+        gc->destroyed++;
+        value_destroy(vm, v);
+        gc->depth--;
+        if (gc->depth == 0 && gc->npending && !gc->draining) gc_reclaim(vm, 0);
+        return;
+    }
+
+    if (gc->npending == gc->pending_cap) {
+        size_t new_cap = gc->pending_cap ? gc->pending_cap * 2 : 256;
+        value_t **new_pending = mem_realloc(&gc->alloc, gc->pending, gc->pending_cap * sizeof(value_t *),
+                                            new_cap * sizeof(value_t *));
+        if (!new_pending) {
+            value_destroy(vm, v);
+            return;
+        }
+        gc->pending = new_pending;
+        gc->pending_cap = new_cap;
+    }
+    v->flags |= VALUE_PENDING;
+    gc->pending[gc->npending++] = v;
+}
+
+static void reclaimer_flush(gc_reclaimer_t *r) {
+    if (!r->current || r->current->n == 0) return;
+    pthread_mutex_lock(&r->lock);
+    r->current->next = r->queue;
+    r->queue = r->current;
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    r->current = NULL;
+}
+
+// Frees up to budget pending values (all of them if budget is 0) and
+// returns the number freed.
+size_t gc_reclaim(vm_t *vm, size_t budget) {
+    gc_t *gc = &vm->gc;
+    if (gc->draining) return 0;
+
+    gc->draining = 1;
+    uint64_t start = gc->destroyed;
+    while (gc->npending && (!budget || gc->destroyed - start < budget)) {
+        gc->destroyed++;
+        value_destroy(vm, gc->pending[--gc->npending]);
+    }
+    gc->draining = 0;
+
+    if (gc->reclaimer) reclaimer_flush(gc->reclaimer);
+    return gc->destroyed - start;
+}
+
+void gc_free(vm_t *vm, void *p) {
+    if (!vm) {
+        free(p);
+        return;
+    }
+    gc_reclaimer_t *r = vm->gc.reclaimer;
+    if (!r || !p) {
+        mem_free(&vm->gc.alloc, p);
+        return;
+    }
+    if (!r->current) {
+        pthread_mutex_lock(&r->lock);
+        r->current = r->spare;
+        if (r->current) r->spare = r->current->next;
+        pthread_mutex_unlock(&r->lock);
+        if (!r->current) r->current = malloc(sizeof(gc_batch_t));
+        if (!r->current) {
+            mem_free(&vm->gc.alloc, p);
+            return;
+        }
+        r->current->n = 0;
+    }
+    r->current->blocks[r->current->n++] = p;
+    if (r->current->n == GC_BATCH_SIZE) reclaimer_flush(r);
+}
+
+static void *reclaimer_main(void *arg) {
+    gc_reclaimer_t *r = arg;
+    pthread_mutex_lock(&r->lock);
+    for (;;) {
+        while (!r->queue && !r->stop) pthread_cond_wait(&r->cond, &r->lock);
+        gc_batch_t *batch = r->queue;
+        r->queue = NULL;
+        if (!batch && r->stop) break;
+        pthread_mutex_unlock(&r->lock);
+
+        gc_batch_t *last = batch;
+        for (gc_batch_t *b = batch; b; b = b->next) {
+            for (size_t i = 0; i < b->n; i++) mem_free(&r->alloc, b->blocks[i]);
+            last = b;
+        }
+
+        pthread_mutex_lock(&r->lock);
+        last->next = r->spare;
+        r->spare = batch;
+    }
+    pthread_mutex_unlock(&r->lock);
+
+    while (r->spare) {
+        gc_batch_t *next = r->spare->next;
+        free(r->spare);
+        r->spare = next;
+    }
+    return NULL;
+}
+
+// Starts or stops the background reclaimer. Stopping waits until every
+// block handed to it has been freed.
+int gc_set_reclaimer(vm_t *vm, int enable) {
+    gc_reclaimer_t *r = vm->gc.reclaimer;
+    if (enable && !r) {
+        r = calloc(1, sizeof(gc_reclaimer_t));
+        if (!r) return 0;
+        r->alloc = vm->gc.alloc;
+        pthread_mutex_init(&r->lock, NULL);
+        pthread_cond_init(&r->cond, NULL);
+        if (pthread_create(&r->thread, NULL, reclaimer_main, r) != 0) {
+            pthread_mutex_destroy(&r->lock);
+            pthread_cond_destroy(&r->cond);
+            free(r);
+            return 0;
+        }
+        vm->gc.reclaimer = r;
+    } else if (!enable && r) {
+        reclaimer_flush(r);
+        pthread_mutex_lock(&r->lock);
+        r->stop = 1;
+        pthread_cond_signal(&r->cond);
+        pthread_mutex_unlock(&r->lock);
+        pthread_join(r->thread, NULL);
+        pthread_mutex_destroy(&r->lock);
+        pthread_cond_destroy(&r->cond);
+        free(r);
+        vm->gc.reclaimer = NULL;
+    }
+    return 1;
+}
+
+value_t *gc_pool_grow(gc_t *gc) {
+    gc_chunk_t *chunk = mem_malloc(&gc->alloc, sizeof(gc_chunk_t));
+    if (!chunk) return NULL;
+    chunk->next = gc->chunks;
+    gc->chunks = chunk;
+    gc->pool_next = chunk->values + 1;
+    gc->pool_end = chunk->values + GC_POOL_CHUNK;
+    return chunk->values;
+}
+
+void gc_destroy(vm_t *vm) {
+    gc_reclaim(vm, 0);
+    gc_collect(vm);
+    gc_set_reclaimer(vm, 0);
+    mem_free(&vm->gc.alloc, vm->gc.roots);
+    mem_free(&vm->gc.alloc, vm->gc.stack);
+    mem_free(&vm->gc.alloc, vm->gc.garbage);
+    mem_free(&vm->gc.alloc, vm->gc.pending);
+
+    // Values still referenced from C are invalid once the VM is gone.
+    while (vm->gc.chunks) {
+        gc_chunk_t *next = vm->gc.chunks->next;
+        mem_free(&vm->gc.alloc, vm->gc.chunks);
+        vm->gc.chunks = next;
+    }
+}
@@ -0,0 +1,105 @@
+#ifndef GC_H
+#define GC_H
+
+#include "value.h"
+
+// Cycle collector colors
+enum {
+    GC_BLACK,   // in use, or freed
+    GC_GRAY,    // possible member of a cycle
+    GC_WHITE,   // member of a garbage cycle
+    GC_PURPLE,  // possible root of a cycle
+};
+
+#define GC_DEFAULT_THRESHOLD 10000
+
+#define GC_POOL_CHUNK 1024   // values per pool chunk
+
+typedef struct gc_reclaimer gc_reclaimer_t;
+
+// Where a VM gets its memory. Without a malloc_fn the C library is used;
+// without a free_fn nothing is ever freed individually (see vm_destroy).
+typedef struct gc_allocator {
+    void *(*malloc_fn)(void *ctx, size_t size);
+    void *(*realloc_fn)(void *ctx, void *p, size_t old_size, size_t new_size);
+    void (*free_fn)(void *ctx, void *p);
+    void *ctx;
+} gc_allocator_t;
+
+typedef struct gc_chunk {
+    struct gc_chunk *next;
+    value_t values[GC_POOL_CHUNK];
+} gc_chunk_t;
+
+typedef struct gc_stats {
+    uint64_t collections;
+    uint64_t freed;          // values reclaimed by the cycle collector
+    uint64_t total_ns;       // time spent collecting
+    uint64_t last_pause_ns;
+    uint64_t max_pause_ns;
+} gc_stats_t;
+
+typedef struct gc {
+    value_t **roots;         // possible cycle roots
+    size_t nroots;
+    size_t roots_cap;
+    size_t threshold;        // collect once this many roots are buffered; 0 disables
+    value_t **stack;         // traversal work list
+    size_t nstack;
+    size_t stack_cap;
+    value_t **garbage;       // white values, freed once the scan is complete
+    size_t ngarbage;
+    size_t garbage_cap;
+    gc_stats_t stats;
+    value_t **pending;       // dead values whose children are still counted
+    size_t npending;
+    size_t pending_cap;
+    size_t budget;           // values reclaimed per evaluation step; 0 frees on release
+    int draining;
+    int depth;               // nesting of synchronous frees
+    uint64_t destroyed;      // values freed by refcount
+    gc_reclaimer_t *reclaimer; // background thread that frees memory, or NULL
+    value_t *pool_free;      // recycled pool slots, linked through as.pair.car
+    value_t *pool_next;      // bump pointer into the newest chunk
+    value_t *pool_end;
+    gc_chunk_t *chunks;
+    gc_allocator_t alloc;
+} gc_t;
+
+value_t *gc_pool_grow(gc_t *gc);
+
+// Value slots come from per-VM chunks: recycled slots first, which are
+// still in cache, then a bump pointer. ASan builds use malloc so that
+// use-after-free is still caught.
+static inline value_t *gc_pool_get(gc_t *gc) {
+#ifdef __SANITIZE_ADDRESS__
+    return NULL;
+#else
+    value_t *v = gc->pool_free;
+    if (v) {
+        gc->pool_free = v->as.pair.car;
+        return v;
+    }
+    if (gc->pool_next < gc->pool_end) return gc->pool_next++;
+    return gc_pool_grow(gc);
+#endif
+}
+
+static inline void gc_pool_put(gc_t *gc, value_t *v) {
+    v->as.pair.car = gc->pool_free;
+    gc->pool_free = v;
+}
+
+void gc_init(gc_t *gc);
+void gc_destroy(vm_t *vm);
+void gc_buffer(vm_t *vm, value_t *v);
+size_t gc_collect(vm_t *vm);
+
+void gc_defer(vm_t *vm, value_t *v);
+size_t gc_reclaim(vm_t *vm, size_t budget);
+int gc_set_reclaimer(vm_t *vm, int enable);
+void *gc_malloc(vm_t *vm, size_t size);
+void *gc_realloc(vm_t *vm, void *p, size_t old_size, size_t new_size);
+void gc_free(vm_t *vm, void *p);
+
+#endif
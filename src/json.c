@@ -1,22 +1,297 @@
 #include "json.h"
+#include "number.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 typedef struct json_parser {
     const char *input;
     size_t pos;
     size_t len;
     vm_t *vm;
+    value_t *source;
+    value_arena_t *arena;  // build the document in this arena, or NULL
+    value_t **stack;       // elements of the containers being parsed
+    size_t nstack;
+    size_t stack_cap;
+    uint32_t *index;       // token starts found by json_build_index(), or NULL
+    size_t nindex;
+    size_t index_cap;
+    size_t at;             // next index entry to look at
+    lazy_doc_t *lazy;      // nested containers become lazy values of this
+    size_t depth;          // containers open around the current one
 } json_parser_t;
 
+// Deeper documents are rejected when parsed and refused when written, so
+// neither can run the C stack out.
+#define JSON_MAX_DEPTH 10000
+
 static value_t *json_parse_value(json_parser_t *p);
 
+/*
+ * Parsing runs in two stages, after simdjson. Stage one classifies the
+ * input 64 bytes at a time with vector compares and records where every
+ * token starts: each structural character outside strings, each opening
+ * quote, and the first byte of each number or literal. Stage two is the
+ * recursive descent below, which jumps from token to token through that
+ * index instead of stepping over whitespace a byte at a time. Scalars are
+ * followed by a delimiter check, since only their first byte is indexed.
+ */
+
+typedef struct json_block {
+    uint64_t quote;
+    uint64_t backslash;
+    uint64_t space;
+    uint64_t op;        // { } [ ] : ,
+} json_block_t;
+
+#if defined(__AVX2__)
+static inline uint64_t json_eq32(__m256i c, char ch) {
+    return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(c, _mm256_set1_epi8(ch)));
+}
+
+static void json_classify(const char *s, json_block_t *b) {
+    memset(b, 0, sizeof(*b));
+    for (int i = 0; i < 64; i += 32) {
+        __m256i c = _mm256_loadu_si256((const __m256i *)(s + i));
+        // '[' and ']' are '{' and '}' without the 0x20 bit.
+        __m256i folded = _mm256_or_si256(c, _mm256_set1_epi8(0x20));
+        b->quote |= json_eq32(c, '"') << i;
+        b->backslash |= json_eq32(c, '\\') << i;
+        b->space |= (json_eq32(c, ' ') | json_eq32(c, '\t') | json_eq32(c, '\n') | json_eq32(c, '\r')) << i;
+        b->op |= (json_eq32(folded, '{') | json_eq32(folded, '}') | json_eq32(c, ':') | json_eq32(c, ',')) << i;
+    }
+}
+#elif defined(__SSE2__)
+static inline uint64_t json_eq16(__m128i c, char ch) {
+    return (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(c, _mm_set1_epi8(ch)));
+}
+
+static void json_classify(const char *s, json_block_t *b) {
+    memset(b, 0, sizeof(*b));
+    for (int i = 0; i < 64; i += 16) {
+        __m128i c = _mm_loadu_si128((const __m128i *)(s + i));
+        // '[' and ']' are '{' and '}' without the 0x20 bit.
+        __m128i folded = _mm_or_si128(c, _mm_set1_epi8(0x20));
+        b->quote |= json_eq16(c, '"') << i;
+        b->backslash |= json_eq16(c, '\\') << i;
+        b->space |= (json_eq16(c, ' ') | json_eq16(c, '\t') | json_eq16(c, '\n') | json_eq16(c, '\r')) << i;
+        b->op |= (json_eq16(folded, '{') | json_eq16(folded, '}') | json_eq16(c, ':') | json_eq16(c, ',')) << i;
+    }
+}
+#else
+static void json_classify(const char *s, json_block_t *b) {
+    memset(b, 0, sizeof(*b));
+    for (int i = 0; i < 64; i++) {
+        uint64_t bit = (uint64_t)1 << i;
+        switch (s[i]) {
+            case '"': b->quote |= bit; break;
+            case '\\': b->backslash |= bit; break;
+            case ' ': case '\t': case '\n': case '\r': b->space |= bit; break;
+            case '{': case '}': case '[': case ']': case ':': case ',': b->op |= bit; break;
+            default: break;
+        }
+    }
+}
+#endif
+
+// Bit i of the result is the parity of bits 0..i of x.
+static inline uint64_t json_prefix_xor(uint64_t x) {
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+}
+
+static int json_index_push(json_parser_t *p, uint32_t pos) {
+    if (p->nindex == p->index_cap) {
+        size_t cap = p->index_cap * 2;
+        uint32_t *index = gc_realloc(p->vm, p->index, p->index_cap * sizeof(uint32_t), cap * sizeof(uint32_t));
+        if (!index) return 0;
+        p->index = index;
+        p->index_cap = cap;
+    }
+    p->index[p->nindex++] = pos;
+    return 1;
+}
+
+// Stage one. Without an index (too large, or out of memory) stage two
+// falls back to skipping whitespace itself. Returns 0, with the error set,
+// for a document nested deeper than JSON_MAX_DEPTH.
+static int json_build_index(json_parser_t *p) {
+    const uint64_t even = 0x5555555555555555ull;
+    uint64_t prev_escaped = 0;  // the next block starts with an escaped byte
+    uint64_t prev_string = 0;   // all ones while inside a string
+    uint64_t prev_scalar = 0;   // the last byte was part of a number or literal
+
+    size_t depth = 0;
+
+    p->nindex = 0;
+    p->at = 0;
+    if (p->len > UINT32_MAX) return 1;
+    // A parser reused across documents keeps its index if it is big enough.
+    size_t cap = p->len / 8 + 16;
+    if (p->index_cap < cap) {
+        gc_free(p->vm, p->index);
+        p->index_cap = cap;
+        p->index = gc_malloc(p->vm, cap * sizeof(uint32_t));
+    }
+    if (!p->index) {
+        p->index_cap = 0;
+        return 1;
+    }
+
+    for (size_t base = 0; base < p->len; base += 64) {
+        json_block_t b;
+        if (p->len - base >= 64) {
+            json_classify(p->input + base, &b);
+        } else {
+            char tail[64];
+            memset(tail, ' ', sizeof(tail));
+            memcpy(tail, p->input + base, p->len - base);
+            json_classify(tail, &b);
+        }
+
+        // A backslash escapes the next byte unless it is escaped itself:
+        // odd-length runs of backslashes escape what follows them.
+        uint64_t backslash = b.backslash & ~prev_escaped;
+        uint64_t follows_escape = backslash << 1 | prev_escaped;
+        uint64_t odd_starts = backslash & ~even & ~follows_escape;
+        uint64_t even_runs;
+        prev_escaped = __builtin_add_overflow(odd_starts, backslash, &even_runs);
+        uint64_t escaped = (even ^ (even_runs << 1)) & follows_escape;
+
+        uint64_t quote = b.quote & ~escaped;
+        uint64_t in_string = json_prefix_xor(quote) ^ prev_string;
+        prev_string = (uint64_t)((int64_t)in_string >> 63);
+        // String bodies and closing quotes; opening quotes stay tokens.
+        uint64_t string_tail = in_string ^ quote;
+
+        uint64_t scalar = ~(b.op | b.space);
+        uint64_t nonquote_scalar = scalar & ~quote;
+        uint64_t follows_scalar = nonquote_scalar << 1 | prev_scalar;
+        prev_scalar = nonquote_scalar >> 63;
+
+        uint64_t starts = (b.op | (scalar & ~follows_scalar)) & ~string_tail;
+        while (starts) {
+            uint32_t pos = (uint32_t)(base + __builtin_ctzll(starts));
+            char c = p->input[pos];
+            if (c == '[' || c == '{') {
+                if (++depth > JSON_MAX_DEPTH) {
+                    vm_set_error(p->vm, VERR_RUNTIME, "invalid JSON");
+                    return 0;
+                }
+            } else if ((c == ']' || c == '}') && depth) {
+                depth--;
+            }
+            if (!json_index_push(p, pos)) {
+                gc_free(p->vm, p->index);
+                p->index = NULL;
+                p->index_cap = 0;
+                return 1;
+            }
+            starts &= starts - 1;
+        }
+    }
+    return 1;
+}
+
+// Numbers and literals must end at whitespace, a structural character or
+// the end of the input.
+static int json_at_delimiter(json_parser_t *p) {
+    if (p->pos >= p->len) return 1;
+    switch (p->input[p->pos]) {
+        case ' ': case '\t': case '\n': case '\r':
+        case '{': case '}': case '[': case ']': case ':': case ',':
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// Returns the position of the first quote or backslash at or after i.
+static size_t json_scan_string(const char *s, size_t i, size_t len) {
+#if defined(__SSE2__)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    while (i + 16 <= len) {
+        __m128i c = _mm_loadu_si128((const __m128i *)(s + i));
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(c, quote), _mm_cmpeq_epi8(c, backslash)));
+        if (mask) return i + __builtin_ctz(mask);
+        i += 16;
+    }
+#endif
+    while (i < len && s[i] != '"' && s[i] != '\\') i++;
+    return i;
+}
+
+// Rejects malformed UTF-8: stray continuation bytes, truncated or overlong
+// sequences, surrogates and code points past U+10FFFF. Runs of ASCII are
+// skipped 16 bytes at a time.
+static int json_utf8_valid(const char *str, size_t len) {
+    const unsigned char *s = (const unsigned char *)str;
+    size_t i = 0;
+    while (i < len) {
+#if defined(__SSE2__)
+        while (i + 16 <= len && !_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(s + i)))) i += 16;
+        if (i >= len) break;
+#endif
+        unsigned char c = s[i];
+        if (c < 0x80) {
+            i++;
+            continue;
+        }
+
+        size_t n;
+        uint32_t cp, min;
+        if ((c & 0xE0) == 0xC0) {
+            n = 1; cp = c & 0x1F; min = 0x80;
+        } else if ((c & 0xF0) == 0xE0) {
+            n = 2; cp = c & 0x0F; min = 0x800;
+        } else if ((c & 0xF8) == 0xF0) {
+            n = 3; cp = c & 0x07; min = 0x10000;
+        } else {
+            return 0;
+        }
+        if (len - i <= n) return 0;
+        for (size_t k = 1; k <= n; k++) {
+            if ((s[i + k] & 0xC0) != 0x80) return 0;
+            cp = cp << 6 | (s[i + k] & 0x3F);
+        }
+        if (cp < min || cp > 0x10FFFF || (cp >= 0xD800 && cp < 0xE000)) return 0;
+        i += n + 1;
+    }
+    return 1;
+}
+
+static inline int json_is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
 static void json_skip_whitespace(json_parser_t *p) {
+    if (p->index) {
+        while (p->at < p->nindex && p->index[p->at] < p->pos) p->at++;
+        p->pos = p->at < p->nindex ? p->index[p->at] : p->len;
+        return;
+    }
     while (p->pos < p->len) {
         char c = p->input[p->pos];
-        if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+        if (json_is_space(c)) {
             p->pos++;
         } else {
             break;
@@ -34,136 +309,289 @@ static char json_next(json_parser_t *p) {
     return p->input[p->pos++];
 }
 
-static value_t *json_parse_string(json_parser_t *p) {
-    json_next(p);
+static int json_hex4(const char *s, unsigned int *out) {
+    unsigned int v = 0;
+    for (int i = 0; i < 4; i++) {
+        char c = s[i];
+        v <<= 4;
+        if (c >= '0' && c <= '9') v |= c - '0';
+        else if (c >= 'a' && c <= 'f') v |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') v |= c - 'A' + 10;
+        else return 0;
+    }
+    *out = v;
+    return 1;
+}
 
-    char buf[4096];
-    size_t len = 0;
+static size_t json_encode_utf8(char *out, unsigned int cp) {
+    if (cp < 0x80) {
+        out[0] = (char)cp;
+        return 1;
+    }
+    if (cp < 0x800) {
+        out[0] = (char)(0xC0 | (cp >> 6));
+        out[1] = (char)(0x80 | (cp & 0x3F));
+        return 2;
+    }
+    if (cp < 0x10000) {
+        out[0] = (char)(0xE0 | (cp >> 12));
+        out[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        out[2] = (char)(0x80 | (cp & 0x3F));
+        return 3;
+    }
+    out[0] = (char)(0xF0 | (cp >> 18));
+    out[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+    out[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+    out[3] = (char)(0x80 | (cp & 0x3F));
+    return 4;
+}
 
-    while (p->pos < p->len) {
-        char c = json_next(p);
-        if (c == '"') {
-            buf[len] = '\0';
-            return value_string(p->vm, buf);
-        }
-        if (c == '\\' && p->pos < p->len) {
-            char next = json_next(p);
-            switch (next) {
-                case 'n': c = '\n'; break;
-                case 'r': c = '\r'; break;
-                case 't': c = '\t'; break;
-                case '\\': c = '\\'; break;
-                case '"': c = '"'; break;
-                case '/': c = '/'; break;
-                case 'b': c = '\b'; break;
-                case 'f': c = '\f'; break;
-                case 'u': {
-                    if (p->pos + 4 >= p->len) break;
-                    char hex[5];
-                    memcpy(hex, &p->input[p->pos], 4);
-                    hex[4] = '\0';
-                    p->pos += 4;
-                    unsigned int codepoint = strtoul(hex, NULL, 16);
-                    if (codepoint < 0x80) {
-                        c = codepoint;
-                    } else if (codepoint < 0x800) {
-                        if (len + 1 < sizeof(buf)) {
-                            buf[len++] = (char)(0xC0 | (codepoint >> 6));
-                            buf[len++] = (char)(0x80 | (codepoint & 0x3F));
-                        }
-                        continue;
-                    } else {
-                        if (len + 2 < sizeof(buf)) {
-                            buf[len++] = (char)(0xE0 | (codepoint >> 12));
-                            buf[len++] = (char)(0x80 | ((codepoint >> 6) & 0x3F));
-                            buf[len++] = (char)(0x80 | (codepoint & 0x3F));
-                        }
-                        continue;
+// Decodes the escapes in input[start, end) into buf. The output is never
+// longer than the raw text, so a buffer of that size is enough.
+static int json_decode_into(json_parser_t *p, size_t start, size_t end, char *buf, size_t *out_len) {
+    const char *in = p->input;
+    size_t len = 0;
+    size_t i = start;
+    while (i < end) {
+        char c = in[i++];
+        if (c != '\\' || i >= end) {
+            buf[len++] = c;
+            continue;
+        }
+        char next = in[i++];
+        switch (next) {
+            case 'n': buf[len++] = '\n'; break;
+            case 'r': buf[len++] = '\r'; break;
+            case 't': buf[len++] = '\t'; break;
+            case 'b': buf[len++] = '\b'; break;
+            case 'f': buf[len++] = '\f'; break;
+            case 'u': {
+                unsigned int cp;
+                if (i + 4 > end || !json_hex4(&in[i], &cp)) {
+                    vm_set_error(p->vm, VERR_RUNTIME, "invalid \\u escape in JSON string");
+                    return 0;
+                }
+                i += 4;
+                if (cp >= 0xD800 && cp < 0xDC00 && i + 6 <= end && in[i] == '\\' && in[i + 1] == 'u') {
+                    unsigned int lo;
+                    if (json_hex4(&in[i + 2], &lo) && lo >= 0xDC00 && lo < 0xE000) {
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                        i += 6;
                     }
-                    break;
                 }
-                default: c = next; break;
+                len += json_encode_utf8(&buf[len], cp);
+                break;
             }
-        }
-        if (len < sizeof(buf) - 1) {
-            buf[len++] = c;
+            default: buf[len++] = next; break;
         }
     }
+    buf[len] = '\0';
+    *out_len = len;
+    return 1;
+}
 
-    vm_set_error(p->vm, VERR_RUNTIME, "unterminated JSON string");
-    return NULL;
+static value_t *json_decode_string(json_parser_t *p, size_t start, size_t end) {
+    size_t len;
+    if (p->arena) {
+        value_t *str = value_arena_string(p->arena, NULL, end - start);
+        if (!str || !json_decode_into(p, start, end, str->as.string.data, &len)) return NULL;
+        str->as.string.len = len;
+        return str;
+    }
+
+    char *buf = gc_malloc(p->vm, end - start + 1);
+    if (!buf) {
+        vm_set_error(p->vm, VERR_RUNTIME, "out of memory");
+        return NULL;
+    }
+    if (!json_decode_into(p, start, end, buf, &len)) {
+        gc_free(p->vm, buf);
+        return NULL;
+    }
+
+    value_t *str = value_string_take(p->vm, buf, len);
+    if (!str) gc_free(p->vm, buf);
+    return str;
 }
 
-static value_t *json_parse_number(json_parser_t *p) {
-    char buf[64];
-    size_t len = 0;
+// Steps over a string token, leaving [*start, *end) around its raw text.
+static int json_scan_token(json_parser_t *p, size_t *start, size_t *end, int *has_escape) {
+    json_next(p);
 
-    if (json_peek(p) == '-') {
-        buf[len++] = json_next(p);
+    *start = p->pos;
+    *has_escape = 0;
+
+    p->pos = json_scan_string(p->input, p->pos, p->len);
+    while (p->pos < p->len && p->input[p->pos] == '\\') {
+        *has_escape = 1;
+        p->pos = p->pos + 2 < p->len ? json_scan_string(p->input, p->pos + 2, p->len) : p->len;
     }
 
-    while (p->pos < p->len && isdigit(json_peek(p)) && len < sizeof(buf) - 1) {
-        buf[len++] = json_next(p);
+    if (p->pos >= p->len) {
+        vm_set_error(p->vm, VERR_RUNTIME, "unterminated JSON string");
+        return 0;
+    }
+
+    *end = p->pos++;
+    return 1;
+}
+
+static value_t *json_parse_string(json_parser_t *p) {
+    size_t start, end;
+    int has_escape;
+    if (!json_scan_token(p, &start, &end, &has_escape)) return NULL;
+
+    if (has_escape) return json_decode_string(p, start, end);
+    if (p->arena) return value_arena_string(p->arena, p->input + start, end - start);
+    if (p->source) return value_string_slice(p->vm, p->source, start, end - start);
+    return value_string_n(p->vm, p->input + start, end - start);
+}
+
+// Keys are interned in the VM, so the thousands of records in a document
+// share one string per key and build their hashes through shapes matched
+// by pointer. Interned keys are copies, which keeps shapes from holding
+// the source text alive. A worker thread has no VM to intern in and puts
+// its keys in its arena instead.
+static value_t *json_parse_key(json_parser_t *p) {
+    if (!p->vm) return json_parse_string(p);
+
+    size_t start, end;
+    int has_escape;
+    if (!json_scan_token(p, &start, &end, &has_escape)) return NULL;
+    if (!has_escape) return hash_intern_key(p->vm, p->input + start, end - start);
+
+    value_arena_t *arena = p->arena;
+    p->arena = NULL;
+    value_t *key = json_decode_string(p, start, end);
+    p->arena = arena;
+    return key;
+}
+
+// Numbers are read by number_parse(); the text after one must end it.
+static value_t *json_parse_number(json_parser_t *p) {
+    number_t num;
+    size_t used = number_parse(p->input + p->pos, p->len - p->pos, &num);
+    p->pos += used;
+    if (!used || !json_at_delimiter(p)) {
+        vm_set_error(p->vm, VERR_RUNTIME, "invalid JSON number");
+        return NULL;
     }
 
-    if (json_peek(p) == '.') {
-        buf[len++] = json_next(p);
-        while (p->pos < p->len && isdigit(json_peek(p)) && len < sizeof(buf) - 1) {
-            buf[len++] = json_next(p);
+    if (!num.is_double) return p->arena ? value_arena_number(p->arena, num.n) : value_number(p->vm, num.n);
+    return p->arena ? value_arena_double(p->arena, num.d) : value_double(p->vm, num.d);
+}
+
+// Arena values are owned by the arena as a whole and never released alone.
+static void json_discard(json_parser_t *p, value_t *v) {
+    if (!value_in_arena(v)) value_release(p->vm, v);
+}
+
+static int json_push(json_parser_t *p, value_t *v) {
+    if (p->nstack == p->stack_cap) {
+        size_t cap = p->stack_cap ? p->stack_cap * 2 : 64;
+        value_t **stack = gc_realloc(p->vm, p->stack, p->stack_cap * sizeof(value_t *), cap * sizeof(value_t *));
+        if (!stack) {
+            vm_set_error(p->vm, VERR_RUNTIME, "out of memory");
+            return 0;
         }
+        p->stack = stack;
+        p->stack_cap = cap;
     }
+    p->stack[p->nstack++] = v;
+    return 1;
+}
 
-    if (json_peek(p) == 'e' || json_peek(p) == 'E') {
-        buf[len++] = json_next(p);
-        if (json_peek(p) == '+' || json_peek(p) == '-') {
-            buf[len++] = json_next(p);
+// Drops the stack entries above base after a failed parse.
+static void json_unwind(json_parser_t *p, size_t base) {
+    while (p->nstack > base) json_discard(p, p->stack[--p->nstack]);
+}
+
+static value_t *json_make_vector(json_parser_t *p, size_t base) {
+    value_t **items = p->stack + base;
+    size_t n = p->nstack - base;
+    value_t *vec = p->arena ? value_arena_vector(p->arena, items, n) : value_vector_take(p->vm, items, n);
+    if (!vec) {
+        json_unwind(p, base);
+        return NULL;
+    }
+    p->nstack = base;
+    return vec;
+}
+
+// The stack above base holds key, value pairs.
+static value_t *json_make_hash(json_parser_t *p, size_t base) {
+    size_t n = (p->nstack - base) / 2;
+    if (p->arena) {
+        value_t **keys = gc_malloc(p->vm, (n ? n : 1) * 2 * sizeof(value_t *));
+        if (!keys) {
+            vm_set_error(p->vm, VERR_RUNTIME, "out of memory");
+            json_unwind(p, base);
+            return NULL;
         }
-        while (p->pos < p->len && isdigit(json_peek(p)) && len < sizeof(buf) - 1) {
-            buf[len++] = json_next(p);
+        value_t **vals = keys + n;
+        for (size_t i = 0; i < n; i++) {
+            keys[i] = p->stack[base + 2 * i];
+            vals[i] = p->stack[base + 2 * i + 1];
         }
+        value_t *hash = value_arena_hash(p->arena, keys, vals, n);
+        for (size_t i = 0; i < n; i++) json_discard(p, keys[i]);
+        gc_free(p->vm, keys);
+        p->nstack = base;
+        return hash;
     }
 
-    buf[len] = '\0';
-
-    if (strchr(buf, '.') || strchr(buf, 'e') || strchr(buf, 'E')) {
-        double d = strtod(buf, NULL);
-        return value_double(p->vm, d);
-    } else {
-        uint64_t n = strtoull(buf, NULL, 10);
-        return value_number(p->vm, n);
+    value_t *hash = value_hash(p->vm);
+    if (!hash) {
+        json_unwind(p, base);
+        return NULL;
+    }
+    size_t i = base;
+    for (; i < p->nstack; i += 2) {
+        value_t *key = p->stack[i];
+        value_t *val = p->stack[i + 1];
+        if (!hash_set(p->vm, hash, key, val)) break;
+        value_release(p->vm, key);
+        value_disown(val);
     }
+    if (i < p->nstack) {
+        vm_set_error(p->vm, VERR_RUNTIME, "out of memory");
+        // Pairs below i already moved into the hash.
+        for (; i < p->nstack; i++) value_release(p->vm, p->stack[i]);
+        p->nstack = base;
+        value_release(p->vm, hash);
+        return NULL;
+    }
+    p->nstack = base;
+    return hash;
 }
 
 static value_t *json_parse_array(json_parser_t *p) {
     json_next(p);
 
-    value_t *vec = value_vector(p->vm);
-    if (!vec) return NULL;
-
+    size_t base = p->nstack;
     json_skip_whitespace(p);
 
     if (json_peek(p) == ']') {
         json_next(p);
-        return vec;
+        return json_make_vector(p, base);
     }
 
     while (1) {
         json_skip_whitespace(p);
 
         value_t *elem = json_parse_value(p);
-        if (!elem) {
-            value_release(p->vm, vec);
-            return NULL;
+        if (!elem) break;
+        if (!json_push(p, elem)) {
+            json_discard(p, elem);
+            break;
         }
 
-        vector_push(p->vm, vec, elem);
-
         json_skip_whitespace(p);
 
         char c = json_peek(p);
         if (c == ']') {
             json_next(p);
-            return vec;
+            return json_make_vector(p, base);
         }
         if (c == ',') {
             json_next(p);
@@ -171,22 +599,22 @@ static value_t *json_parse_array(json_parser_t *p) {
         }
 
         vm_set_error(p->vm, VERR_RUNTIME, "expected ',' or ']' in JSON array");
-        value_release(p->vm, vec);
-        return NULL;
+        break;
     }
+
+    json_unwind(p, base);
+    return NULL;
 }
 
 static value_t *json_parse_object(json_parser_t *p) {
     json_next(p);
 
-    value_t *hash = value_hash(p->vm);
-    if (!hash) return NULL;
-
+    size_t base = p->nstack;
     json_skip_whitespace(p);
 
     if (json_peek(p) == '}') {
         json_next(p);
-        return hash;
+        return json_make_hash(p, base);
     }
 
     while (1) {
@@ -194,43 +622,39 @@ static value_t *json_parse_object(json_parser_t *p) {
 
         if (json_peek(p) != '"') {
             vm_set_error(p->vm, VERR_RUNTIME, "expected string key in JSON object");
-            value_release(p->vm, hash);
-            return NULL;
+            break;
         }
 
-        value_t *key = json_parse_string(p);
-        if (!key) {
-            value_release(p->vm, hash);
-            return NULL;
+        value_t *key = json_parse_key(p);
+        if (!key) break;
+        if (!json_push(p, key)) {
+            json_discard(p, key);
+            break;
         }
 
         json_skip_whitespace(p);
 
         if (json_peek(p) != ':') {
             vm_set_error(p->vm, VERR_RUNTIME, "expected ':' in JSON object");
-            value_release(p->vm, key);
-            value_release(p->vm, hash);
-            return NULL;
+            break;
         }
         json_next(p);
 
         json_skip_whitespace(p);
 
         value_t *val = json_parse_value(p);
-        if (!val) {
-            value_release(p->vm, key);
-            value_release(p->vm, hash);
-            return NULL;
+        if (!val) break;
+        if (!json_push(p, val)) {
+            json_discard(p, val);
+            break;
         }
 
-        hash_set(p->vm, hash, key, val);
-
         json_skip_whitespace(p);
 
         char c = json_peek(p);
         if (c == '}') {
             json_next(p);
-            return hash;
+            return json_make_hash(p, base);
         }
         if (c == ',') {
             json_next(p);
@@ -238,241 +662,1165 @@ static value_t *json_parse_object(json_parser_t *p) {
         }
 
         vm_set_error(p->vm, VERR_RUNTIME, "expected ',' or '}' in JSON object");
-        value_release(p->vm, hash);
-        return NULL;
+        break;
+    }
+
+    json_unwind(p, base);
+    return NULL;
+}
+
+static int json_literal(json_parser_t *p, const char *word, size_t n) {
+    if (p->len - p->pos < n || memcmp(p->input + p->pos, word, n) != 0) return 0;
+    size_t pos = p->pos;
+    p->pos += n;
+    if (json_at_delimiter(p)) return 1;
+    p->pos = pos;
+    return 0;
+}
+
+// Finds the token closing the container that opens at token at, by
+// counting brackets in the index without looking inside strings. Returns
+// nindex when it is not closed.
+static size_t json_container_close(const char *input, const uint32_t *index, size_t nindex, size_t at) {
+    size_t depth = 0;
+    for (size_t t = at; t < nindex; t++) {
+        char c = input[index[t]];
+        if (c == '{' || c == '[') {
+            depth++;
+        } else if ((c == '}' || c == ']') && --depth == 0) {
+            return t;
+        }
+    }
+    return nindex;
+}
+
+// Moves past the container at the current token without building it.
+static int json_skip_container(json_parser_t *p) {
+    size_t t = json_container_close(p->input, p->index, p->nindex, p->at);
+    if (t == p->nindex) {
+        vm_set_error(p->vm, VERR_RUNTIME, "unterminated JSON container");
+        return 0;
     }
+    p->at = t + 1;
+    p->pos = p->index[t] + 1;
+    return 1;
+}
+
+static value_t *json_parse_lazy(json_parser_t *p) {
+    uint32_t token = (uint32_t)p->at;
+    if (!json_skip_container(p)) return NULL;
+    return value_lazy(p->vm, p->lazy, token);
 }
 
 static value_t *json_parse_value(json_parser_t *p) {
     json_skip_whitespace(p);
     char c = json_peek(p);
 
+    if (p->lazy && (c == '{' || c == '[')) return json_parse_lazy(p);
+
     if (c == '"') return json_parse_string(p);
-    if (c == '{') return json_parse_object(p);
-    if (c == '[') return json_parse_array(p);
+    if (c == '{' || c == '[') {
+        // Stage one already checked indexed documents.
+        if (p->depth >= JSON_MAX_DEPTH) {
+            vm_set_error(p->vm, VERR_RUNTIME, "invalid JSON");
+            return NULL;
+        }
+        p->depth++;
+        value_t *result = c == '{' ? json_parse_object(p) : json_parse_array(p);
+        p->depth--;
+        return result;
+    }
     if (c == '-' || isdigit(c)) return json_parse_number(p);
 
-    if (c == 't') {
-        if (p->pos + 3 <= p->len && strncmp(&p->input[p->pos], "true", 4) == 0) {
-            p->pos += 4;
-            return value_bool(p->vm, 1);
+    if (json_literal(p, "true", 4)) return value_bool(p->vm, 1);
+    if (json_literal(p, "false", 5)) return value_bool(p->vm, 0);
+    if (json_literal(p, "null", 4)) return value_null(p->vm);
+
+    vm_set_error(p->vm, VERR_RUNTIME, "invalid JSON");
+    return NULL;
+}
+
+/*
+ * Parallel parsing. Once stage one has indexed a large document whose root
+ * is an array, a walk over the index finds the top-level commas and cuts
+ * the elements into one range per thread. Each range is parsed by a parser
+ * without a VM into an arena of its own (see value_arena_parallel()), and
+ * the arenas are then merged into the document's and the elements gathered
+ * into the root vector. A range that fails sends the whole document back
+ * to the ordinary parser, which reports the error.
+ */
+
+#define JSON_PARALLEL_MIN (16u << 20)  // smaller documents use one thread
+#define JSON_MAX_THREADS 16
+
+typedef struct json_range {
+    json_parser_t p;
+    size_t end;         // where the next range starts, or the closing ']'
+    int last;
+} json_range_t;
+
+// Parses the elements in range i and hands them over from its parser's
+// stack.
+static int json_parse_range(void *ctx, size_t i, value_arena_t *arena, value_t ***items, size_t *nitems) {
+    json_range_t *r = (json_range_t *)ctx + i;
+    json_parser_t *p = &r->p;
+    p->arena = arena;
+    int ok = 0;
+    for (;;) {
+        value_t *elem = json_parse_value(p);
+        if (!elem || !json_push(p, elem)) break;
+        json_skip_whitespace(p);
+        char c = json_peek(p);
+        if (c == ']') {
+            ok = r->last && p->pos == r->end;
+            break;
+        }
+        if (c != ',') break;
+        json_next(p);
+        json_skip_whitespace(p);
+        if (p->pos >= r->end) {
+            ok = !r->last && p->pos == r->end;
+            break;
         }
     }
+    *items = p->stack;
+    *nitems = p->nstack;
+    return ok;
+}
 
-    if (c == 'f') {
-        if (p->pos + 4 <= p->len && strncmp(&p->input[p->pos], "false", 5) == 0) {
-            p->pos += 5;
-            return value_bool(p->vm, 0);
+// Cuts the top-level array into up to n ranges of similar size, storing
+// the token each starts at. Returns the number of ranges, or 0 when the
+// array is not closed; *close is the token of its ']'.
+static size_t json_split_array(json_parser_t *p, size_t *starts, size_t n, size_t *close) {
+    size_t count = 1, depth = 0;
+    size_t target = p->len / n;
+    starts[0] = 1;
+    for (size_t t = 1; t < p->nindex; t++) {
+        char c = p->input[p->index[t]];
+        if (c == '[' || c == '{') {
+            depth++;
+        } else if (c == ']' || c == '}') {
+            if (depth == 0) {
+                *close = t;
+                return starts[0] < t ? count : 0;
+            }
+            depth--;
+        } else if (c == ',' && depth == 0 && count < n && p->index[t] >= target && t + 1 < p->nindex) {
+            starts[count++] = t + 1;
+            target = p->len / n * count;
         }
     }
+    return 0;
+}
 
-    if (c == 'n') {
-        if (p->pos + 3 <= p->len && strncmp(&p->input[p->pos], "null", 4) == 0) {
-            p->pos += 4;
-            return value_null(p->vm);
-        }
+// Returns 0 when the document should be parsed on this thread instead;
+// otherwise *result is the root, or NULL with the error set.
+static int json_parse_parallel(json_parser_t *p, value_t **result) {
+    int nthreads = p->arena && !p->lazy && p->vm && p->index && p->len >= JSON_PARALLEL_MIN ? vm_thread_count(p->vm, JSON_MAX_THREADS) : 1;
+    if (nthreads < 2 || p->nindex < 2 || p->input[p->index[0]] != '[') return 0;
+
+    size_t starts[JSON_MAX_THREADS], close;
+    size_t n = json_split_array(p, starts, (size_t)nthreads, &close);
+    if (n < 2) return 0;
+
+    json_range_t ranges[JSON_MAX_THREADS];
+    size_t hints[JSON_MAX_THREADS];
+    for (size_t i = 0; i < n; i++) {
+        json_range_t *r = &ranges[i];
+        memset(r, 0, sizeof(*r));
+        r->p.input = p->input;
+        r->p.len = p->len;
+        r->p.index = p->index;
+        r->p.nindex = p->nindex;
+        r->p.at = starts[i];
+        r->p.pos = p->index[starts[i]];
+        r->p.depth = 1;
+        r->last = i + 1 == n;
+        r->end = r->last ? p->index[close] : p->index[starts[i + 1]];
+        hints[i] = (r->end - r->p.pos) / 2;
     }
+    *result = value_arena_parallel(p->arena, n, hints, json_parse_range, ranges);
+    if (!*result) return vm_error_code(p->vm) != VERR_NONE;
 
-    vm_set_error(p->vm, VERR_RUNTIME, "invalid JSON");
-    return NULL;
+    p->at = close + 1;
+    p->pos = p->index[close] + 1;
+    return 1;
+}
+
+// Parses one whole document, leaving the parser's stack and index
+// allocated for the next.
+static value_t *json_parse_text(json_parser_t *p) {
+    if (!json_utf8_valid(p->input, p->len)) {
+        vm_set_error(p->vm, VERR_RUNTIME, "invalid UTF-8 in JSON");
+        return NULL;
+    }
+    if (!json_build_index(p)) return NULL;
+
+    value_t *result;
+    if (!json_parse_parallel(p, &result)) result = json_parse_value(p);
+
+    json_skip_whitespace(p);
+    if (p->pos < p->len && result) {
+        vm_set_error(p->vm, VERR_RUNTIME, "trailing data in JSON");
+        json_discard(p, result);
+        result = NULL;
+    }
+    return result;
+}
+
+static value_t *json_parse_document(json_parser_t *p) {
+    value_t *result = json_parse_text(p);
+    gc_free(p->vm, p->stack);
+    gc_free(p->vm, p->index);
+    return result;
 }
 
 value_t *json_parse(vm_t *vm, const char *json_str) {
-    json_parser_t p = { json_str, 0, strlen(json_str), vm };
-    value_t *result = json_parse_value(&p);
+    json_parser_t p = { json_str, 0, strlen(json_str), vm, NULL };
+    return json_parse_document(&p);
+}
+
+// Parses a string value in place: escape-free strings in the result are
+// slices of source instead of copies.
+value_t *json_parse_source(vm_t *vm, value_t *source) {
+    if (!value_is_string(source)) {
+        vm_set_error(vm, VERR_TYPE, "json-parse: expected string");
+        return NULL;
+    }
+    json_parser_t p = { source->as.string.data, 0, source->as.string.len, vm, source };
+    return json_parse_document(&p);
+}
+
+// Parses into a fresh arena. The result holds the arena's only reference,
+// so releasing the root frees the whole document at once.
+value_t *json_parse_arena(vm_t *vm, const char *json_str, size_t len) {
+    value_arena_t *arena = value_arena_create(vm, len);
+    if (!arena) return NULL;
+
+    json_parser_t p = { json_str, 0, len, vm, NULL, arena };
+    value_t *result = json_parse_document(&p);
+    if (!result || !value_in_arena(result)) value_arena_release(arena);
+    return result;
+}
+
+#define JSON_LINES_CHUNK (1 << 20)
+
+static int json_blank(const char *s, size_t len) {
+    while (len > 0 && (*s == ' ' || *s == '\t' || *s == '\r')) s++, len--;
+    return len == 0;
+}
+
+// Parses one record into the reader's arena and hands it to fn. When fn
+// kept nothing from the record the arena is emptied for the next one,
+// otherwise it goes with the record and a new one is started.
+static int json_lines_record(json_parser_t *p, const char *line, size_t len, size_t lineno,
+                             json_record_fn fn, void *ctx) {
+    vm_t *vm = p->vm;
+    if (!p->arena && !(p->arena = value_arena_create(vm, len))) return 0;
+
+    p->input = line;
+    p->pos = 0;
+    p->len = len;
+    value_arena_retain(p->arena);
+    value_t *record = json_parse_text(p);
+    if (!record || !value_in_arena(record)) value_arena_release(p->arena);
+    if (!record) {
+        char msg[256];
+        snprintf(msg, sizeof(msg), "%s", vm_error_message(vm));
+        vm_set_error(vm, vm_error_code(vm), "ndjson: line %zu: %s", lineno, msg);
+        return 0;
+    }
+
+    int ok = fn(ctx, record);
+    value_release(vm, record);
+    if (!value_arena_reset(p->arena)) {
+        value_arena_release(p->arena);
+        p->arena = NULL;
+    }
+    return ok && !vm_check_interrupt(vm);
+}
+
+// Reads newline-delimited JSON from fd in 1 MB reads and parses each line
+// where it lies in the buffer, so a record costs its own values and no
+// copy of the text.
+int json_read_lines(vm_t *vm, int fd, json_record_fn fn, void *ctx) {
+    json_parser_t p = { NULL, 0, 0, vm, NULL };
+    size_t cap = JSON_LINES_CHUNK, len = 0, lineno = 0;
+    char *buf = gc_malloc(vm, cap);
+    int ok = buf != NULL;
+    if (!buf) vm_set_error(vm, VERR_RUNTIME, "out of memory");
+
+    while (ok) {
+        if (len == cap) {
+            // One line fills the buffer: make room for the rest of it.
+            char *grown = gc_realloc(vm, buf, cap, cap * 2);
+            if (!grown) {
+                vm_set_error(vm, VERR_RUNTIME, "out of memory");
+                ok = 0;
+                break;
+            }
+            buf = grown;
+            cap *= 2;
+        }
+        ssize_t n = read(fd, buf + len, cap - len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            vm_set_error(vm, VERR_RUNTIME, "ndjson: %s", strerror(errno));
+            ok = 0;
+            break;
+        }
+        if (n == 0) {
+            // A last line without a newline.
+            lineno++;
+            if (len > 0 && !json_blank(buf, len)) ok = json_lines_record(&p, buf, len, lineno, fn, ctx);
+            break;
+        }
 
+        size_t start = 0, scan = len;
+        len += (size_t)n;
+        char *nl;
+        while (ok && (nl = memchr(buf + scan, '\n', len - scan)) != NULL) {
+            size_t end = (size_t)(nl - buf);
+            lineno++;
+            if (!json_blank(buf + start, end - start)) {
+                ok = json_lines_record(&p, buf + start, end - start, lineno, fn, ctx);
+            }
+            start = scan = end + 1;
+        }
+        memmove(buf, buf + start, len - start);
+        len -= start;
+    }
+
+    if (p.arena) value_arena_release(p.arena);
+    gc_free(vm, p.stack);
+    gc_free(vm, p.index);
+    gc_free(vm, buf);
+    return ok;
+}
+
+// Steps over a string token as json_decode_into() would read it.
+static int json_check_string(json_parser_t *p) {
+    size_t start, end;
+    int has_escape;
+    if (!json_scan_token(p, &start, &end, &has_escape)) return 0;
+    for (size_t i = start; has_escape && i < end; i++) {
+        if (p->input[i] != '\\' || ++i >= end || p->input[i] != 'u') continue;
+        unsigned int cp;
+        if (i + 5 > end || !json_hex4(&p->input[i + 1], &cp)) {
+            vm_set_error(p->vm, VERR_RUNTIME, "invalid \\u escape in JSON string");
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Steps over a number or literal as json_parse_value() would read it.
+static int json_check_scalar(json_parser_t *p) {
+    char c = json_peek(p);
+    if (c == '-' || isdigit(c)) {
+        number_t num;
+        size_t used = number_parse(p->input + p->pos, p->len - p->pos, &num);
+        p->pos += used;
+        return used && json_at_delimiter(p);
+    }
+    return json_literal(p, "true", 4) || json_literal(p, "false", 5) || json_literal(p, "null", 4);
+}
+
+// Checks a document json-open has indexed, token by token, against the
+// grammar the parser applies. Its containers stay lazy, to be built or
+// copied out as they stand much later, so they must be valid up front.
+// Returns 0, with the error set, when they are not.
+static int json_check_index(json_parser_t *p) {
+    enum { WANT_VALUE, WANT_VALUE_OR_CLOSE, WANT_KEY, WANT_KEY_OR_CLOSE, WANT_COLON, WANT_NEXT } want = WANT_VALUE;
+    uint64_t in_object[JSON_MAX_DEPTH / 64 + 1];  // a bit per open container
+    size_t depth = 0;
+    const char *input = p->input;
+    const uint32_t *index = p->index;
+
+    for (size_t t = 0, n = p->nindex; t < n; t++) {
+        char c = input[index[t]];
+        int ok = 1;
+        switch (want) {
+            case WANT_VALUE:
+            case WANT_VALUE_OR_CLOSE:
+            case WANT_KEY:
+            case WANT_KEY_OR_CLOSE:
+                if (want == WANT_VALUE_OR_CLOSE && c == ']') {
+                    depth--;
+                    want = WANT_NEXT;
+                } else if (want == WANT_KEY_OR_CLOSE && c == '}') {
+                    depth--;
+                    want = WANT_NEXT;
+                } else if (c == '"') {
+                    p->pos = index[t];
+                    ok = json_check_string(p);
+                    want = want >= WANT_KEY ? WANT_COLON : WANT_NEXT;
+                } else if (want >= WANT_KEY) {
+                    ok = 0;
+                } else if (c == '[' || c == '{') {
+                    uint64_t bit = 1ull << (depth % 64);
+                    if (c == '{') {
+                        in_object[depth / 64] |= bit;
+                    } else {
+                        in_object[depth / 64] &= ~bit;
+                    }
+                    depth++;
+                    want = c == '{' ? WANT_KEY_OR_CLOSE : WANT_VALUE_OR_CLOSE;
+                } else {
+                    p->pos = index[t];
+                    ok = json_check_scalar(p);
+                    want = WANT_NEXT;
+                }
+                break;
+            case WANT_COLON:
+                ok = c == ':';
+                want = WANT_VALUE;
+                break;
+            case WANT_NEXT: {
+                int object = depth && in_object[(depth - 1) / 64] >> ((depth - 1) % 64) & 1;
+                if (depth && c == ',') {
+                    want = object ? WANT_KEY : WANT_VALUE;
+                } else if (depth && c == (object ? '}' : ']')) {
+                    depth--;
+                } else {
+                    ok = 0;
+                }
+                break;
+            }
+        }
+        if (!ok) {
+            if (vm_error_code(p->vm) == VERR_NONE) vm_set_error(p->vm, VERR_RUNTIME, "invalid JSON");
+            return 0;
+        }
+    }
+    if (want != WANT_NEXT || depth) {
+        vm_set_error(p->vm, VERR_RUNTIME, "invalid JSON");
+        return 0;
+    }
+    return 1;
+}
+
+// Builds one level of a json-open document: the container at token, with
+// strings sliced from the mapping and nested containers left lazy.
+static value_t *json_force(vm_t *vm, lazy_doc_t *doc, uint32_t token) {
+    json_parser_t p = { doc->text->as.string.data, doc->index[token], doc->text->as.string.len, vm, doc->text };
+    p.index = doc->index;
+    p.nindex = doc->nindex;
+    p.at = token;
+    p.lazy = doc;
+
+    value_t *result = json_peek(&p) == '{' ? json_parse_object(&p) : json_parse_array(&p);
+    gc_free(vm, p.stack);
+    return result;
+}
+
+// Maps a file and indexes its tokens, but builds only the top-level value;
+// containers are lazy values, built a level at a time as they are used.
+// Memory and time then follow what is read, not the size of the file.
+value_t *json_open(vm_t *vm, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        vm_set_error(vm, VERR_RUNTIME, "json-open: cannot open file");
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        vm_set_error(vm, VERR_RUNTIME, "json-open: empty or unreadable file");
+        return NULL;
+    }
+    size_t len = (size_t)st.st_size;
+    char *data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        vm_set_error(vm, VERR_RUNTIME, "json-open: cannot map file");
+        return NULL;
+    }
+
+    value_t *text = value_string_mapped(vm, data, len);
+    if (!text) {
+        munmap(data, len);
+        return NULL;
+    }
+
+    json_parser_t p = { data, 0, len, vm, text };
+    if (!json_utf8_valid(data, len)) {
+        vm_set_error(vm, VERR_RUNTIME, "invalid UTF-8 in JSON");
+        value_release(vm, text);
+        return NULL;
+    }
+    if (!json_build_index(&p) || !p.index || !p.nindex) {
+        if (vm_error_code(vm) == VERR_NONE) {
+            vm_set_error(vm, VERR_RUNTIME, p.index ? "invalid JSON" : "json-open: cannot index file");
+        }
+        gc_free(vm, p.index);
+        value_release(vm, text);
+        return NULL;
+    }
+
+    // The index stays for the document's lifetime: trim it and count it.
+    size_t bytes = p.nindex * sizeof(uint32_t);
+    uint32_t *index = gc_realloc(vm, p.index, p.index_cap * sizeof(uint32_t), bytes);
+    if (index) p.index = index;
+    if (!index || !vm_mem_charge(vm, VTYPE_LAZY, bytes)) {
+        if (!index) vm_set_error(vm, VERR_RUNTIME, "out of memory");
+        gc_free(vm, p.index);
+        value_release(vm, text);
+        return NULL;
+    }
+    lazy_doc_t *doc = vm_alloc(vm, VTYPE_LAZY, sizeof(lazy_doc_t));
+    if (!doc) {
+        vm_free(vm, VTYPE_LAZY, index, bytes);
+        value_release(vm, text);
+        return NULL;
+    }
+
+    doc->refcount = 1;
+    doc->text = text;
+    doc->index = index;
+    doc->nindex = p.nindex;
+    doc->force = json_force;
+    p.lazy = doc;
+
+    value_t *result = json_parse_value(&p);
     json_skip_whitespace(&p);
-    if (p.pos < p.len && result) {
+    if (result && p.pos < p.len) {
         vm_set_error(vm, VERR_RUNTIME, "trailing data in JSON");
         value_release(vm, result);
+        result = NULL;
+    }
+    if (result && !json_check_index(&p)) {
+        value_release(vm, result);
+        result = NULL;
+    }
+    gc_free(vm, p.stack);
+    lazy_doc_release(vm, doc);
+    return result;
+}
+
+/*
+ * Push parsing. The input arrives in chunks that may split any token, so
+ * the grammar is a state machine over a stack of open containers instead
+ * of recursive descent. Complete scalars are decoded by the ordinary
+ * parser; a token cut off at the end of a chunk is copied aside and
+ * finished from the next one. Containers nested at build_depth or deeper
+ * are assembled on the builder's stack with json_make_vector() and
+ * json_make_hash() and delivered whole, so memory grows with the nesting,
+ * the longest token and the largest subtree built, never the document.
+ */
+
+enum {
+    JSON_PUSH_VALUE,         // a value
+    JSON_PUSH_VALUE_OR_END,  // after '[': a value or ']'
+    JSON_PUSH_KEY,           // after ',' in an object
+    JSON_PUSH_KEY_OR_END,    // after '{': a key or '}'
+    JSON_PUSH_COLON,         // after a key
+    JSON_PUSH_NEXT,          // after a member: ',' or the closing bracket
+    JSON_PUSH_DONE,          // the document is complete
+};
+
+enum {
+    JSON_TOKEN_NONE,
+    JSON_TOKEN_STRING,
+    JSON_TOKEN_SCALAR,       // a number or literal
+};
+
+struct json_push {
+    vm_t *vm;
+    json_event_fn handler;
+    void *ctx;
+    long build_depth;        // deliver containers this deep whole; < 0: never
+    int state;
+    int failed;
+    char *nest;              // '{' or '[' for each open container
+    size_t depth;
+    size_t nest_cap;
+    size_t *bases;           // builder stack base of each container being built
+    size_t nbuild;
+    size_t bases_cap;
+    char *tok;               // a token split across chunks
+    size_t ntok;
+    size_t tok_cap;
+    int tok_kind;
+    int tok_escape;          // the buffered string ends in a backslash
+    json_parser_t build;     // holds the members of the containers being built
+};
+
+json_push_t *json_push_new(vm_t *vm, json_event_fn handler, void *ctx, long build_depth) {
+    json_push_t *ps = gc_malloc(vm, sizeof(json_push_t));
+    if (!ps) {
+        vm_set_error(vm, VERR_RUNTIME, "out of memory");
         return NULL;
     }
+    memset(ps, 0, sizeof(*ps));
+    ps->vm = vm;
+    ps->handler = handler;
+    ps->ctx = ctx;
+    ps->build_depth = build_depth;
+    ps->state = JSON_PUSH_VALUE;
+    ps->build.vm = vm;
+    return ps;
+}
 
-    return result;
+void json_push_free(json_push_t *ps) {
+    if (!ps) return;
+    vm_t *vm = ps->vm;
+    json_unwind(&ps->build, 0);
+    gc_free(vm, ps->build.stack);
+    gc_free(vm, ps->nest);
+    gc_free(vm, ps->bases);
+    gc_free(vm, ps->tok);
+    gc_free(vm, ps);
 }
 
-int json_write_string(char *buf, size_t *pos, size_t len, const char *str) {
-    if (*pos >= len) return 0;
+static int json_push_fail(json_push_t *ps, const char *msg) {
+    if (msg) vm_set_error(ps->vm, VERR_RUNTIME, "%s", msg);
+    ps->failed = 1;
+    return 0;
+}
 
-    if (*pos < len) buf[(*pos)++] = '"';
+static int json_push_grow(json_push_t *ps, void **items, size_t *cap, size_t need, size_t size) {
+    if (need <= *cap) return 1;
+    size_t new_cap = *cap ? *cap * 2 : 64;
+    while (new_cap < need) new_cap *= 2;
+    void *p = gc_realloc(ps->vm, *items, *cap * size, new_cap * size);
+    if (!p) return json_push_fail(ps, "out of memory");
+    *items = p;
+    *cap = new_cap;
+    return 1;
+}
+
+static int json_push_event(json_push_t *ps, json_event_t event, value_t *v) {
+    if (ps->handler(ps->ctx, event, v)) return 1;
+    return json_push_fail(ps, vm_error_code(ps->vm) == VERR_NONE ? "JSON event handler failed" : NULL);
+}
+
+// A complete value in value position: a member of the container being
+// built, or an event. Takes ownership of v.
+static int json_push_emit(json_push_t *ps, value_t *v) {
+    if (ps->nbuild) {
+        if (!json_push(&ps->build, v)) {
+            value_release(ps->vm, v);
+            return json_push_fail(ps, NULL);
+        }
+    } else {
+        int ok = json_push_event(ps, JSON_EVENT_VALUE, v);
+        value_release(ps->vm, v);
+        if (!ok) return 0;
+    }
+    ps->state = ps->depth ? JSON_PUSH_NEXT : JSON_PUSH_DONE;
+    return 1;
+}
+
+// Decodes one complete string, number or literal with the ordinary parser.
+static int json_push_token(json_push_t *ps, const char *s, size_t n) {
+    int key = ps->state == JSON_PUSH_KEY || ps->state == JSON_PUSH_KEY_OR_END;
+    if (key && s[0] != '"') return json_push_fail(ps, "expected string key in JSON object");
+    if (!key && ps->state != JSON_PUSH_VALUE && ps->state != JSON_PUSH_VALUE_OR_END) {
+        return json_push_fail(ps, ps->state == JSON_PUSH_DONE ? "trailing data in JSON" : "unexpected JSON value");
+    }
+    if (s[0] == '"' && !json_utf8_valid(s, n)) return json_push_fail(ps, "invalid UTF-8 in JSON");
+
+    json_parser_t q = { .input = s, .len = n, .vm = ps->vm };
+    value_t *v = key ? json_parse_key(&q) : json_parse_value(&q);
+    if (!v) return json_push_fail(ps, NULL);
+    if (q.pos != n) {
+        value_release(ps->vm, v);
+        return json_push_fail(ps, "invalid JSON value");
+    }
+
+    if (!key) return json_push_emit(ps, v);
+    ps->state = JSON_PUSH_COLON;
+    if (ps->nbuild) {
+        if (json_push(&ps->build, v)) return 1;
+        value_release(ps->vm, v);
+        return json_push_fail(ps, NULL);
+    }
+    int ok = json_push_event(ps, JSON_EVENT_KEY, v);
+    value_release(ps->vm, v);
+    return ok;
+}
 
-    for (const char *s = str; *s && *pos < len; s++) {
-        char c = *s;
+static int json_push_open(json_push_t *ps, char c) {
+    if (ps->state != JSON_PUSH_VALUE && ps->state != JSON_PUSH_VALUE_OR_END) {
+        return json_push_fail(ps, ps->state == JSON_PUSH_DONE ? "trailing data in JSON" : "unexpected JSON value");
+    }
+    if (!json_push_grow(ps, (void **)&ps->nest, &ps->nest_cap, ps->depth + 1, 1)) return 0;
+
+    if (ps->nbuild || (ps->build_depth >= 0 && ps->depth >= (size_t)ps->build_depth)) {
+        if (!json_push_grow(ps, (void **)&ps->bases, &ps->bases_cap, ps->nbuild + 1, sizeof(size_t))) return 0;
+        ps->bases[ps->nbuild++] = ps->build.nstack;
+    } else if (!json_push_event(ps, c == '{' ? JSON_EVENT_OBJECT_START : JSON_EVENT_ARRAY_START, NULL)) {
+        return 0;
+    }
+    ps->nest[ps->depth++] = c;
+    ps->state = c == '{' ? JSON_PUSH_KEY_OR_END : JSON_PUSH_VALUE_OR_END;
+    return 1;
+}
+
+static int json_push_close(json_push_t *ps, char c) {
+    char open = c == '}' ? '{' : '[';
+    int ok_state = ps->state == JSON_PUSH_NEXT ||
+                   ps->state == (open == '{' ? JSON_PUSH_KEY_OR_END : JSON_PUSH_VALUE_OR_END);
+    if (!ps->depth || ps->nest[ps->depth - 1] != open || !ok_state) {
+        return json_push_fail(ps, ps->state == JSON_PUSH_DONE ? "trailing data in JSON" : "unbalanced JSON brackets");
+    }
+    ps->depth--;
+
+    if (!ps->nbuild) {
+        if (!json_push_event(ps, open == '{' ? JSON_EVENT_OBJECT_END : JSON_EVENT_ARRAY_END, NULL)) return 0;
+        ps->state = ps->depth ? JSON_PUSH_NEXT : JSON_PUSH_DONE;
+        return 1;
+    }
+    size_t base = ps->bases[--ps->nbuild];
+    value_t *v = open == '{' ? json_make_hash(&ps->build, base) : json_make_vector(&ps->build, base);
+    if (!v) return json_push_fail(ps, NULL);
+    return json_push_emit(ps, v);
+}
+
+static int json_push_save(json_push_t *ps, const char *s, size_t n) {
+    if (!json_push_grow(ps, (void **)&ps->tok, &ps->tok_cap, ps->ntok + n, 1)) return 0;
+    memcpy(ps->tok + ps->ntok, s, n);
+    ps->ntok += n;
+    return 1;
+}
+
+// Finds the end of a string whose body starts at i, after a backslash if
+// escape is set. Returns len when the closing quote is not in this chunk.
+static size_t json_push_string_end(const char *s, size_t i, size_t len, int *escape) {
+    if (*escape) {
+        if (i >= len) return len;
+        i++;
+        *escape = 0;
+    }
+    while ((i = json_scan_string(s, i, len)) < len && s[i] == '\\') {
+        if (i + 1 >= len) {
+            *escape = 1;
+            return len;
+        }
+        i += 2;
+    }
+    return i;
+}
+
+static size_t json_push_scalar_end(const char *s, size_t i, size_t len) {
+    json_parser_t q = { .input = s, .pos = i, .len = len };
+    while (q.pos < len && !json_at_delimiter(&q)) q.pos++;
+    return q.pos;
+}
+
+// Continues a token left over from the previous chunk; returns how much
+// of this chunk it took.
+static size_t json_push_resume(json_push_t *ps, const char *data, size_t len) {
+    int string = ps->tok_kind == JSON_TOKEN_STRING;
+    size_t end = string ? json_push_string_end(data, 0, len, &ps->tok_escape) : json_push_scalar_end(data, 0, len);
+    size_t take = string && end < len ? end + 1 : end;
+    if (!json_push_save(ps, data, take)) return len;
+    if (end < len) {
+        size_t n = ps->ntok;
+        ps->ntok = 0;
+        ps->tok_kind = JSON_TOKEN_NONE;
+        json_push_token(ps, ps->tok, n);
+    }
+    return take;
+}
+
+int json_push_feed(json_push_t *ps, const char *data, size_t len) {
+    if (ps->failed) return 0;
+    size_t i = ps->tok_kind ? json_push_resume(ps, data, len) : 0;
+
+    while (i < len && !ps->failed) {
+        char c = data[i];
         switch (c) {
-            case '"':
-            case '\\':
-            case '/':
-                if (*pos + 1 < len) {
-                    buf[(*pos)++] = '\\';
-                    buf[(*pos)++] = c;
-                }
+            case ' ': case '\t': case '\n': case '\r':
+                i++;
                 break;
-            case '\b':
-                if (*pos + 1 < len) {
-                    buf[(*pos)++] = '\\';
-                    buf[(*pos)++] = 'b';
-                }
+            case '{': case '[':
+                json_push_open(ps, c);
+                i++;
                 break;
-            case '\f':
-                if (*pos + 1 < len) {
-                    buf[(*pos)++] = '\\';
-                    buf[(*pos)++] = 'f';
-                }
+            case '}': case ']':
+                json_push_close(ps, c);
+                i++;
                 break;
-            case '\n':
-                if (*pos + 1 < len) {
-                    buf[(*pos)++] = '\\';
-                    buf[(*pos)++] = 'n';
-                }
+            case ':':
+                if (ps->state != JSON_PUSH_COLON) json_push_fail(ps, "expected ':' in JSON object");
+                else ps->state = JSON_PUSH_VALUE;
+                i++;
                 break;
-            case '\r':
-                if (*pos + 1 < len) {
-                    buf[(*pos)++] = '\\';
-                    buf[(*pos)++] = 'r';
-                }
+            case ',':
+                if (ps->state != JSON_PUSH_NEXT) json_push_fail(ps, "unexpected ',' in JSON");
+                else ps->state = ps->nest[ps->depth - 1] == '{' ? JSON_PUSH_KEY : JSON_PUSH_VALUE;
+                i++;
                 break;
-            case '\t':
-                if (*pos + 1 < len) {
-                    buf[(*pos)++] = '\\';
-                    buf[(*pos)++] = 't';
+            default: {
+                int string = c == '"';
+                int escape = 0;
+                size_t end = string ? json_push_string_end(data, i + 1, len, &escape) : json_push_scalar_end(data, i, len);
+                if (end >= len) {
+                    // Cut off by the end of the chunk.
+                    ps->tok_kind = string ? JSON_TOKEN_STRING : JSON_TOKEN_SCALAR;
+                    ps->tok_escape = escape;
+                    json_push_save(ps, data + i, len - i);
+                    i = len;
+                    break;
                 }
+                if (string) end++;
+                json_push_token(ps, data + i, end - i);
+                i = end;
                 break;
+            }
+        }
+    }
+    return !ps->failed;
+}
+
+// Ends the input: completes a number or literal left at the very end and
+// checks that the document is complete.
+int json_push_finish(json_push_t *ps) {
+    if (ps->failed) return 0;
+    if (ps->tok_kind == JSON_TOKEN_STRING) return json_push_fail(ps, "unterminated JSON string");
+    if (ps->tok_kind == JSON_TOKEN_SCALAR) {
+        size_t n = ps->ntok;
+        ps->ntok = 0;
+        ps->tok_kind = JSON_TOKEN_NONE;
+        if (!json_push_token(ps, ps->tok, n)) return 0;
+    }
+    if (ps->state != JSON_PUSH_DONE) return json_push_fail(ps, "unexpected end of JSON input");
+    return 1;
+}
+
+#define JSON_WRITER_CHUNK 65536
+
+void json_writer_init(json_writer_t *w, vm_t *vm) {
+    memset(w, 0, sizeof(*w));
+    w->vm = vm;
+    w->fd = -1;
+}
+
+void json_writer_init_fd(json_writer_t *w, vm_t *vm, int fd) {
+    json_writer_init(w, vm);
+    w->fd = fd;
+}
+
+void json_writer_init_sink(json_writer_t *w, vm_t *vm, json_sink_t sink, void *ctx) {
+    json_writer_init(w, vm);
+    w->sink = sink;
+    w->ctx = ctx;
+}
+
+void json_writer_free(json_writer_t *w) {
+    gc_free(w->vm, w->buf);
+    w->buf = NULL;
+    w->len = w->cap = 0;
+}
+
+// Hands the buffered text to the fd or sink. A growable writer keeps it.
+int json_writer_flush(json_writer_t *w) {
+    if (w->failed) return 0;
+    if (w->sink) {
+        if (w->len && !w->sink(w->ctx, w->buf, w->len)) {
+            vm_set_error(w->vm, VERR_RUNTIME, "JSON output sink failed");
+            w->failed = 1;
+            return 0;
+        }
+        w->len = 0;
+    } else if (w->fd >= 0) {
+        size_t done = 0;
+        while (done < w->len) {
+            ssize_t n = write(w->fd, w->buf + done, w->len - done);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                vm_set_error(w->vm, VERR_RUNTIME, "JSON output: %s", strerror(errno));
+                w->failed = 1;
+                return 0;
+            }
+            done += (size_t)n;
+        }
+        w->len = 0;
+    }
+    return 1;
+}
+
+// Makes room for n more bytes, flushing a streaming writer first.
+static int json_reserve(json_writer_t *w, size_t n) {
+    if (w->failed) return 0;
+    if (w->len + n <= w->cap) return 1;
+    if (w->sink || w->fd >= 0) {
+        if (!json_writer_flush(w)) return 0;
+        if (n <= w->cap) return 1;
+    }
+    size_t cap = w->cap ? w->cap : JSON_WRITER_CHUNK;
+    while (cap < w->len + n) cap *= 2;
+    char *buf = gc_realloc(w->vm, w->buf, w->cap, cap);
+    if (!buf) {
+        vm_set_error(w->vm, VERR_RUNTIME, "out of memory");
+        w->failed = 1;
+        return 0;
+    }
+    w->buf = buf;
+    w->cap = cap;
+    return 1;
+}
+
+static int json_put(json_writer_t *w, const char *s, size_t n) {
+    if (!json_reserve(w, n)) return 0;
+    memcpy(w->buf + w->len, s, n);
+    w->len += n;
+    return 1;
+}
+
+int json_writer_put(json_writer_t *w, const void *data, size_t len) {
+    return json_put(w, data, len);
+}
+
+static inline int json_putc(json_writer_t *w, char c) {
+    if (w->len >= w->cap && !json_reserve(w, 1)) return 0;
+    w->buf[w->len++] = c;
+    return 1;
+}
+
+static int json_write_uint(json_writer_t *w, uint64_t n) {
+    char num[NUMBER_TEXT_MAX];
+    return json_put(w, num, number_format_uint(n, num));
+}
+
+// JSON has no NaN or infinity, so those become null.
+static int json_write_double(json_writer_t *w, double d) {
+    if (d != d || d - d != 0) return json_put(w, "null", 4);
+    char num[NUMBER_TEXT_MAX];
+    return json_put(w, num, number_format_double(d, num));
+}
+
+// Finds the next byte from i that must be escaped: a quote, backslash,
+// slash or control character.
+static size_t json_scan_escape(const unsigned char *s, size_t i, size_t len) {
+#if defined(__SSE2__)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i slash = _mm_set1_epi8('/');
+    const __m128i control = _mm_set1_epi8(0x1f);
+    while (i + 16 <= len) {
+        __m128i c = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(c, quote), _mm_cmpeq_epi8(c, backslash)),
+                                   _mm_or_si128(_mm_cmpeq_epi8(c, slash),
+                                                _mm_cmpeq_epi8(_mm_max_epu8(c, control), control)));
+        int mask = _mm_movemask_epi8(hit);
+        if (mask) return i + __builtin_ctz(mask);
+        i += 16;
+    }
+#endif
+    while (i < len && s[i] != '"' && s[i] != '\\' && s[i] != '/' && s[i] >= ' ') i++;
+    return i;
+}
+
+static int json_write_string(json_writer_t *w, const char *str, size_t n) {
+    const unsigned char *s = (const unsigned char *)str;
+    if (!json_putc(w, '"')) return 0;
+
+    size_t i = 0;
+    while (i < n) {
+        size_t run = json_scan_escape(s, i, n);
+        if (run > i && !json_put(w, str + i, run - i)) return 0;
+        if (run >= n) break;
+
+        unsigned char c = s[run];
+        char esc[6] = { '\\', (char)c };
+        size_t len = 2;
+        switch (c) {
+            case '\b': esc[1] = 'b'; break;
+            case '\f': esc[1] = 'f'; break;
+            case '\n': esc[1] = 'n'; break;
+            case '\r': esc[1] = 'r'; break;
+            case '\t': esc[1] = 't'; break;
             default:
                 if (c < ' ') {
-                    char hex[8];
-                    snprintf(hex, sizeof(hex), "\\u%04x", (unsigned char)c);
-                    for (size_t i = 0; hex[i] && *pos < len; i++) {
-                        buf[(*pos)++] = hex[i];
-                    }
-                } else {
-                    buf[(*pos)++] = c;
+                    esc[1] = 'u';
+                    memcpy(esc + 2, "00", 2);
+                    esc[4] = "0123456789abcdef"[c >> 4];
+                    esc[5] = "0123456789abcdef"[c & 15];
+                    len = 6;
                 }
                 break;
         }
+        if (!json_put(w, esc, len)) return 0;
+        i = run + 1;
     }
 
-    if (*pos < len) buf[(*pos)++] = '"';
-    return *pos < len;
+    return json_putc(w, '"');
 }
 
-int json_write_value(char *buf, size_t *pos, size_t len, value_t *val) {
-    if (!val) {
-        if (*pos + 4 <= len) {
-            memcpy(&buf[*pos], "null", 4);
-            *pos += 4;
-        }
-        return *pos <= len;
-    }
+static int json_write_value(json_writer_t *w, value_t *val);
 
+static int json_write_items(json_writer_t *w, value_t *val) {
     switch (val->type) {
-        case VTYPE_NULL:
-            if (*pos + 4 <= len) {
-                memcpy(&buf[*pos], "null", 4);
-                *pos += 4;
-            }
-            break;
-        case VTYPE_BOOL:
-            if (val->as.boolean) {
-                if (*pos + 4 <= len) {
-                    memcpy(&buf[*pos], "true", 4);
-                    *pos += 4;
-                }
-            } else {
-                if (*pos + 5 <= len) {
-                    memcpy(&buf[*pos], "false", 5);
-                    *pos += 5;
-                }
-            }
-            break;
-        case VTYPE_NUMBER:
-            if (val->as.number == (double)val->as.number) {
-                char num[32];
-                int n = snprintf(num, sizeof(num), "%llu", (unsigned long long)val->as.number);
-                if (*pos + n <= len) {
-                    memcpy(&buf[*pos], num, n);
-                    *pos += n;
-                }
-            } else {
-                char num[64];
-                int n = snprintf(num, sizeof(num), "%g", val->as.floating);
-                if (*pos + n <= len) {
-                    memcpy(&buf[*pos], num, n);
-                    *pos += n;
-                }
-            }
-            break;
-        case VTYPE_STRING:
-            json_write_string(buf, pos, len, val->as.string);
-            break;
         case VTYPE_VECTOR: {
-            if (*pos >= len) return 0;
-            buf[(*pos)++] = '[';
-
+            if (!json_putc(w, '[')) return 0;
             for (size_t i = 0; i < val->as.vector.size; i++) {
-                if (i > 0) {
-                    if (*pos >= len) return 0;
-                    buf[(*pos)++] = ',';
-                }
-                json_write_value(buf, pos, len, val->as.vector.elements[i]);
+                if (i > 0 && !json_putc(w, ',')) return 0;
+                if (!json_write_value(w, val->as.vector.elements[i])) return 0;
             }
-
-            if (*pos >= len) return 0;
-            buf[(*pos)++] = ']';
-            break;
+            return json_putc(w, ']');
         }
         case VTYPE_HASH: {
-            if (*pos >= len) return 0;
-            buf[(*pos)++] = '{';
-
+            if (!json_putc(w, '{')) return 0;
             int first = 1;
-            for (size_t i = 0; i < val->as.hash.size; i++) {
-                if (val->as.hash.keys[i]) {
-                    if (!first) {
-                        if (*pos >= len) return 0;
-                        buf[(*pos)++] = ',';
-                    }
-                    first = 0;
-
-                    if (value_is_string(val->as.hash.keys[i])) {
-                        json_write_string(buf, pos, len, val->as.hash.keys[i]->as.string);
-                    } else if (value_is_number(val->as.hash.keys[i])) {
-                        json_write_value(buf, pos, len, val->as.hash.keys[i]);
-                    } else {
-                        continue;
-                    }
-
-                    if (*pos >= len) return 0;
-                    buf[(*pos)++] = ':';
-
-                    json_write_value(buf, pos, len, val->as.hash.values[i]);
+            size_t iter = 0;
+            value_t *key, *item;
+            while (hash_next(val, &iter, &key, &item)) {
+                if (!value_is_string(key) && !value_is_number(key)) continue;
+                if (!first && !json_putc(w, ',')) return 0;
+                first = 0;
+
+                int ok = value_is_string(key) ? json_write_string(w, key->as.string.data, key->as.string.len)
+                                              : json_write_value(w, key);
+                if (!ok || !json_putc(w, ':') || !json_write_value(w, item)) return 0;
+            }
+            return json_putc(w, '}');
+        }
+        case VTYPE_RECORD: {
+            // Records serialise as objects keyed by field name.
+            value_t *type = val->as.record.type;
+            if (!json_putc(w, '{')) return 0;
+            for (size_t i = 0; i < type->as.record_type.nfields; i++) {
+                if (i > 0 && !json_putc(w, ',')) return 0;
+                const char *field = type->as.record_type.fields[i]->as.symbol.name;
+                if (!json_write_string(w, field, strlen(field)) || !json_putc(w, ':') ||
+                    !json_write_value(w, val->as.record.slots[i])) {
+                    return 0;
                 }
             }
-
-            if (*pos >= len) return 0;
-            buf[(*pos)++] = '}';
-            break;
+            return json_putc(w, '}');
         }
         default:
-            if (*pos + 4 <= len) {
-                memcpy(&buf[*pos], "null", 4);
-                *pos += 4;
+            return 0;
+    }
+}
+
+static int json_write_value(json_writer_t *w, value_t *val) {
+    if (!val) return json_put(w, "null", 4);
+
+    switch (val->type) {
+        case VTYPE_BOOL:
+            return val->as.boolean ? json_put(w, "true", 4) : json_put(w, "false", 5);
+        case VTYPE_NUMBER:
+            if (val->flags & VALUE_DOUBLE) return json_write_double(w, val->as.floating);
+            return json_write_uint(w, val->as.number);
+        case VTYPE_STRING:
+            return json_write_string(w, val->as.string.data, val->as.string.len);
+        case VTYPE_VECTOR:
+        case VTYPE_HASH:
+        case VTYPE_RECORD: {
+            // A cycle would otherwise write forever.
+            if (w->depth >= JSON_MAX_DEPTH) {
+                vm_set_error(w->vm, VERR_RUNTIME, "JSON output nested too deeply");
+                w->failed = 1;
+                return 0;
             }
-            break;
+            w->depth++;
+            int ok = json_write_items(w, val);
+            w->depth--;
+            return ok;
+        }
+        case VTYPE_LAZY: {
+            if (val->as.lazy.value) return json_write_value(w, val->as.lazy.value);
+            // Never built: copy its source tokens without the whitespace
+            // between them. json-open checked that the container is closed.
+            lazy_doc_t *doc = val->as.lazy.doc;
+            const char *text = doc->text->as.string.data;
+            size_t close = json_container_close(text, doc->index, doc->nindex, val->as.lazy.token);
+            for (size_t t = val->as.lazy.token; t <= close; t++) {
+                size_t start = doc->index[t];
+                size_t end = t == close ? start + 1 : doc->index[t + 1];
+                while (end > start + 1 && json_is_space(text[end - 1])) end--;
+                if (!json_put(w, text + start, end - start)) return 0;
+            }
+            return 1;
+        }
+        default:
+            return json_put(w, "null", 4);
+    }
+}
+
+int json_write(json_writer_t *w, value_t *val) {
+    return json_write_value(w, val) && json_writer_flush(w);
+}
+
+#define JSON_PARALLEL_ITEMS 16384  // smaller vectors are written on one thread
+
+typedef struct json_chunk {
+    json_writer_t w;    // a growable writer without a VM
+    value_t **items;
+    size_t n;
+    int ok;
+    pthread_t thread;
+} json_chunk_t;
+
+static void *json_write_chunk(void *arg) {
+    json_chunk_t *c = arg;
+    c->ok = 1;
+    for (size_t i = 0; c->ok && i < c->n; i++) {
+        c->ok = (i == 0 || json_putc(&c->w, ',')) && json_write_value(&c->w, c->items[i]);
     }
+    return NULL;
+}
 
-    return *pos <= len;
+// Writes the elements of a large vector in one chunk per thread and joins
+// the chunks in order. Returns 0 when they are better written on this
+// thread, which is also how errors get reported.
+static int json_write_parallel(json_writer_t *w, value_t *vec) {
+    size_t size = vec->as.vector.size;
+    int nthreads = size >= JSON_PARALLEL_ITEMS ? vm_thread_count(w->vm, JSON_MAX_THREADS) : 1;
+    if (nthreads < 2) return 0;
+
+    json_chunk_t chunks[JSON_MAX_THREADS];
+    for (int i = 0; i < nthreads; i++) {
+        json_chunk_t *c = &chunks[i];
+        json_writer_init(&c->w, NULL);
+        c->w.depth = 1;
+        c->items = vec->as.vector.elements + size * i / nthreads;
+        c->n = size * (i + 1) / nthreads - size * i / nthreads;
+        if (i > 0 && pthread_create(&c->thread, NULL, json_write_chunk, c) != 0) c->thread = 0;
+    }
+    json_write_chunk(&chunks[0]);
+
+    int ok = 1;
+    for (int i = 0; i < nthreads; i++) {
+        json_chunk_t *c = &chunks[i];
+        if (i > 0 && c->thread) {
+            pthread_join(c->thread, NULL);
+        } else if (i > 0) {
+            json_write_chunk(c);
+        }
+        ok = ok && c->ok;
+    }
+
+    size_t start = w->len;
+    ok = ok && json_putc(w, '[');
+    for (int i = 0; i < nthreads; i++) {
+        ok = ok && (i == 0 || json_putc(w, ',')) && json_put(w, chunks[i].w.buf, chunks[i].w.len);
+        json_writer_free(&chunks[i].w);
+    }
+    ok = ok && json_putc(w, ']');
+    if (!ok) w->len = start;
+    return ok;
 }
 
 value_t *json_stringify(vm_t *vm, value_t *val) {
-    char buf[65536];
-    size_t pos = 0;
-
-    if (!json_write_value(buf, &pos, sizeof(buf), val)) {
-        vm_set_error(vm, VERR_RUNTIME, "JSON stringification failed: buffer too small");
+    json_writer_t w;
+    json_writer_init(&w, vm);
+    int parallel = value_is_vector(val) && json_write_parallel(&w, val);
+    if (!(parallel || json_write(&w, val)) || !json_reserve(&w, 1)) {
+        json_writer_free(&w);
         return NULL;
     }
 
-    return value_string(vm, buf);
+    w.buf[w.len] = '\0';
+    char *buf = w.cap - w.len > JSON_WRITER_CHUNK ? gc_realloc(vm, w.buf, w.cap, w.len + 1) : w.buf;
+    if (buf) w.buf = buf;
+    value_t *result = value_string_take(vm, w.buf, w.len);
+    if (!result) json_writer_free(&w);
+    return result;
 }
 
 value_t *json_select(vm_t *vm, value_t *obj, value_t *path) {
@@ -484,6 +1832,8 @@ value_t *json_select(vm_t *vm, value_t *obj, value_t *path) {
             vm_set_error(vm, VERR_RUNTIME, "json-select: null path element");
             return NULL;
         }
+        current = value_force(vm, current);
+        if (!current) return NULL;
 
         value_t *key = item->as.pair.car;
 
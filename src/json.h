@@ -5,10 +5,61 @@
 #include "value.h"
 
 value_t *json_parse(vm_t *vm, const char *json_str);
+value_t *json_parse_source(vm_t *vm, value_t *source);
+value_t *json_parse_arena(vm_t *vm, const char *json_str, size_t len);
+value_t *json_open(vm_t *vm, const char *path);
 value_t *json_stringify(vm_t *vm, value_t *val);
 value_t *json_select(vm_t *vm, value_t *obj, value_t *path);
 
-int json_write_string(char *buf, size_t *pos, size_t len, const char *str);
-int json_write_value(char *buf, size_t *pos, size_t len, value_t *val);
+// Calls fn with each line of newline-delimited JSON read from fd, skipping
+// blank lines. Records are borrowed and freed when fn returns unless it
+// keeps a reference; fn returns 0 to stop with an error.
+typedef int (*json_record_fn)(void *ctx, value_t *record);
+int json_read_lines(vm_t *vm, int fd, json_record_fn fn, void *ctx);
+
+// Push parsing: feed chunks split anywhere and receive events. Values
+// passed to the handler are borrowed; it returns 0 to stop with an error.
+// Containers at nesting depth build_depth or deeper (0 is the document
+// itself) arrive whole as JSON_EVENT_VALUE; a negative depth never builds.
+typedef enum {
+    JSON_EVENT_OBJECT_START,
+    JSON_EVENT_OBJECT_END,
+    JSON_EVENT_ARRAY_START,
+    JSON_EVENT_ARRAY_END,
+    JSON_EVENT_KEY,
+    JSON_EVENT_VALUE,
+} json_event_t;
+
+typedef int (*json_event_fn)(void *ctx, json_event_t event, value_t *value);
+typedef struct json_push json_push_t;
+
+json_push_t *json_push_new(vm_t *vm, json_event_fn handler, void *ctx, long build_depth);
+int json_push_feed(json_push_t *ps, const char *data, size_t len);
+int json_push_finish(json_push_t *ps);
+void json_push_free(json_push_t *ps);
+
+// Serialises into a buffer that either grows to hold the whole text or is
+// flushed to an fd or sink whenever it fills. A sink returns 0 on failure.
+typedef int (*json_sink_t)(void *ctx, const char *data, size_t len);
+
+typedef struct json_writer {
+    vm_t *vm;
+    char *buf;
+    size_t len;
+    size_t cap;
+    int fd;            // flush here when >= 0
+    json_sink_t sink;  // or here when set
+    void *ctx;
+    size_t depth;
+    int failed;
+} json_writer_t;
+
+void json_writer_init(json_writer_t *w, vm_t *vm);
+void json_writer_init_fd(json_writer_t *w, vm_t *vm, int fd);
+void json_writer_init_sink(json_writer_t *w, vm_t *vm, json_sink_t sink, void *ctx);
+int json_write(json_writer_t *w, value_t *val);
+int json_writer_put(json_writer_t *w, const void *data, size_t len);  // raw bytes, for other formats
+int json_writer_flush(json_writer_t *w);
+void json_writer_free(json_writer_t *w);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,666 @@
+#include "jsonpath.h"
+#include "number.h"
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+/*
+ * A selector compiles to an array of steps. Evaluation walks the document
+ * depth first and carries each match of one step straight into the next,
+ * so the only thing it builds is the result vector. Every name lookup has
+ * its own inline cache, which makes a step over records of one shape an
+ * indexed load.
+ */
+
+typedef enum {
+    PATH_CHILD,     // .name or ['name']
+    PATH_INDEX,     // [n]
+    PATH_WILDCARD,  // .* or [*]
+    PATH_SLICE,     // [start:end:step]
+    PATH_UNION,     // [a,b,...]
+    PATH_FILTER,    // [?expr]
+} path_kind_t;
+
+typedef enum {
+    EXPR_EXISTS,
+    EXPR_EQ,
+    EXPR_NE,
+    EXPR_LT,
+    EXPR_LE,
+    EXPR_GT,
+    EXPR_GE,
+    EXPR_AND,
+    EXPR_OR,
+    EXPR_NOT,
+} expr_op_t;
+
+typedef struct path_step path_step_t;
+typedef struct path_expr path_expr_t;
+
+struct path_step {
+    path_kind_t kind;
+    int descend;            // after '..': applies again below every child
+    value_t *key;           // CHILD
+    hash_ic_t ic;           // CHILD
+    int64_t start;          // INDEX, SLICE
+    int64_t end;            // SLICE
+    int64_t step;           // SLICE
+    int has_start;          // SLICE
+    int has_end;            // SLICE
+    path_step_t *alts;      // UNION: the selectors between the brackets
+    size_t nalts;
+    path_expr_t *filter;    // FILTER
+};
+
+struct path_expr {
+    expr_op_t op;
+    path_expr_t *lhs;       // AND, OR, NOT
+    path_expr_t *rhs;       // AND, OR
+    path_step_t *rel;       // the @ path tested or compared
+    size_t nrel;
+    value_t *literal;       // what it is compared with
+};
+
+struct json_path {
+    path_step_t *steps;
+    size_t nsteps;
+};
+
+static void path_steps_free(vm_t *vm, path_step_t *steps, size_t n);
+
+static void path_expr_free(vm_t *vm, path_expr_t *e) {
+    if (!e) return;
+    path_expr_free(vm, e->lhs);
+    path_expr_free(vm, e->rhs);
+    path_steps_free(vm, e->rel, e->nrel);
+    value_release(vm, e->literal);
+    vm_free(vm, VTYPE_PATH, e, sizeof(path_expr_t));
+}
+
+static void path_step_clear(vm_t *vm, path_step_t *step) {
+    value_release(vm, step->key);
+    hash_ic_clear(vm, &step->ic);
+    path_steps_free(vm, step->alts, step->nalts);
+    path_expr_free(vm, step->filter);
+}
+
+static void path_steps_free(vm_t *vm, path_step_t *steps, size_t n) {
+    for (size_t i = 0; i < n; i++) path_step_clear(vm, &steps[i]);
+    vm_free(vm, VTYPE_PATH, steps, n * sizeof(path_step_t));
+}
+
+static void json_path_destroy(vm_t *vm, json_path_t *path) {
+    path_steps_free(vm, path->steps, path->nsteps);
+    vm_free(vm, VTYPE_PATH, path, sizeof(json_path_t));
+}
+
+typedef struct path_parser {
+    vm_t *vm;
+    const char *s;
+    size_t pos;
+    size_t len;
+} path_parser_t;
+
+static int path_error(path_parser_t *p, const char *msg) {
+    vm_set_error(p->vm, VERR_SYNTAX, "json-path: %s at offset %zu", msg, p->pos);
+    return 0;
+}
+
+static char path_peek(path_parser_t *p) {
+    return p->pos < p->len ? p->s[p->pos] : '\0';
+}
+
+static void path_skip_space(path_parser_t *p) {
+    while (p->pos < p->len && isspace((unsigned char)p->s[p->pos])) p->pos++;
+}
+
+static int path_eat(path_parser_t *p, const char *tok) {
+    path_skip_space(p);
+    size_t n = strlen(tok);
+    if (p->len - p->pos < n || memcmp(p->s + p->pos, tok, n) != 0) return 0;
+    p->pos += n;
+    return 1;
+}
+
+static int path_is_name_char(char c) {
+    return isalnum((unsigned char)c) || c == '_' || c == '-' || (unsigned char)c >= 0x80;
+}
+
+// Takes over step's contents, or clears them on failure.
+static int path_add_step(vm_t *vm, path_step_t **steps, size_t *n, path_step_t *step) {
+    path_step_t *grown = vm_realloc(vm, VTYPE_PATH, *steps, *n * sizeof(path_step_t), (*n + 1) * sizeof(path_step_t));
+    if (!grown) {
+        path_step_clear(vm, step);
+        return 0;
+    }
+    grown[(*n)++] = *step;
+    *steps = grown;
+    return 1;
+}
+
+// 'text' or "text"; a backslash takes the next byte as it is.
+static value_t *path_parse_quoted(path_parser_t *p) {
+    char quote = p->s[p->pos++];
+    size_t start = p->pos;
+    while (p->pos < p->len && p->s[p->pos] != quote) p->pos += p->s[p->pos] == '\\' ? 2 : 1;
+    if (p->pos >= p->len) {
+        path_error(p, "unterminated string");
+        return NULL;
+    }
+
+    char *buf = gc_malloc(p->vm, p->pos - start + 1);
+    if (!buf) {
+        vm_set_error(p->vm, VERR_RUNTIME, "out of memory");
+        return NULL;
+    }
+    size_t n = 0;
+    for (size_t i = start; i < p->pos; i++) {
+        if (p->s[i] == '\\') i++;
+        buf[n++] = p->s[i];
+    }
+    buf[n] = '\0';
+    p->pos++;
+
+    value_t *str = value_string_take(p->vm, buf, n);
+    if (!str) gc_free(p->vm, buf);
+    return str;
+}
+
+static value_t *path_parse_name(path_parser_t *p) {
+    size_t start = p->pos;
+    while (p->pos < p->len && path_is_name_char(p->s[p->pos])) p->pos++;
+    if (p->pos == start) {
+        path_error(p, "expected a name");
+        return NULL;
+    }
+    return value_string_n(p->vm, p->s + start, p->pos - start);
+}
+
+static int path_parse_int(path_parser_t *p, int64_t *out) {
+    path_skip_space(p);
+    size_t start = p->pos;
+    if (path_peek(p) == '-') p->pos++;
+    if (!isdigit((unsigned char)path_peek(p))) {
+        p->pos = start;
+        return 0;
+    }
+    int64_t v = 0;
+    while (isdigit((unsigned char)path_peek(p))) v = v * 10 + (p->s[p->pos++] - '0');
+    *out = p->s[start] == '-' ? -v : v;
+    return 1;
+}
+
+static path_expr_t *path_parse_or(path_parser_t *p);
+static int path_parse_segments(path_parser_t *p, path_step_t **steps, size_t *n, int relative);
+
+// One selector between brackets: a quoted name, an index or a slice.
+static int path_parse_selector(path_parser_t *p, path_step_t *step) {
+    path_skip_space(p);
+    char c = path_peek(p);
+    if (c == '\'' || c == '"') {
+        step->kind = PATH_CHILD;
+        step->key = path_parse_quoted(p);
+        return step->key != NULL;
+    }
+
+    step->has_start = path_parse_int(p, &step->start);
+    if (!path_eat(p, ":")) {
+        step->kind = PATH_INDEX;
+        return step->has_start || path_error(p, "expected a name, index or slice");
+    }
+    step->kind = PATH_SLICE;
+    step->has_end = path_parse_int(p, &step->end);
+    step->step = 1;
+    if (path_eat(p, ":")) path_parse_int(p, &step->step);
+    return 1;
+}
+
+// Everything after '[' up to and including the closing ']'.
+static int path_parse_bracket(path_parser_t *p, path_step_t *step) {
+    if (path_eat(p, "*")) {
+        step->kind = PATH_WILDCARD;
+    } else if (path_eat(p, "?")) {
+        step->kind = PATH_FILTER;
+        step->filter = path_parse_or(p);
+        if (!step->filter) return 0;
+    } else {
+        do {
+            path_step_t sel = { 0 };
+            if (!path_parse_selector(p, &sel)) {
+                path_step_clear(p->vm, &sel);
+                return 0;
+            }
+            if (!path_add_step(p->vm, &step->alts, &step->nalts, &sel)) return 0;
+        } while (path_eat(p, ","));
+
+        if (step->nalts == 1) {
+            // A single selector is the step itself.
+            path_step_t *alts = step->alts;
+            int descend = step->descend;
+            *step = alts[0];
+            step->descend = descend;
+            vm_free(p->vm, VTYPE_PATH, alts, sizeof(path_step_t));
+        } else {
+            step->kind = PATH_UNION;
+        }
+    }
+    return path_eat(p, "]") || path_error(p, "expected ']'");
+}
+
+// Parses segments until none follows. Paths inside filters (relative) may
+// only name children and indexes, so they select at most one value.
+static int path_parse_segments(path_parser_t *p, path_step_t **steps, size_t *n, int relative) {
+    path_step_t step;
+    for (;;) {
+        memset(&step, 0, sizeof(step));
+        char c = path_peek(p);
+        if (c == '.' && p->pos + 1 < p->len && p->s[p->pos + 1] == '.') {
+            p->pos += 2;
+            step.descend = 1;
+            if (path_peek(p) == '[') {
+                p->pos++;
+                if (!path_parse_bracket(p, &step)) goto fail;
+            } else if (path_peek(p) == '*') {
+                p->pos++;
+                step.kind = PATH_WILDCARD;
+            } else {
+                step.kind = PATH_CHILD;
+                if (!(step.key = path_parse_name(p))) goto fail;
+            }
+        } else if (c == '.') {
+            p->pos++;
+            if (path_peek(p) == '*') {
+                p->pos++;
+                step.kind = PATH_WILDCARD;
+            } else {
+                step.kind = PATH_CHILD;
+                if (!(step.key = path_parse_name(p))) goto fail;
+            }
+        } else if (c == '[') {
+            p->pos++;
+            if (!path_parse_bracket(p, &step)) goto fail;
+        } else {
+            return 1;
+        }
+
+        if (relative && (step.descend || (step.kind != PATH_CHILD && step.kind != PATH_INDEX))) {
+            path_error(p, "filter paths take only names and indexes");
+            goto fail;
+        }
+        if (!path_add_step(p->vm, steps, n, &step)) return 0;
+    }
+
+fail:
+    path_step_clear(p->vm, &step);
+    return 0;
+}
+
+static path_expr_t *path_new_expr(path_parser_t *p, expr_op_t op) {
+    path_expr_t *e = vm_alloc(p->vm, VTYPE_PATH, sizeof(path_expr_t));
+    if (!e) return NULL;
+    memset(e, 0, sizeof(*e));
+    e->op = op;
+    return e;
+}
+
+static value_t *path_parse_literal(path_parser_t *p) {
+    path_skip_space(p);
+    char c = path_peek(p);
+    if (c == '\'' || c == '"') return path_parse_quoted(p);
+    if (path_eat(p, "true")) return value_bool(p->vm, 1);
+    if (path_eat(p, "false")) return value_bool(p->vm, 0);
+    if (path_eat(p, "null")) return value_null(p->vm);
+
+    number_t num;
+    size_t used = number_parse(p->s + p->pos, p->len - p->pos, &num);
+    if (!used) {
+        path_error(p, "expected a literal or @ path");
+        return NULL;
+    }
+    p->pos += used;
+    if (num.is_double) return value_double(p->vm, num.d);
+    return value_number(p->vm, num.n);
+}
+
+// An @ path, optionally compared with a literal (on either side).
+static path_expr_t *path_parse_comparison(path_parser_t *p) {
+    static const struct {
+        const char *tok;
+        expr_op_t op;
+        expr_op_t flipped;
+    } ops[] = {
+        { "==", EXPR_EQ, EXPR_EQ }, { "!=", EXPR_NE, EXPR_NE }, { "<=", EXPR_LE, EXPR_GE },
+        { ">=", EXPR_GE, EXPR_LE }, { "<", EXPR_LT, EXPR_GT }, { ">", EXPR_GT, EXPR_LT },
+    };
+
+    path_expr_t *e = path_new_expr(p, EXPR_EXISTS);
+    if (!e) return NULL;
+
+    int path_first = path_eat(p, "@");
+    if (path_first) {
+        if (!path_parse_segments(p, &e->rel, &e->nrel, 1)) goto fail;
+    } else if (!(e->literal = path_parse_literal(p))) {
+        goto fail;
+    }
+
+    size_t i = 0;
+    while (i < sizeof(ops) / sizeof(ops[0]) && !path_eat(p, ops[i].tok)) i++;
+    if (i == sizeof(ops) / sizeof(ops[0])) {
+        if (path_first) return e;
+        path_error(p, "expected a comparison");
+        goto fail;
+    }
+    e->op = path_first ? ops[i].op : ops[i].flipped;
+
+    if (path_eat(p, "@")) {
+        if (path_first) {
+            path_error(p, "an @ path can only be compared with a literal");
+            goto fail;
+        }
+        if (!path_parse_segments(p, &e->rel, &e->nrel, 1)) goto fail;
+    } else if (!path_first) {
+        path_error(p, "expected an @ path");
+        goto fail;
+    } else if (!(e->literal = path_parse_literal(p))) {
+        goto fail;
+    }
+    return e;
+
+fail:
+    path_expr_free(p->vm, e);
+    return NULL;
+}
+
+static path_expr_t *path_parse_unary(path_parser_t *p) {
+    path_skip_space(p);
+    if (path_peek(p) == '!' && !(p->pos + 1 < p->len && p->s[p->pos + 1] == '=')) {
+        p->pos++;
+        path_expr_t *inner = path_parse_unary(p);
+        if (!inner) return NULL;
+        path_expr_t *e = path_new_expr(p, EXPR_NOT);
+        if (!e) {
+            path_expr_free(p->vm, inner);
+            return NULL;
+        }
+        e->lhs = inner;
+        return e;
+    }
+    if (path_eat(p, "(")) {
+        path_expr_t *e = path_parse_or(p);
+        if (e && !path_eat(p, ")")) {
+            path_error(p, "expected ')'");
+            path_expr_free(p->vm, e);
+            return NULL;
+        }
+        return e;
+    }
+    return path_parse_comparison(p);
+}
+
+static path_expr_t *path_parse_binary(path_parser_t *p, expr_op_t op) {
+    path_expr_t *lhs = op == EXPR_OR ? path_parse_binary(p, EXPR_AND) : path_parse_unary(p);
+    while (lhs && path_eat(p, op == EXPR_OR ? "||" : "&&")) {
+        path_expr_t *rhs = op == EXPR_OR ? path_parse_binary(p, EXPR_AND) : path_parse_unary(p);
+        path_expr_t *e = rhs ? path_new_expr(p, op) : NULL;
+        if (!e) {
+            path_expr_free(p->vm, lhs);
+            path_expr_free(p->vm, rhs);
+            return NULL;
+        }
+        e->lhs = lhs;
+        e->rhs = rhs;
+        lhs = e;
+    }
+    return lhs;
+}
+
+static path_expr_t *path_parse_or(path_parser_t *p) {
+    return path_parse_binary(p, EXPR_OR);
+}
+
+value_t *json_path_compile(vm_t *vm, const char *expr, size_t len) {
+    path_parser_t p = { vm, expr, 0, len };
+    json_path_t *path = vm_alloc(vm, VTYPE_PATH, sizeof(json_path_t));
+    if (!path) return NULL;
+    path->steps = NULL;
+    path->nsteps = 0;
+
+    path_skip_space(&p);
+    if (path_peek(&p) == '$') {
+        p.pos++;
+    } else if (path_is_name_char(path_peek(&p))) {
+        // A leading name reads as if it followed "$.".
+        path_step_t step = { PATH_CHILD };
+        if (!(step.key = path_parse_name(&p)) || !path_add_step(vm, &path->steps, &path->nsteps, &step)) goto fail;
+    }
+    if (!path_parse_segments(&p, &path->steps, &path->nsteps, 0)) goto fail;
+    path_skip_space(&p);
+    if (p.pos < p.len) {
+        path_error(&p, "unexpected character");
+        goto fail;
+    }
+
+    value_t *v = value_path(vm, path, json_path_destroy);
+    if (!v) json_path_destroy(vm, path);
+    return v;
+
+fail:
+    json_path_destroy(vm, path);
+    return NULL;
+}
+
+typedef struct path_out {
+    vm_t *vm;
+    value_t *results;
+} path_out_t;
+
+static int path_eval(path_out_t *o, path_step_t *steps, size_t n, value_t *node);
+
+// Continues with rest from every element or member value of node.
+static int path_each_child(path_out_t *o, path_step_t *rest, size_t nrest, value_t *node) {
+    if (value_is_vector(node)) {
+        for (size_t i = 0; i < node->as.vector.size; i++) {
+            if (!path_eval(o, rest, nrest, node->as.vector.elements[i])) return 0;
+        }
+    } else if (value_is_hash(node)) {
+        size_t iter = 0;
+        value_t *key, *val;
+        while (hash_next(node, &iter, &key, &val)) {
+            if (!path_eval(o, rest, nrest, val)) return 0;
+        }
+    }
+    return 1;
+}
+
+// Follows a filter's @ path; NULL when something along it is missing.
+static value_t *path_lookup(vm_t *vm, path_step_t *steps, size_t n, value_t *node) {
+    for (size_t i = 0; node && i < n; i++) {
+        node = value_force(vm, node);
+        if (steps[i].kind == PATH_CHILD) {
+            node = value_is_hash(node) ? hash_get_cached(vm, node, steps[i].key, &steps[i].ic) : NULL;
+        } else if (value_is_vector(node)) {
+            int64_t size = (int64_t)node->as.vector.size;
+            int64_t at = steps[i].start < 0 ? steps[i].start + size : steps[i].start;
+            node = at >= 0 && at < size ? node->as.vector.elements[at] : NULL;
+        } else {
+            node = NULL;
+        }
+    }
+    return value_force(vm, node);
+}
+
+static int path_is_double(value_t *v) {
+    return (v->flags & VALUE_DOUBLE) != 0;
+}
+
+// Orders numbers numerically and strings bytewise. Returns 0 when a and b
+// are not of one of those kinds.
+static int path_order(value_t *a, value_t *b, int *cmp) {
+    if (value_is_number(a) && value_is_number(b)) {
+        if (!path_is_double(a) && !path_is_double(b)) {
+            int64_t x = (int64_t)a->as.number, y = (int64_t)b->as.number;
+            *cmp = (x > y) - (x < y);
+        } else {
+            double x = path_is_double(a) ? a->as.floating : (double)(int64_t)a->as.number;
+            double y = path_is_double(b) ? b->as.floating : (double)(int64_t)b->as.number;
+            *cmp = (x > y) - (x < y);
+        }
+        return 1;
+    }
+    if (value_is_string(a) && value_is_string(b)) {
+        size_t n = a->as.string.len < b->as.string.len ? a->as.string.len : b->as.string.len;
+        int c = memcmp(a->as.string.data, b->as.string.data, n);
+        if (c == 0) c = (a->as.string.len > b->as.string.len) - (a->as.string.len < b->as.string.len);
+        *cmp = (c > 0) - (c < 0);
+        return 1;
+    }
+    return 0;
+}
+
+static int path_test(vm_t *vm, path_expr_t *e, value_t *node) {
+    switch (e->op) {
+        case EXPR_AND:
+            return path_test(vm, e->lhs, node) && path_test(vm, e->rhs, node);
+        case EXPR_OR:
+            return path_test(vm, e->lhs, node) || path_test(vm, e->rhs, node);
+        case EXPR_NOT:
+            return !path_test(vm, e->lhs, node);
+        case EXPR_EXISTS:
+            return path_lookup(vm, e->rel, e->nrel, node) != NULL;
+        default:
+            break;
+    }
+
+    value_t *v = path_lookup(vm, e->rel, e->nrel, node);
+    int cmp = 0;
+    int ordered = v && path_order(v, e->literal, &cmp);
+    int equal = ordered ? cmp == 0 : v && value_equal(v, e->literal);
+    switch (e->op) {
+        case EXPR_EQ: return equal;
+        case EXPR_NE: return !equal;
+        case EXPR_LT: return ordered && cmp < 0;
+        case EXPR_LE: return ordered && cmp <= 0;
+        case EXPR_GT: return ordered && cmp > 0;
+        case EXPR_GE: return ordered && cmp >= 0;
+        default: return 0;
+    }
+}
+
+// Applies one step at node and continues with rest from each match.
+static int path_select(path_out_t *o, path_step_t *step, path_step_t *rest, size_t nrest, value_t *node) {
+    switch (step->kind) {
+        case PATH_CHILD: {
+            if (!value_is_hash(node)) return 1;
+            value_t *v = hash_get_cached(o->vm, node, step->key, &step->ic);
+            return !v || path_eval(o, rest, nrest, v);
+        }
+        case PATH_INDEX: {
+            if (!value_is_vector(node)) return 1;
+            int64_t size = (int64_t)node->as.vector.size;
+            int64_t at = step->start < 0 ? step->start + size : step->start;
+            return at < 0 || at >= size || path_eval(o, rest, nrest, node->as.vector.elements[at]);
+        }
+        case PATH_WILDCARD:
+            return path_each_child(o, rest, nrest, node);
+        case PATH_SLICE: {
+            if (!value_is_vector(node) || step->step == 0) return 1;
+            // Python's rules: negative bounds count from the end and are
+            // clamped to the vector.
+            int64_t size = (int64_t)node->as.vector.size;
+            int64_t lo = step->start < 0 ? step->start + size : step->start;
+            int64_t hi = step->end < 0 ? step->end + size : step->end;
+            if (step->step > 0) {
+                lo = !step->has_start || lo < 0 ? 0 : lo > size ? size : lo;
+                hi = !step->has_end ? size : hi < 0 ? 0 : hi > size ? size : hi;
+                for (int64_t i = lo; i < hi; i += step->step) {
+                    if (!path_eval(o, rest, nrest, node->as.vector.elements[i])) return 0;
+                }
+            } else {
+                lo = !step->has_start || lo >= size ? size - 1 : lo < -1 ? -1 : lo;
+                hi = !step->has_end || hi < -1 ? -1 : hi >= size ? size - 1 : hi;
+                for (int64_t i = lo; i > hi; i += step->step) {
+                    if (!path_eval(o, rest, nrest, node->as.vector.elements[i])) return 0;
+                }
+            }
+            return 1;
+        }
+        case PATH_UNION:
+            for (size_t i = 0; i < step->nalts; i++) {
+                if (!path_select(o, &step->alts[i], rest, nrest, node)) return 0;
+            }
+            return 1;
+        case PATH_FILTER: {
+            if (value_is_vector(node)) {
+                for (size_t i = 0; i < node->as.vector.size; i++) {
+                    value_t *child = value_force(o->vm, node->as.vector.elements[i]);
+                    if (!child) return 0;
+                    if (path_test(o->vm, step->filter, child) && !path_eval(o, rest, nrest, child)) return 0;
+                }
+            } else if (value_is_hash(node)) {
+                size_t iter = 0;
+                value_t *key, *val;
+                while (hash_next(node, &iter, &key, &val)) {
+                    value_t *child = value_force(o->vm, val);
+                    if (!child) return 0;
+                    if (path_test(o->vm, step->filter, child) && !path_eval(o, rest, nrest, child)) return 0;
+                }
+            }
+            return 1;
+        }
+    }
+    return 1;
+}
+
+static int path_eval(path_out_t *o, path_step_t *steps, size_t n, value_t *node) {
+    node = value_force(o->vm, node);
+    if (!node) return 0;
+    if (n == 0) return vector_push(o->vm, o->results, node) != NULL;
+
+    if (!path_select(o, steps, steps + 1, n - 1, node)) return 0;
+    // '..' tries the same step again below every child.
+    return !steps->descend || path_each_child(o, steps, n, node);
+}
+
+value_t *json_path_apply(vm_t *vm, value_t *path, value_t *doc) {
+    if (!value_is_path(path)) {
+        vm_set_error(vm, VERR_TYPE, "json-path-apply: expected compiled path");
+        return NULL;
+    }
+    json_path_t *compiled = path->as.path.compiled;
+    path_out_t out = { vm, value_vector(vm) };
+    if (!out.results) return NULL;
+    if (!path_eval(&out, compiled->steps, compiled->nsteps, doc)) {
+        value_release(vm, out.results);
+        return NULL;
+    }
+    return out.results;
+}
+
+value_t *json_path_apply_each(vm_t *vm, value_t *path, value_t *docs) {
+    docs = value_force(vm, docs);
+    if (!docs) return NULL;
+    if (!value_is_vector(docs)) {
+        vm_set_error(vm, VERR_TYPE, "json-path-apply-each: expected vector of documents");
+        return NULL;
+    }
+
+    size_t n = docs->as.vector.size;
+    value_t **items = gc_malloc(vm, (n ? n : 1) * sizeof(value_t *));
+    if (!items) {
+        vm_set_error(vm, VERR_RUNTIME, "out of memory");
+        return NULL;
+    }
+    size_t i = 0;
+    for (; i < n; i++) {
+        if (vm_check_interrupt(vm)) break;
+        items[i] = json_path_apply(vm, path, docs->as.vector.elements[i]);
+        if (!items[i]) break;
+    }
+
+    value_t *result = i == n ? value_vector_take(vm, items, n) : NULL;
+    if (!result) {
+        while (i > 0) value_release(vm, items[--i]);
+    }
+    gc_free(vm, items);
+    return result;
+}
@@ -0,0 +1,20 @@
+#ifndef JSONPATH_H
+#define JSONPATH_H
+
+#include "vm.h"
+#include "value.h"
+
+// Compiles a JSONPath expression into a reusable selector value. Supported:
+// $ (optional), .name, ['name'], [n] (negative from the end), .* and [*],
+// ..name and the other selectors after .. for recursive descent,
+// [start:end:step], unions such as ['a','b'] or [0,2], and filters
+// [?(@.key < 3 && @.tag == 'x')] with ==, !=, <, <=, >, >=, !, && and ||.
+value_t *json_path_compile(vm_t *vm, const char *expr, size_t len);
+
+// Returns a vector of every value the selector matches in doc, in document
+// order; json_path_apply_each() does the same for each document in a vector
+// and returns a vector of those vectors.
+value_t *json_path_apply(vm_t *vm, value_t *path, value_t *doc);
+value_t *json_path_apply_each(vm_t *vm, value_t *path, value_t *docs);
+
+#endif
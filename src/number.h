@@ -0,0 +1,30 @@
+#ifndef NUMBER_H
+#define NUMBER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Decimal text for numbers, shared by the reader, JSON and the printers.
+
+#define NUMBER_TEXT_MAX 32  // enough for any output of number_format_*()
+
+typedef struct number {
+    uint64_t n;      // an integer; negative ones in two's complement
+    double d;
+    int is_double;   // set for a '.', an exponent or an integer past 64 bits
+} number_t;
+
+// Reads the longest number at the start of s, of the form
+// [+-]?digits*(.digits*)?([eE][+-]?digits+)? with at least one digit
+// before any exponent, and returns the bytes it took, or 0 if there is no
+// number there. Doubles, and integers past 64 bits, are read as correctly
+// rounded doubles.
+size_t number_parse(const char *s, size_t len, number_t *out);
+
+// Writes n, or the shortest digits that read back as d, to buf without a
+// terminating NUL and returns the length. A double always has a '.' or an
+// exponent; NaN and infinities are +nan.0, +inf.0 and -inf.0.
+size_t number_format_uint(uint64_t n, char *buf);
+size_t number_format_double(double d, char *buf);
+
+#endif
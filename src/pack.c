@@ -0,0 +1,490 @@
+#include "pack.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define PACK_MAX_DEPTH 10000
+
+static const char *pack_name(pack_format_t format, int decode) {
+    if (format == PACK_CBOR) return decode ? "cbor-decode" : "cbor-encode";
+    return decode ? "msgpack-decode" : "msgpack-encode";
+}
+
+/*
+ * Encoding. Both formats put a type and a length or value in one byte when
+ * it is small and follow it with 1, 2, 4 or 8 big-endian bytes otherwise,
+ * so each item costs one short put before its payload.
+ */
+
+static int pack_put_be(json_writer_t *w, uint8_t lead, uint64_t n, int bytes) {
+    uint8_t buf[9];
+    buf[0] = lead;
+    for (int i = bytes; i > 0; i--) {
+        buf[i] = (uint8_t)n;
+        n >>= 8;
+    }
+    return json_writer_put(w, buf, (size_t)bytes + 1);
+}
+
+// CBOR: a major type in the top three bits, then the argument.
+static int cbor_head(json_writer_t *w, uint8_t major, uint64_t n) {
+    major <<= 5;
+    if (n < 24) return pack_put_be(w, major | (uint8_t)n, 0, 0);
+    if (n <= 0xff) return pack_put_be(w, major | 24, n, 1);
+    if (n <= 0xffff) return pack_put_be(w, major | 25, n, 2);
+    if (n <= 0xffffffff) return pack_put_be(w, major | 26, n, 4);
+    return pack_put_be(w, major | 27, n, 8);
+}
+
+typedef enum {
+    PACK_UINT,
+    PACK_STR,
+    PACK_ARRAY,
+    PACK_MAP,
+} pack_kind_t;
+
+static int pack_head(json_writer_t *w, pack_format_t format, pack_kind_t kind, uint64_t n) {
+    if (format == PACK_CBOR) {
+        static const uint8_t major[] = { 0, 3, 4, 5 };
+        return cbor_head(w, major[kind], n);
+    }
+    switch (kind) {
+        case PACK_UINT:
+            if (n < 0x80) return pack_put_be(w, (uint8_t)n, 0, 0);
+            if (n <= 0xff) return pack_put_be(w, 0xcc, n, 1);
+            if (n <= 0xffff) return pack_put_be(w, 0xcd, n, 2);
+            if (n <= 0xffffffff) return pack_put_be(w, 0xce, n, 4);
+            return pack_put_be(w, 0xcf, n, 8);
+        case PACK_STR:
+            if (n < 32) return pack_put_be(w, 0xa0 | (uint8_t)n, 0, 0);
+            if (n <= 0xff) return pack_put_be(w, 0xd9, n, 1);
+            return n <= 0xffff ? pack_put_be(w, 0xda, n, 2) : pack_put_be(w, 0xdb, n, 4);
+        case PACK_ARRAY:
+            if (n < 16) return pack_put_be(w, 0x90 | (uint8_t)n, 0, 0);
+            return n <= 0xffff ? pack_put_be(w, 0xdc, n, 2) : pack_put_be(w, 0xdd, n, 4);
+        case PACK_MAP:
+            if (n < 16) return pack_put_be(w, 0x80 | (uint8_t)n, 0, 0);
+            return n <= 0xffff ? pack_put_be(w, 0xde, n, 2) : pack_put_be(w, 0xdf, n, 4);
+    }
+    return 0;
+}
+
+static int pack_string(json_writer_t *w, pack_format_t format, const char *s, size_t len) {
+    if (format == PACK_MSGPACK && len > 0xffffffff) {
+        vm_set_error(w->vm, VERR_RUNTIME, "msgpack-encode: string too long");
+        return 0;
+    }
+    return pack_head(w, format, PACK_STR, len) && json_writer_put(w, s, len);
+}
+
+static int pack_value(json_writer_t *w, pack_format_t format, value_t *val);
+
+static int pack_items(json_writer_t *w, pack_format_t format, value_t *val) {
+    switch (val->type) {
+        case VTYPE_VECTOR:
+            if (!pack_head(w, format, PACK_ARRAY, val->as.vector.size)) return 0;
+            for (size_t i = 0; i < val->as.vector.size; i++) {
+                if (!pack_value(w, format, val->as.vector.elements[i])) return 0;
+            }
+            return 1;
+        case VTYPE_HASH: {
+            if (!pack_head(w, format, PACK_MAP, val->as.hash.size)) return 0;
+            size_t iter = 0;
+            value_t *key, *item;
+            while (hash_next(val, &iter, &key, &item)) {
+                if (!pack_value(w, format, key) || !pack_value(w, format, item)) return 0;
+            }
+            return 1;
+        }
+        case VTYPE_RECORD: {
+            // Records encode as maps keyed by field name.
+            value_t *type = val->as.record.type;
+            if (!pack_head(w, format, PACK_MAP, type->as.record_type.nfields)) return 0;
+            for (size_t i = 0; i < type->as.record_type.nfields; i++) {
+                const char *field = type->as.record_type.fields[i]->as.symbol.name;
+                if (!pack_string(w, format, field, strlen(field)) || !pack_value(w, format, val->as.record.slots[i])) {
+                    return 0;
+                }
+            }
+            return 1;
+        }
+        default:
+            return 0;
+    }
+}
+
+static int pack_value(json_writer_t *w, pack_format_t format, value_t *val) {
+    uint8_t nil = format == PACK_CBOR ? 0xf6 : 0xc0;
+    if (!val) return json_writer_put(w, &nil, 1);
+
+    switch (val->type) {
+        case VTYPE_BOOL: {
+            uint8_t b = format == PACK_CBOR ? (val->as.boolean ? 0xf5 : 0xf4) : (val->as.boolean ? 0xc3 : 0xc2);
+            return json_writer_put(w, &b, 1);
+        }
+        case VTYPE_NUMBER:
+            if (val->flags & VALUE_DOUBLE) {
+                uint64_t bits;
+                memcpy(&bits, &val->as.floating, sizeof(bits));
+                return pack_put_be(w, format == PACK_CBOR ? 0xfb : 0xcb, bits, 8);
+            }
+            return pack_head(w, format, PACK_UINT, val->as.number);
+        case VTYPE_STRING:
+            return pack_string(w, format, val->as.string.data, val->as.string.len);
+        case VTYPE_LAZY:
+            val = value_force(w->vm, val);
+            return val && pack_value(w, format, val);
+        case VTYPE_VECTOR:
+        case VTYPE_HASH:
+        case VTYPE_RECORD: {
+            // A cycle would otherwise write forever.
+            if (w->depth >= PACK_MAX_DEPTH) {
+                vm_set_error(w->vm, VERR_RUNTIME, "%s: nested too deeply", pack_name(format, 0));
+                w->failed = 1;
+                return 0;
+            }
+            w->depth++;
+            int ok = pack_items(w, format, val);
+            w->depth--;
+            return ok;
+        }
+        default:
+            return json_writer_put(w, &nil, 1);
+    }
+}
+
+int pack_write(json_writer_t *w, pack_format_t format, value_t *val) {
+    return pack_value(w, format, val) && json_writer_flush(w);
+}
+
+value_t *pack_encode(vm_t *vm, pack_format_t format, value_t *val) {
+    json_writer_t w;
+    json_writer_init(&w, vm);
+    // Strings keep a NUL after their bytes.
+    if (!pack_write(&w, format, val) || !json_writer_put(&w, "", 1)) {
+        json_writer_free(&w);
+        return NULL;
+    }
+
+    // The writer grows in large steps; give back the slack.
+    char *buf = w.cap > w.len ? gc_realloc(vm, w.buf, w.cap, w.len) : w.buf;
+    if (buf) w.buf = buf;
+    value_t *result = value_string_take(vm, w.buf, w.len - 1);
+    if (!result) json_writer_free(&w);
+    return result;
+}
+
+/*
+ * Decoding reads straight from the string being decoded. Every length is
+ * checked against the bytes left before anything is allocated for it, so
+ * a hostile count fails as truncated input instead of exhausting memory.
+ */
+
+typedef struct pack_reader {
+    vm_t *vm;
+    value_t *source;
+    const uint8_t *s;
+    size_t pos;
+    size_t len;
+    pack_format_t format;
+    int depth;
+} pack_reader_t;
+
+static int pack_fail(pack_reader_t *r, const char *msg) {
+    vm_set_error(r->vm, VERR_RUNTIME, "%s: %s at offset %zu", pack_name(r->format, 1), msg, r->pos);
+    return 0;
+}
+
+static int pack_read_be(pack_reader_t *r, int bytes, uint64_t *out) {
+    if (r->len - r->pos < (size_t)bytes) return pack_fail(r, "truncated input");
+    uint64_t n = 0;
+    for (int i = 0; i < bytes; i++) n = n << 8 | r->s[r->pos++];
+    *out = n;
+    return 1;
+}
+
+static double pack_half(uint16_t h) {
+    int exp = (h >> 10) & 0x1f;
+    int mant = h & 0x3ff;
+    double d = exp == 0 ? ldexp(mant, -24) : exp == 31 ? (mant ? NAN : INFINITY) : ldexp(mant + 1024, exp - 25);
+    return h & 0x8000 ? -d : d;
+}
+
+static value_t *pack_double(pack_reader_t *r, int bytes) {
+    uint64_t bits;
+    if (!pack_read_be(r, bytes, &bits)) return NULL;
+    double d;
+    if (bytes == 2) {
+        d = pack_half((uint16_t)bits);
+    } else if (bytes == 4) {
+        uint32_t b32 = (uint32_t)bits;
+        float f;
+        memcpy(&f, &b32, sizeof(f));
+        d = f;
+    } else {
+        memcpy(&d, &bits, sizeof(d));
+    }
+    return value_double(r->vm, d);
+}
+
+static value_t *pack_slice(pack_reader_t *r, uint64_t len) {
+    if (r->len - r->pos < len) {
+        pack_fail(r, "truncated input");
+        return NULL;
+    }
+    value_t *str = value_string_slice(r->vm, r->source, r->pos, (size_t)len);
+    r->pos += (size_t)len;
+    return str;
+}
+
+static value_t *pack_item(pack_reader_t *r);
+
+// Reads n items (or, with n -1, CBOR items up to a break) into a vector.
+static value_t *pack_array(pack_reader_t *r, int64_t n) {
+    size_t cap = n >= 0 ? (size_t)n : 8, count = 0;
+    if (n >= 0 && (uint64_t)n > r->len - r->pos) {
+        pack_fail(r, "truncated input");
+        return NULL;
+    }
+    value_t **items = gc_malloc(r->vm, (cap ? cap : 1) * sizeof(value_t *));
+    if (!items) {
+        vm_set_error(r->vm, VERR_RUNTIME, "out of memory");
+        return NULL;
+    }
+
+    for (;;) {
+        if (n >= 0 ? count == (size_t)n : r->pos < r->len && r->s[r->pos] == 0xff) break;
+        if (count == cap) {
+            value_t **grown = gc_realloc(r->vm, items, cap * sizeof(value_t *), cap * 2 * sizeof(value_t *));
+            if (!grown) {
+                vm_set_error(r->vm, VERR_RUNTIME, "out of memory");
+                goto fail;
+            }
+            items = grown;
+            cap *= 2;
+        }
+        if (!(items[count] = pack_item(r))) goto fail;
+        count++;
+    }
+    if (n < 0) r->pos++;
+
+    value_t *vec = value_vector_take(r->vm, items, count);
+    if (!vec) goto fail;
+    gc_free(r->vm, items);
+    return vec;
+
+fail:
+    while (count > 0) value_release(r->vm, items[--count]);
+    gc_free(r->vm, items);
+    return NULL;
+}
+
+static value_t *pack_map(pack_reader_t *r, int64_t n) {
+    if (n >= 0 && (uint64_t)n > (r->len - r->pos) / 2) {
+        pack_fail(r, "truncated input");
+        return NULL;
+    }
+    value_t *hash = value_hash(r->vm);
+    if (!hash) return NULL;
+
+    for (int64_t i = 0; n < 0 || i < n; i++) {
+        if (n < 0 && r->pos < r->len && r->s[r->pos] == 0xff) {
+            r->pos++;
+            break;
+        }
+        value_t *key = pack_item(r);
+        value_t *val = key ? pack_item(r) : NULL;
+        if (!val) {
+            value_release(r->vm, key);
+            value_release(r->vm, hash);
+            return NULL;
+        }
+        if (!(value_is_string(key) || value_is_number(key)) || !hash_set(r->vm, hash, key, val)) {
+            if (value_is_string(key) || value_is_number(key)) {
+                vm_set_error(r->vm, VERR_RUNTIME, "out of memory");
+            } else {
+                pack_fail(r, "map keys must be strings or numbers");
+            }
+            value_release(r->vm, key);
+            value_release(r->vm, val);
+            value_release(r->vm, hash);
+            return NULL;
+        }
+        value_release(r->vm, key);
+        value_disown(val);
+    }
+    return hash;
+}
+
+// Joins the chunks of an indefinite-length CBOR string; the only case
+// where decoding copies.
+static value_t *cbor_chunks(pack_reader_t *r, uint8_t major) {
+    size_t start = r->pos, total = 0;
+    for (;;) {
+        if (r->pos >= r->len) {
+            pack_fail(r, "truncated input");
+            return NULL;
+        }
+        uint8_t b = r->s[r->pos++];
+        if (b == 0xff) break;
+        uint64_t n = b & 0x1f;
+        if (b >> 5 != major || n > 27 || (n >= 24 && !pack_read_be(r, 1 << (n - 24), &n))) {
+            if (b >> 5 != major || n > 27) pack_fail(r, "invalid string chunk");
+            return NULL;
+        }
+        if (r->len - r->pos < n) {
+            pack_fail(r, "truncated input");
+            return NULL;
+        }
+        r->pos += (size_t)n;
+        total += (size_t)n;
+    }
+
+    char *buf = gc_malloc(r->vm, total + 1);
+    if (!buf) {
+        vm_set_error(r->vm, VERR_RUNTIME, "out of memory");
+        return NULL;
+    }
+    // The chunks were validated above; copy them out in a second pass.
+    size_t end = r->pos, out = 0;
+    r->pos = start;
+    while (r->s[r->pos] != 0xff) {
+        uint64_t n = r->s[r->pos++] & 0x1f;
+        if (n >= 24) pack_read_be(r, 1 << (n - 24), &n);
+        memcpy(buf + out, r->s + r->pos, (size_t)n);
+        r->pos += (size_t)n;
+        out += (size_t)n;
+    }
+    r->pos = end;
+    buf[total] = '\0';
+
+    value_t *str = value_string_take(r->vm, buf, total);
+    if (!str) gc_free(r->vm, buf);
+    return str;
+}
+
+static value_t *cbor_item(pack_reader_t *r) {
+    uint8_t b = r->s[r->pos++];
+    uint8_t major = b >> 5, info = b & 0x1f;
+
+    if (major == 7) {
+        switch (info) {
+            case 20: return value_bool(r->vm, 0);
+            case 21: return value_bool(r->vm, 1);
+            case 25: return pack_double(r, 2);
+            case 26: return pack_double(r, 4);
+            case 27: return pack_double(r, 8);
+            case 24:
+                if (r->pos >= r->len) break;
+                r->pos++;
+                return value_null(r->vm);
+            case 31:
+                pack_fail(r, "unexpected break");
+                return NULL;
+            default:
+                // null, undefined and the other simple values.
+                if (info < 24) return value_null(r->vm);
+                break;
+        }
+        pack_fail(r, info < 28 ? "truncated input" : "invalid simple value");
+        return NULL;
+    }
+
+    uint64_t n = info;
+    if (info == 31) {
+        if (major == 4) return pack_array(r, -1);
+        if (major == 5) return pack_map(r, -1);
+        if (major == 2 || major == 3) return cbor_chunks(r, major);
+        pack_fail(r, "invalid indefinite length");
+        return NULL;
+    }
+    if (info > 27) {
+        pack_fail(r, "invalid additional information");
+        return NULL;
+    }
+    if (info >= 24 && !pack_read_be(r, 1 << (info - 24), &n)) return NULL;
+
+    switch (major) {
+        case 0: return value_number(r->vm, n);
+        case 1: return value_number(r->vm, ~n);  // -1 - n, as JSON stores negatives
+        case 2:
+        case 3: return pack_slice(r, n);
+        case 4:
+        case 5:
+            if (n > r->len) {
+                pack_fail(r, "truncated input");
+                return NULL;
+            }
+            return major == 4 ? pack_array(r, (int64_t)n) : pack_map(r, (int64_t)n);
+        default:
+            return pack_item(r);  // a tag: decode what it tags
+    }
+}
+
+static value_t *msgpack_item(pack_reader_t *r) {
+    uint8_t b = r->s[r->pos++];
+    uint64_t n;
+
+    if (b < 0x80) return value_number(r->vm, b);
+    if (b >= 0xe0) return value_number(r->vm, (uint64_t)(int64_t)(int8_t)b);
+    if (b < 0x90) return pack_map(r, b & 0x0f);
+    if (b < 0xa0) return pack_array(r, b & 0x0f);
+    if (b < 0xc0) return pack_slice(r, b & 0x1f);
+
+    switch (b) {
+        case 0xc0: return value_null(r->vm);
+        case 0xc2: return value_bool(r->vm, 0);
+        case 0xc3: return value_bool(r->vm, 1);
+        case 0xca: return pack_double(r, 4);
+        case 0xcb: return pack_double(r, 8);
+        case 0xc4: case 0xd9: return pack_read_be(r, 1, &n) ? pack_slice(r, n) : NULL;
+        case 0xc5: case 0xda: return pack_read_be(r, 2, &n) ? pack_slice(r, n) : NULL;
+        case 0xc6: case 0xdb: return pack_read_be(r, 4, &n) ? pack_slice(r, n) : NULL;
+        case 0xcc: return pack_read_be(r, 1, &n) ? value_number(r->vm, n) : NULL;
+        case 0xcd: return pack_read_be(r, 2, &n) ? value_number(r->vm, n) : NULL;
+        case 0xce: return pack_read_be(r, 4, &n) ? value_number(r->vm, n) : NULL;
+        case 0xcf: return pack_read_be(r, 8, &n) ? value_number(r->vm, n) : NULL;
+        case 0xd0: return pack_read_be(r, 1, &n) ? value_number(r->vm, (uint64_t)(int64_t)(int8_t)n) : NULL;
+        case 0xd1: return pack_read_be(r, 2, &n) ? value_number(r->vm, (uint64_t)(int64_t)(int16_t)n) : NULL;
+        case 0xd2: return pack_read_be(r, 4, &n) ? value_number(r->vm, (uint64_t)(int64_t)(int32_t)n) : NULL;
+        case 0xd3: return pack_read_be(r, 8, &n) ? value_number(r->vm, n) : NULL;
+        case 0xdc: return pack_read_be(r, 2, &n) ? pack_array(r, (int64_t)n) : NULL;
+        case 0xdd: return pack_read_be(r, 4, &n) ? pack_array(r, (int64_t)n) : NULL;
+        case 0xde: return pack_read_be(r, 2, &n) ? pack_map(r, (int64_t)n) : NULL;
+        case 0xdf: return pack_read_be(r, 4, &n) ? pack_map(r, (int64_t)n) : NULL;
+        default:
+            r->pos--;
+            pack_fail(r, "unsupported type");  // extension types and 0xc1
+            return NULL;
+    }
+}
+
+static value_t *pack_item(pack_reader_t *r) {
+    if (r->pos >= r->len) {
+        pack_fail(r, "truncated input");
+        return NULL;
+    }
+    if (r->depth >= PACK_MAX_DEPTH) {
+        pack_fail(r, "nested too deeply");
+        return NULL;
+    }
+    r->depth++;
+    value_t *v = r->format == PACK_CBOR ? cbor_item(r) : msgpack_item(r);
+    r->depth--;
+    return v;
+}
+
+value_t *pack_decode(vm_t *vm, pack_format_t format, value_t *data) {
+    if (!value_is_string(data)) {
+        vm_set_error(vm, VERR_TYPE, "%s: expected string", pack_name(format, 1));
+        return NULL;
+    }
+    pack_reader_t r = { vm, data, (const uint8_t *)data->as.string.data, 0, data->as.string.len, format, 0 };
+    value_t *result = pack_item(&r);
+    if (result && r.pos < r.len) {
+        pack_fail(&r, "trailing data");
+        value_release(vm, result);
+        return NULL;
+    }
+    return result;
+}
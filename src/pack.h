@@ -0,0 +1,27 @@
+#ifndef PACK_H
+#define PACK_H
+
+#include "vm.h"
+#include "value.h"
+#include "json.h"
+
+// Binary serialisation in CBOR (RFC 8949) or MessagePack. Numbers encode
+// as unsigned integers or, with VALUE_DOUBLE, as 64-bit floats; strings,
+// vectors, hashes and records map to text strings, arrays and maps, and
+// anything else to null. Decoding accepts every integer and float width,
+// byte strings (as strings), CBOR tags (skipped) and indefinite lengths.
+typedef enum {
+    PACK_CBOR,
+    PACK_MSGPACK,
+} pack_format_t;
+
+// Writes val through a json_writer_t, growing its buffer or flushing it to
+// an fd or sink as for JSON.
+int pack_write(json_writer_t *w, pack_format_t format, value_t *val);
+value_t *pack_encode(vm_t *vm, pack_format_t format, value_t *val);
+
+// Decodes one item that fills data, a string value; strings in the result
+// are slices of data rather than copies.
+value_t *pack_decode(vm_t *vm, pack_format_t format, value_t *data);
+
+#endif
@@ -1,12 +1,21 @@
 #include "reader.h"
+#include "number.h"
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 reader_t *reader_create(vm_t *vm, const char *input) {
-    reader_t *r = calloc(1, sizeof(reader_t));
+    reader_t *r = gc_malloc(vm, sizeof(reader_t));
     if (!r) return NULL;
+    memset(r, 0, sizeof(reader_t));
 
     r->input = input;
     r->len = strlen(input);
@@ -16,22 +25,139 @@ reader_t *reader_create(vm_t *vm, const char *input) {
     return r;
 }
 
+// Reads from a string value; string literals become slices of it.
+reader_t *reader_create_value(vm_t *vm, value_t *source) {
+    if (!value_is_string(source)) return NULL;
+
+    reader_t *r = gc_malloc(vm, sizeof(reader_t));
+    if (!r) return NULL;
+    memset(r, 0, sizeof(reader_t));
+
+    r->input = source->as.string.data;
+    r->len = source->as.string.len;
+    r->pos = 0;
+    r->vm = vm;
+    r->source = source;
+    value_retain(source);
+
+    return r;
+}
+
 void reader_destroy(reader_t *r) {
-    free(r);
+    if (!r) return;
+    if (r->source) value_release(r->vm, r->source);
+    gc_free(r->vm, r->stack);
+    gc_free(r->vm, r);
+}
+
+// Values in an arena are freed with it, never one by one.
+static void reader_discard(reader_t *r, value_t *v) {
+    if (!value_in_arena(v)) value_release(r->vm, v);
+}
+
+static int reader_push(reader_t *r, value_t *v) {
+    if (r->nstack == r->stack_cap) {
+        size_t cap = r->stack_cap ? r->stack_cap * 2 : 64;
+        value_t **stack = gc_realloc(r->vm, r->stack, r->stack_cap * sizeof(value_t *), cap * sizeof(value_t *));
+        if (!stack) {
+            vm_set_error(r->vm, VERR_RUNTIME, "out of memory");
+            return 0;
+        }
+        r->stack = stack;
+        r->stack_cap = cap;
+    }
+    r->stack[r->nstack++] = v;
+    return 1;
+}
+
+static value_t *reader_pair(reader_t *r, value_t *car, value_t *cdr) {
+    if (r->arena) return value_arena_pair(r->arena, car, cdr);
+    return value_pair(r->vm, car, cdr);
+}
+
+/*
+ * Tokens are found by scanning ahead for the byte that ends them, 16 bytes
+ * at a time with SSE2, and are then made into a value with one copy. Every
+ * byte up to ' ' counts as whitespace. Tokens are short and runs of
+ * whitespace and string text rarely reach 32 bytes, so AVX2 would not pay.
+ */
+
+static inline int reader_is_delimiter(unsigned char c) {
+    return c <= ' ' || c == '"' || c == ';' || c == '(' || c == ')' ||
+           c == '[' || c == ']' || c == '{' || c == '}';
+}
+
+// Returns the position of the first delimiter at or after i.
+static size_t reader_scan_token(const char *s, size_t i, size_t len) {
+#if defined(__SSE2__)
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i semi = _mm_set1_epi8(';');
+    const __m128i paren = _mm_set1_epi8('(');
+    const __m128i open = _mm_set1_epi8('{');    // [ and { differ only in bit 5
+    const __m128i close = _mm_set1_epi8('}');
+    const __m128i low = _mm_set1_epi8(0x20);
+    const __m128i odd = _mm_set1_epi8((char)0xfe);
+    while (i + 16 <= len) {
+        __m128i c = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i folded = _mm_or_si128(c, low);
+        __m128i hit = _mm_cmpeq_epi8(_mm_min_epu8(c, space), c);
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(c, quote));
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(c, semi));
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(_mm_and_si128(c, odd), paren));
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(folded, open));
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(folded, close));
+        int mask = _mm_movemask_epi8(hit);
+        if (mask) return i + __builtin_ctz(mask);
+        i += 16;
+    }
+#endif
+    while (i < len && !reader_is_delimiter((unsigned char)s[i])) i++;
+    return i;
+}
+
+// Returns the position of the first byte above ' ' at or after i.
+static size_t reader_scan_space(const char *s, size_t i, size_t len) {
+#if defined(__SSE2__)
+    const __m128i space = _mm_set1_epi8(' ');
+    while (i + 16 <= len) {
+        __m128i c = _mm_loadu_si128((const __m128i *)(s + i));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(c, space), c));
+        if (mask != 0xffff) return i + __builtin_ctz(~mask);
+        i += 16;
+    }
+#endif
+    while (i < len && (unsigned char)s[i] <= ' ') i++;
+    return i;
+}
+
+// Returns the position of the first quote or backslash at or after i.
+static size_t reader_scan_string(const char *s, size_t i, size_t len) {
+#if defined(__SSE2__)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    while (i + 16 <= len) {
+        __m128i c = _mm_loadu_si128((const __m128i *)(s + i));
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(c, quote), _mm_cmpeq_epi8(c, backslash)));
+        if (mask) return i + __builtin_ctz(mask);
+        i += 16;
+    }
+#endif
+    while (i < len && s[i] != '"' && s[i] != '\\') i++;
+    return i;
+}
+
+// Returns the position of the newline ending a comment, or len.
+static size_t reader_scan_line(const char *s, size_t i, size_t len) {
+    const char *nl = memchr(s + i, '\n', len - i);
+    return nl ? (size_t)(nl - s) : len;
 }
 
 int reader_skip_whitespace(reader_t *r) {
     while (r->pos < r->len) {
-        char c = r->input[r->pos];
-        if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
-            r->pos++;
-        } else if (c == ';') {
-            while (r->pos < r->len && r->input[r->pos] != '\n') {
-                r->pos++;
-            }
-        } else {
-            break;
-        }
+        r->pos = reader_scan_space(r->input, r->pos, r->len);
+        if (r->pos >= r->len || r->input[r->pos] != ';') break;
+        r->pos = reader_scan_line(r->input, r->pos, r->len);
     }
     return r->pos < r->len;
 }
@@ -57,17 +183,46 @@ int reader_match(reader_t *r, char c) {
 value_t *read_string(reader_t *r) {
     reader_next(r);
 
-    char buf[4096];
-    size_t len = 0;
+    size_t start = r->pos;
+    int has_escape = 0;
 
-    while (r->pos < r->len) {
-        int c = reader_next(r);
-        if (c == '"') {
-            buf[len] = '\0';
-            return value_string(r->vm, buf);
+    for (;;) {
+        r->pos = reader_scan_string(r->input, r->pos, r->len);
+        if (r->pos >= r->len || r->input[r->pos] == '"') break;
+        has_escape = 1;
+        r->pos += 2;
+    }
+
+    if (r->pos >= r->len) {
+        r->pos = r->len;
+        vm_set_error(r->vm, VERR_SYNTAX, "unterminated string");
+        return NULL;
+    }
+
+    size_t end = r->pos++;
+
+    if (!has_escape) {
+        if (r->arena) {
+            return value_arena_string(r->arena, r->input + start, end - start);
         }
-        if (c == '\\' && r->pos < r->len) {
-            int next = reader_next(r);
+        if (r->source) {
+            return value_string_slice(r->vm, r->source, start, end - start);
+        }
+        return value_string_n(r->vm, r->input + start, end - start);
+    }
+
+    value_t *str = r->arena ? value_arena_string(r->arena, NULL, end - start) : NULL;
+    char *buf = str ? str->as.string.data : r->arena ? NULL : gc_malloc(r->vm, end - start + 1);
+    if (!buf) {
+        vm_set_error(r->vm, VERR_RUNTIME, "out of memory");
+        return NULL;
+    }
+
+    size_t len = 0;
+    for (size_t i = start; i < end; i++) {
+        int c = r->input[i];
+        if (c == '\\' && i + 1 < end) {
+            int next = r->input[++i];
             switch (next) {
                 case 'n': c = '\n'; break;
                 case 'r': c = '\r'; break;
@@ -77,77 +232,74 @@ value_t *read_string(reader_t *r) {
                 default: c = next; break;
             }
         }
-        if (len < sizeof(buf) - 1) {
-            buf[len++] = c;
-        }
-    }
-
-    vm_set_error(r->vm, VERR_SYNTAX, "unterminated string");
-    return NULL;
-}
-
-value_t *read_number(reader_t *r) {
-    char buf[256];
-    size_t len = 0;
-    int is_float = 0;
-
-    int c = reader_peek(r);
-    if (c == '-') {
-        buf[len++] = reader_next(r);
+        buf[len++] = c;
     }
+    buf[len] = '\0';
 
-    while (r->pos < r->len && isdigit(r->input[r->pos]) && len < sizeof(buf) - 1) {
-        buf[len++] = reader_next(r);
+    if (str) {
+        str->as.string.len = len;
+        return str;
     }
+    str = value_string_take(r->vm, buf, len);
+    if (!str) gc_free(r->vm, buf);
+    return str;
+}
 
-    if (r->pos < r->len && r->input[r->pos] == '.') {
-        is_float = 1;
-        buf[len++] = reader_next(r);
-        while (r->pos < r->len && isdigit(r->input[r->pos]) && len < sizeof(buf) - 1) {
-            buf[len++] = reader_next(r);
-        }
+// Steps over the token at the current position. A token that would be
+// empty starts with a delimiter the caller did not expect.
+static int reader_token(reader_t *r, size_t *start, size_t *end) {
+    *start = r->pos;
+    *end = r->pos = reader_scan_token(r->input, r->pos, r->len);
+    if (*end > *start) return 1;
+    if (r->pos < r->len) {
+        vm_set_error(r->vm, VERR_SYNTAX, "unexpected '%c'", r->input[r->pos]);
+    } else {
+        vm_set_error(r->vm, VERR_SYNTAX, "unexpected end of input");
     }
+    return 0;
+}
 
-    buf[len] = '\0';
-
-    if (is_float) {
-        double d = strtod(buf, NULL);
-        return value_double(r->vm, d);
+// Converts a token that number_parse() reads whole to a number in *out.
+// Returns 0 for anything else.
+static int reader_number(reader_t *r, const char *s, size_t len, value_t **out) {
+    number_t num;
+    if (number_parse(s, len, &num) != len) return 0;
+    if (num.is_double) {
+        *out = r->arena ? value_arena_double(r->arena, num.d) : value_double(r->vm, num.d);
     } else {
-        uint64_t n = strtoull(buf, NULL, 10);
-        return value_number(r->vm, n);
+        *out = r->arena ? value_arena_number(r->arena, num.n) : value_number(r->vm, num.n);
     }
+    return 1;
 }
 
-value_t *read_symbol(reader_t *r) {
-    char buf[256];
-    size_t len = 0;
+static value_t *reader_atom(reader_t *r, size_t start, size_t end) {
+    const char *s = r->input + start;
+    size_t len = end - start;
 
-    while (r->pos < r->len) {
-        int c = r->input[r->pos];
-        if (c == '(' || c == ')' || c == '[' || c == ']' || c == '{' || c == '}' ||
-            c == '"' || c == ';' || c == ' ' || c == '\t' || c == '\n' || c == '\r') {
-            break;
-        }
-        if (len < sizeof(buf) - 1) {
-            buf[len++] = c;
-        }
-        r->pos++;
+    if (len == 2 && s[0] == '#' && (s[1] == 't' || s[1] == 'f')) {
+        return value_bool(r->vm, s[1] == 't');
     }
-
-    buf[len] = '\0';
-
-    if (strcmp(buf, "null") == 0 || strcmp(buf, "#f") == 0 || strcmp(buf, "#t") == 0) {
-        if (strcmp(buf, "#t") == 0 || strcmp(buf, "true") == 0) {
-            return value_bool(r->vm, 1);
-        }
-        if (strcmp(buf, "#f") == 0 || strcmp(buf, "false") == 0) {
-            return value_bool(r->vm, 0);
-        }
+    if (len == 4 && memcmp(s, "null", 4) == 0) {
         return value_null(r->vm);
     }
+    if (r->arena) return value_arena_symbol(r->arena, s, len);
+    return value_symbol_n(r->vm, s, len);
+}
 
-    return value_symbol(r->vm, buf);
+// Numbers are tokens like any other: one that does not read as a number
+// whole, such as - or 12abc, is a symbol.
+value_t *read_number(reader_t *r) {
+    size_t start, end;
+    if (!reader_token(r, &start, &end)) return NULL;
+    value_t *num;
+    if (reader_number(r, r->input + start, end - start, &num)) return num;
+    return reader_atom(r, start, end);
+}
+
+value_t *read_symbol(reader_t *r) {
+    size_t start, end;
+    if (!reader_token(r, &start, &end)) return NULL;
+    return reader_atom(r, start, end);
 }
 
 value_t *read_list(reader_t *r, char end) {
@@ -161,91 +313,162 @@ value_t *read_list(reader_t *r, char end) {
 
         value_t *item = reader_read(r);
         if (!item) {
-            value_release(r->vm, head);
+            reader_discard(r, head);
             return NULL;
         }
 
         if (reader_peek(r) == '.') {
+            reader_discard(r, item);
             reader_next(r);
             reader_skip_whitespace(r);
             value_t *rest = reader_read(r);
             if (!rest) {
-                value_release(r->vm, head);
+                reader_discard(r, head);
                 return NULL;
             }
             *tail = rest;
             reader_skip_whitespace(r);
             if (!reader_match(r, end)) {
                 vm_set_error(r->vm, VERR_SYNTAX, "expected %c", end);
-                value_release(r->vm, head);
+                reader_discard(r, head);
                 return NULL;
             }
             return head;
         }
 
-        *tail = value_pair(r->vm, item, value_null(r->vm));
+        *tail = reader_pair(r, item, value_null(r->vm));
+        if (!*tail) {
+            reader_discard(r, item);
+            reader_discard(r, head);
+            return NULL;
+        }
+        if (!r->arena) value_disown(item);
         tail = &((*tail)->as.pair.cdr);
     }
 
     vm_set_error(r->vm, VERR_SYNTAX, "unterminated list");
-    value_release(r->vm, head);
+    reader_discard(r, head);
     return NULL;
 }
 
+// With an arena the items gather on the reader's stack and the vector is
+// built once their number is known.
 value_t *read_vector(reader_t *r) {
     reader_next(r);
 
-    value_t *vec = value_vector(r->vm);
-    if (!vec) return NULL;
+    size_t base = r->nstack;
+    value_t *vec = r->arena ? NULL : value_vector(r->vm);
+    if (!r->arena && !vec) return NULL;
 
-    reader_skip_whitespace(r);
-    while (reader_peek(r) != ']') {
+    while (reader_skip_whitespace(r) && reader_peek(r) != ']') {
         value_t *item = reader_read(r);
-        if (!item) {
-            value_release(r->vm, vec);
-            return NULL;
+        if (!item) goto fail;
+        if (r->arena) {
+            if (!reader_push(r, item)) goto fail;
+            continue;
+        }
+        if (!vector_push(r->vm, vec, item)) {
+            value_release(r->vm, item);
+            goto fail;
         }
-        vector_push(r->vm, vec, item);
-        reader_skip_whitespace(r);
+        value_disown(item);
     }
 
-    reader_next(r);
+    if (!reader_match(r, ']')) {
+        vm_set_error(r->vm, VERR_SYNTAX, "unterminated vector");
+        goto fail;
+    }
+    if (r->arena) {
+        vec = value_arena_vector(r->arena, r->stack + base, r->nstack - base);
+        r->nstack = base;
+    }
     return vec;
+
+fail:
+    r->nstack = base;
+    reader_discard(r, vec);
+    return NULL;
 }
 
 value_t *read_hash(reader_t *r) {
     reader_next(r);
 
-    value_t *hash = value_hash(r->vm);
-    if (!hash) return NULL;
+    size_t base = r->nstack;
+    value_t *hash = r->arena ? NULL : value_hash(r->vm);
+    if (!r->arena && !hash) return NULL;
 
-    reader_skip_whitespace(r);
-    while (reader_peek(r) != '}') {
+    while (reader_skip_whitespace(r) && reader_peek(r) != '}') {
         value_t *key = reader_read(r);
-        if (!key) {
-            value_release(r->vm, hash);
-            return NULL;
-        }
-
-        reader_skip_whitespace(r);
+        if (!key) goto fail;
 
-        value_t *val = reader_read(r);
+        value_t *val = reader_skip_whitespace(r) && reader_peek(r) != '}' ? reader_read(r) : NULL;
         if (!val) {
-            value_release(r->vm, key);
-            value_release(r->vm, hash);
-            return NULL;
+            if (vm_error_code(r->vm) == VERR_NONE) {
+                vm_set_error(r->vm, VERR_SYNTAX, "hash literal needs a value for every key");
+            }
+            reader_discard(r, key);
+            goto fail;
         }
 
-        hash_set(r->vm, hash, key, val);
-
-        reader_skip_whitespace(r);
+        if (r->arena) {
+            if (!reader_push(r, key) || !reader_push(r, val)) goto fail;
+            continue;
+        }
+        value_t *stored = hash_set(r->vm, hash, key, val);
+        value_release(r->vm, key);
+        if (!stored) {
+            value_release(r->vm, val);
+            goto fail;
+        }
+        value_disown(val);
     }
 
-    reader_next(r);
+    if (!reader_match(r, '}')) {
+        vm_set_error(r->vm, VERR_SYNTAX, "unterminated hash");
+        goto fail;
+    }
+    if (r->arena) {
+        // Keys and values alternate on the stack; value_arena_hash() wants
+        // them apart.
+        size_t n = (r->nstack - base) / 2;
+        value_t **keys = gc_malloc(r->vm, (n ? n : 1) * 2 * sizeof(value_t *));
+        if (!keys) {
+            vm_set_error(r->vm, VERR_RUNTIME, "out of memory");
+            goto fail;
+        }
+        for (size_t i = 0; i < n; i++) {
+            keys[i] = r->stack[base + 2 * i];
+            keys[n + i] = r->stack[base + 2 * i + 1];
+        }
+        hash = value_arena_hash(r->arena, keys, keys + n, n);
+        gc_free(r->vm, keys);
+        r->nstack = base;
+    }
     return hash;
+
+fail:
+    r->nstack = base;
+    reader_discard(r, hash);
+    return NULL;
 }
 
+// Deeper forms are rejected, so reading them cannot run the C stack out.
+#define READER_MAX_DEPTH 10000
+
+static value_t *reader_read_form(reader_t *r);
+
 value_t *reader_read(reader_t *r) {
+    if (r->depth >= READER_MAX_DEPTH) {
+        vm_set_error(r->vm, VERR_SYNTAX, "nested too deeply");
+        return NULL;
+    }
+    r->depth++;
+    value_t *form = reader_read_form(r);
+    r->depth--;
+    return form;
+}
+
+static value_t *reader_read_form(reader_t *r) {
     if (!reader_skip_whitespace(r)) return NULL;
 
     int c = reader_peek(r);
@@ -267,8 +490,13 @@ value_t *reader_read(reader_t *r) {
         reader_next(r);
         value_t *quoted = reader_read(r);
         if (!quoted) return NULL;
-        value_t *quote_sym = value_symbol(r->vm, "quote");
-        return value_pair(r->vm, quote_sym, value_pair(r->vm, quoted, value_null(r->vm)));
+        value_t *quote_sym = r->arena ? value_arena_symbol(r->arena, "quote", 5) : value_symbol(r->vm, "quote");
+        value_t *tail = quote_sym ? reader_pair(r, quoted, value_null(r->vm)) : NULL;
+        value_t *form = tail ? reader_pair(r, quote_sym, tail) : NULL;
+        reader_discard(r, quote_sym);
+        reader_discard(r, quoted);
+        reader_discard(r, tail);
+        return form;
     }
 
     if (c == '"') {
@@ -280,4 +508,352 @@ value_t *reader_read(reader_t *r) {
     }
 
     return read_symbol(r);
-}
\ No newline at end of file
+}
+
+/*
+ * Streaming: a reader_stream_t reads an fd in 64 KB chunks and scans them
+ * for the end of the next top-level form, keeping its place between reads
+ * so a long form is scanned once. The complete form is then read by an
+ * ordinary reader over that span of the buffer. Before each read the
+ * unread tail is moved to the front, so the buffer only grows for a form
+ * longer than a chunk. Strings are copied out, so nothing read holds it.
+ */
+
+#define READER_CHUNK 65536
+
+enum { SCAN_CODE, SCAN_COMMENT, SCAN_STRING, SCAN_ESCAPE, SCAN_ATOM };
+
+typedef struct reader_scan {
+    size_t start;   // first byte not yet read as a form
+    size_t scan;    // first byte not yet scanned
+    int mode;       // SCAN_*
+    int depth;
+    int started;    // a form, or a quote before one, has begun at start
+} reader_scan_t;
+
+struct reader_stream {
+    vm_t *vm;
+    int fd;
+    int eof;
+    char *buf;
+    size_t len;
+    size_t cap;
+    reader_scan_t sc;
+};
+
+reader_stream_t *reader_stream_create(vm_t *vm, int fd) {
+    reader_stream_t *rs = gc_malloc(vm, sizeof(reader_stream_t));
+    char *buf = gc_malloc(vm, READER_CHUNK);
+    if (!rs || !buf) {
+        gc_free(vm, rs);
+        gc_free(vm, buf);
+        return NULL;
+    }
+    memset(rs, 0, sizeof(reader_stream_t));
+    rs->vm = vm;
+    rs->fd = fd;
+    rs->buf = buf;
+    rs->cap = READER_CHUNK;
+    return rs;
+}
+
+void reader_stream_destroy(reader_stream_t *rs) {
+    if (!rs) return;
+    gc_free(rs->vm, rs->buf);
+    gc_free(rs->vm, rs);
+}
+
+static void reader_scan_reset(reader_scan_t *sc, size_t pos) {
+    sc->start = sc->scan = pos;
+    sc->mode = SCAN_CODE;
+    sc->depth = 0;
+    sc->started = 0;
+}
+
+// Scans s on from sc->scan. Returns 1 with *end set past the next complete
+// top-level form, 0 when more input is needed, and -1 on a stray closer,
+// which is then the byte before sc->scan.
+static int reader_scan_form(reader_scan_t *sc, const char *s, size_t len, size_t *end) {
+    size_t i = sc->scan;
+
+    while (i < len) {
+        switch (sc->mode) {
+            case SCAN_COMMENT:
+                i = reader_scan_line(s, i, len);
+                if (i < len) sc->mode = SCAN_CODE;
+                if (!sc->started) sc->start = i;
+                continue;
+            case SCAN_ESCAPE:
+                sc->mode = SCAN_STRING;
+                i++;
+                continue;
+            case SCAN_STRING:
+                i = reader_scan_string(s, i, len);
+                if (i >= len) continue;
+                if (s[i++] == '\\') {
+                    sc->mode = SCAN_ESCAPE;
+                    continue;
+                }
+                sc->mode = SCAN_CODE;
+                if (sc->depth == 0) {
+                    *end = i;
+                    return 1;
+                }
+                continue;
+            case SCAN_ATOM:
+                i = reader_scan_token(s, i, len);
+                if (i >= len) continue;
+                sc->mode = SCAN_CODE;
+                *end = i;
+                return 1;
+        }
+
+        i = reader_scan_space(s, i, len);
+        if (!sc->started) sc->start = i;
+        if (i >= len) break;
+
+        char c = s[i++];
+        if (c == ';') {
+            sc->mode = SCAN_COMMENT;
+            continue;
+        }
+        sc->started = 1;
+
+        if (c == '"') {
+            sc->mode = SCAN_STRING;
+        } else if (c == '(' || c == '[' || c == '{') {
+            sc->depth++;
+        } else if (c == ')' || c == ']' || c == '}') {
+            if (sc->depth == 0) {
+                sc->scan = i;
+                return -1;
+            }
+            if (--sc->depth == 0) {
+                *end = i;
+                return 1;
+            }
+        } else if (c != '\'') {
+            if (sc->depth == 0) {
+                sc->mode = SCAN_ATOM;
+            } else {
+                i = reader_scan_token(s, i, len);
+            }
+        }
+    }
+
+    sc->scan = i;
+    return 0;
+}
+
+// Appends up to one chunk of input. Returns 0 on a read error.
+static int reader_stream_fill(reader_stream_t *rs) {
+    if (rs->sc.start > 0) {
+        memmove(rs->buf, rs->buf + rs->sc.start, rs->len - rs->sc.start);
+        rs->len -= rs->sc.start;
+        rs->sc.scan -= rs->sc.start;
+        rs->sc.start = 0;
+    }
+    if (rs->cap - rs->len < READER_CHUNK) {
+        char *grown = gc_realloc(rs->vm, rs->buf, rs->cap, rs->cap * 2);
+        if (!grown) {
+            vm_set_error(rs->vm, VERR_RUNTIME, "out of memory");
+            return 0;
+        }
+        rs->buf = grown;
+        rs->cap *= 2;
+    }
+
+    ssize_t n;
+    do {
+        n = read(rs->fd, rs->buf + rs->len, READER_CHUNK);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+        vm_set_error(rs->vm, VERR_RUNTIME, "read: %s", strerror(errno));
+        return 0;
+    }
+    if (n == 0) rs->eof = 1;
+    rs->len += (size_t)n;
+    return 1;
+}
+
+value_t *reader_stream_read(reader_stream_t *rs) {
+    size_t end;
+    for (;;) {
+        int found = reader_scan_form(&rs->sc, rs->buf, rs->len, &end);
+        if (found < 0) {
+            vm_set_error(rs->vm, VERR_SYNTAX, "unexpected '%c'", rs->buf[rs->sc.scan - 1]);
+            return NULL;
+        }
+        if (found) break;
+        if (rs->eof) {
+            // Whatever is left is one last atom or a form the reader will
+            // report as unterminated.
+            if (!rs->sc.started) return NULL;
+            end = rs->len;
+            break;
+        }
+        if (!reader_stream_fill(rs)) return NULL;
+    }
+
+    reader_t r = { rs->buf + rs->sc.start, 0, end - rs->sc.start, rs->vm, NULL };
+    value_t *form = reader_read(&r);
+
+    // The reader may stop inside the span (as with 12abc), so scanning
+    // resumes from wherever it left off.
+    reader_scan_reset(&rs->sc, rs->sc.start + r.pos);
+    if (!form && vm_error_code(rs->vm) == VERR_NONE) {
+        vm_set_error(rs->vm, VERR_SYNTAX, "unexpected end of input");
+    }
+    return form;
+}
+
+value_t *reader_eval_fd(vm_t *vm, int fd) {
+    reader_stream_t *rs = reader_stream_create(vm, fd);
+    if (!rs) {
+        vm_set_error(vm, VERR_RUNTIME, "out of memory");
+        return NULL;
+    }
+
+    value_t *result = value_null(vm);
+    value_t *form;
+    while (vm_error_code(vm) == VERR_NONE && (form = reader_stream_read(rs))) {
+        value_release(vm, result);
+        result = vm_eval(vm, form, vm->global_env);
+        value_release(vm, form);
+    }
+    reader_stream_destroy(rs);
+
+    if (vm_error_code(vm) != VERR_NONE) {
+        value_release(vm, result);
+        return NULL;
+    }
+    return result;
+}
+
+/*
+ * Data files. reader_load_data() reads every form of a file, without
+ * evaluating any, into one arena of read-only values. A large file is
+ * first scanned for the ends of its top-level forms and cut at them into
+ * one range of similar size per thread. Each range is read by a reader
+ * without a VM into an arena of its own (see value_arena_parallel()),
+ * and the arenas are merged once all are done. A range that fails sends the
+ * whole file back to a single reader, which reports the error.
+ */
+
+#define READER_PARALLEL_MIN (4u << 20)  // smaller files use one thread
+#define READER_MAX_THREADS 16
+
+// Reads each form left in the input onto the reader's stack.
+static int reader_read_all(reader_t *r) {
+    while (reader_skip_whitespace(r)) {
+        value_t *form = reader_read(r);
+        if (!form || !reader_push(r, form)) return 0;
+    }
+    return 1;
+}
+
+// Reads the forms of range i and hands them over from its reader's stack.
+static int reader_read_range(void *ctx, size_t i, value_arena_t *arena, value_t ***items, size_t *nitems) {
+    reader_t *r = (reader_t *)ctx + i;
+    r->arena = arena;
+    int ok = reader_read_all(r);
+    *items = r->stack;
+    *nitems = r->nstack;
+    return ok;
+}
+
+// Cuts s at the ends of top-level forms into up to n ranges of similar
+// size, storing the offset each starts at. Returns the number of ranges,
+// or 0 on a stray closer.
+static size_t reader_split(const char *s, size_t len, size_t *starts, size_t n) {
+    reader_scan_t sc;
+    size_t count = 1, end;
+    size_t target = len / n;
+    starts[0] = 0;
+    reader_scan_reset(&sc, 0);
+    while (count < n) {
+        int found = reader_scan_form(&sc, s, len, &end);
+        if (found < 0) return 0;
+        if (!found) break;
+        if (end >= target && end < len) {
+            starts[count++] = end;
+            target = len / n * count;
+        }
+        reader_scan_reset(&sc, end);
+    }
+    return count;
+}
+
+// Returns 0 when the file should be read on this thread instead;
+// otherwise *result is the vector of forms, or NULL with the error set.
+static int reader_load_parallel(vm_t *vm, value_arena_t *arena, const char *s, size_t len, value_t **result) {
+    int nthreads = len >= READER_PARALLEL_MIN ? vm_thread_count(vm, READER_MAX_THREADS) : 1;
+    if (nthreads < 2) return 0;
+
+    size_t starts[READER_MAX_THREADS + 1];
+    size_t n = reader_split(s, len, starts, (size_t)nthreads);
+    if (n < 2) return 0;
+    starts[n] = len;
+
+    reader_t ranges[READER_MAX_THREADS];
+    size_t hints[READER_MAX_THREADS];
+    for (size_t i = 0; i < n; i++) {
+        reader_t *r = &ranges[i];
+        memset(r, 0, sizeof(*r));
+        r->input = s + starts[i];
+        r->len = starts[i + 1] - starts[i];
+        hints[i] = r->len;
+    }
+    *result = value_arena_parallel(arena, n, hints, reader_read_range, ranges);
+    return *result || vm_error_code(vm) != VERR_NONE;
+}
+
+value_t *reader_load_data(vm_t *vm, int fd) {
+    // A regular file is mapped; anything else is read in whole first.
+    struct stat st;
+    const char *s = NULL;
+    size_t len = 0;
+    reader_stream_t *rs = NULL;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            s = data;
+            len = (size_t)st.st_size;
+        }
+    }
+    if (!s) {
+        rs = reader_stream_create(vm, fd);
+        if (!rs) {
+            vm_set_error(vm, VERR_RUNTIME, "out of memory");
+            return NULL;
+        }
+        while (!rs->eof) {
+            if (!reader_stream_fill(rs)) {
+                reader_stream_destroy(rs);
+                return NULL;
+            }
+        }
+        s = rs->buf;
+        len = rs->len;
+    }
+
+    value_t *result = NULL;
+    value_arena_t *arena = value_arena_create(vm, len);
+    if (arena && !reader_load_parallel(vm, arena, s, len, &result) && vm_error_code(vm) == VERR_NONE) {
+        reader_t r = { s, 0, len, vm, NULL, arena };
+        if (reader_read_all(&r)) {
+            result = value_arena_vector(arena, r.stack, r.nstack);
+        } else if (vm_error_code(vm) == VERR_NONE) {
+            vm_set_error(vm, VERR_SYNTAX, "unexpected end of input");
+        }
+        gc_free(vm, r.stack);
+    }
+    if (arena && !result) value_arena_release(arena);
+
+    if (rs) {
+        reader_stream_destroy(rs);
+    } else {
+        munmap((void *)s, len);
+    }
+    return result;
+}
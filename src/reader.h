@@ -9,9 +9,16 @@ typedef struct reader {
     size_t pos;
     size_t len;
     vm_t *vm;
+    value_t *source;
+    value_arena_t *arena;  // build read-only values in this arena, or NULL
+    value_t **stack;       // with an arena: items of the open vectors and hashes
+    size_t nstack;
+    size_t stack_cap;
+    size_t depth;          // forms open around the current one
 } reader_t;
 
 reader_t *reader_create(vm_t *vm, const char *input);
+reader_t *reader_create_value(vm_t *vm, value_t *source);
 void reader_destroy(reader_t *r);
 
 int reader_skip_whitespace(reader_t *r);
@@ -28,4 +35,22 @@ value_t *read_list(reader_t *r, char end);
 value_t *read_vector(reader_t *r);
 value_t *read_hash(reader_t *r);
 
+// Reads top-level forms from an fd as they arrive, holding only the form
+// being read and the input after it. reader_stream_read() returns NULL at
+// the end of input, or with the VM's error set.
+typedef struct reader_stream reader_stream_t;
+
+reader_stream_t *reader_stream_create(vm_t *vm, int fd);
+value_t *reader_stream_read(reader_stream_t *rs);
+void reader_stream_destroy(reader_stream_t *rs);
+
+// Evaluates each form from fd in the global environment as soon as it is
+// read, and returns the last value (null if there were none).
+value_t *reader_eval_fd(vm_t *vm, int fd);
+
+// Reads every form from fd without evaluating any, and returns them in
+// order as a vector of read-only values in one arena. Large files are
+// read on several threads (see scheme_set_threads()).
+value_t *reader_load_data(vm_t *vm, int fd);
+
 #endif
\ No newline at end of file
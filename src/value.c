@@ -1,24 +1,116 @@
 #include "value.h"
+#include "vm.h"
+#include "gc.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <pthread.h>
+
+static void keys_release(vm_t *vm, hash_keys_t *keys);
+static void keys_free(vm_t *vm, hash_keys_t *keys);
+static void hash_free_values(vm_t *vm, value_t *hash);
+
+typedef struct shape_edge {
+    value_t *key;
+    uint64_t hash;
+    hash_keys_t *child;
+} shape_edge_t;
+
+// The keys table of a hash: either private to one hash, with the values
+// stored in the entries, or a shape shared by many hashes.
+struct hash_keys {
+    int refcount;
+    int is_shape;
+    uint32_t nentries;      // entries used, including removed ones
+    uint32_t capacity;      // index slots, power of two
+    hash_keys_t *parent;    // shapes: the shape this one extends by a key
+    shape_edge_t *edges;    // shapes: weak links to the extending shapes
+    uint32_t nedges;
+    uint32_t edges_cap;
+    hash_entry_t entries[]; // insertion order, then the index table
+};
+
+/*
+ * An arena value's refcount field holds its distance, in cells, from the
+ * header of the arena block it lives in, which leads to the arena and its
+ * single count. See "Value arenas" below.
+ */
+typedef union arena_block {
+    struct {
+        value_arena_t *arena;
+        union arena_block *next;
+        size_t size;
+    } h;
+    value_t align;  // cells follow the header at cell-sized offsets
+} arena_block_t;
+
+// Shared by the arenas of one parallel build (see value_arena_parallel()).
+typedef struct arena_group {
+    pthread_mutex_t lock;
+    int stop;                 // set once memory is refused; every arena then fails
+} arena_group_t;
+
+struct value_arena {
+    int refcount;             // references to any of its values from outside
+    vm_t *vm;
+    arena_block_t *blocks;    // the block being filled comes first
+    value_t *cell_next;       // cells grow up from the header
+    char *byte_next;          // buffers grow down from the end
+    size_t block_size;
+    hash_keys_t **shapes;     // one reference to each shape its hashes use
+    size_t nshapes;
+    size_t shapes_cap;
+    size_t bytes[VTYPE_COUNT];
+    arena_group_t *group;     // set while a worker thread fills the arena
+    size_t held;              // block bytes charged to the VM while detached
+};
+
+static inline value_arena_t *value_arena_of(value_t *v) {
+    arena_block_t *block = (arena_block_t *)(v - (uint32_t)v->refcount);
+    return block->h.arena;
+}
+
+static void value_arena_free(value_arena_t *a);
 
 value_t *value_alloc(vm_t *vm, vtype_t type) {
-    value_t *v = calloc(1, sizeof(value_t));
-    if (!v) return NULL;
+    if (!vm_mem_charge(vm, type, sizeof(value_t))) return NULL;
+    value_t *v = vm ? gc_pool_get(&vm->gc) : NULL;
+    if (v) {
+        memset(v, 0, sizeof(value_t));
+        v->flags = VALUE_POOLED;
+    } else {
+        v = gc_malloc(vm, sizeof(value_t));
+        if (!v) {
+            vm_mem_uncharge(vm, type, sizeof(value_t));
+            vm_set_error(vm, VERR_RUNTIME, "out of memory");
+            return NULL;
+        }
+        memset(v, 0, sizeof(value_t));
+    }
     v->type = type;
     v->refcount = 1;
     return v;
 }
 
+static void value_dealloc(vm_t *vm, value_t *v) {
+    vm_mem_uncharge(vm, v->type, sizeof(value_t));
+    if (!(v->flags & VALUE_POOLED)) {
+        gc_free(vm, v);
+    } else if (vm) {
+        gc_pool_put(&vm->gc, v);
+    }
+}
+
 value_t *value_null(vm_t *vm) {
-    static value_t null_val = { VTYPE_NULL, 99999 };
+    static value_t null_val = { .type = VTYPE_NULL, .flags = VALUE_IMMORTAL };
     return &null_val;
 }
 
 value_t *value_bool(vm_t *vm, int b) {
-    static value_t true_val = { VTYPE_BOOL, 99999, { .boolean = 1 } };
-    static value_t false_val = { VTYPE_BOOL, 99999, { .boolean = 0 } };
+    static value_t true_val = { .type = VTYPE_BOOL, .flags = VALUE_IMMORTAL, .as.boolean = 1 };
+    static value_t false_val = { .type = VTYPE_BOOL, .flags = VALUE_IMMORTAL, .as.boolean = 0 };
     return b ? &true_val : &false_val;
 }
 
@@ -33,20 +125,130 @@ value_t *value_double(vm_t *vm, double d) {
     value_t *v = value_alloc(vm, VTYPE_NUMBER);
     if (!v) return NULL;
     v->as.floating = d;
+    v->flags |= VALUE_DOUBLE;
     return v;
 }
 
 value_t *value_string(vm_t *vm, const char *s) {
+    return value_string_n(vm, s, strlen(s));
+}
+
+value_t *value_string_n(vm_t *vm, const char *s, size_t len) {
+    char *buf = gc_malloc(vm, len + 1);
+    if (!buf) return NULL;
+    memcpy(buf, s, len);
+    buf[len] = '\0';
+    value_t *v = value_string_take(vm, buf, len);
+    if (!v) gc_free(vm, buf);
+    return v;
+}
+
+// Adopts a NUL-terminated buffer from gc_malloc() without copying it. The buffer
+// counts as len + 1 bytes of string memory from here on.
+value_t *value_string_take(vm_t *vm, char *buf, size_t len) {
+    if (!vm_mem_charge(vm, VTYPE_STRING, len + 1)) return NULL;
+    value_t *v = value_alloc(vm, VTYPE_STRING);
+    if (!v) {
+        vm_mem_uncharge(vm, VTYPE_STRING, len + 1);
+        return NULL;
+    }
+    v->as.string.data = buf;
+    v->as.string.len = len;
+    v->as.string.parent = NULL;
+    return v;
+}
+
+// Returns a view of len bytes at offset inside str. The view keeps the
+// buffer owner alive and is only copied out by value_cstr().
+value_t *value_string_slice(vm_t *vm, value_t *str, size_t offset, size_t len) {
+    if (!value_is_string(str) || offset > str->as.string.len || len > str->as.string.len - offset) return NULL;
+
+    value_t *owner = str->as.string.parent ? str->as.string.parent : str;
+    value_t *v = value_alloc(vm, VTYPE_STRING);
+    if (!v) return NULL;
+    v->as.string.data = str->as.string.data + offset;
+    v->as.string.len = len;
+    v->as.string.parent = owner;
+    value_retain(owner);
+    return v;
+}
+
+// Wraps a read-only file mapping of len bytes, which the string unmaps
+// when it is freed. Such strings are only used as the parent of slices.
+value_t *value_string_mapped(vm_t *vm, char *data, size_t len) {
     value_t *v = value_alloc(vm, VTYPE_STRING);
     if (!v) return NULL;
-    v->as.string = strdup(s);
+    v->flags |= VALUE_MAPPED;
+    v->as.string.data = data;
+    v->as.string.len = len;
+    return v;
+}
+
+// The lazy value holds a reference to doc until it is forced.
+value_t *value_lazy(vm_t *vm, lazy_doc_t *doc, uint32_t token) {
+    value_t *v = value_alloc(vm, VTYPE_LAZY);
+    if (!v) return NULL;
+    v->as.lazy.doc = doc;
+    v->as.lazy.token = token;
+    doc->refcount++;
+    return v;
+}
+
+// A compiled selector, freed by destroy when the value goes.
+value_t *value_path(vm_t *vm, json_path_t *compiled, void (*destroy)(vm_t *vm, json_path_t *compiled)) {
+    value_t *v = value_alloc(vm, VTYPE_PATH);
+    if (!v) return NULL;
+    v->as.path.compiled = compiled;
+    v->as.path.destroy = destroy;
     return v;
 }
 
+// Returns what v stands for: v itself unless it is lazy, in which case the
+// value is built on first use and kept. The result is borrowed from v; NULL
+// means building it failed.
+value_t *value_force(vm_t *vm, value_t *v) {
+    if (!v || v->type != VTYPE_LAZY) return v;
+    if (v->as.lazy.value) return v->as.lazy.value;
+
+    lazy_doc_t *doc = v->as.lazy.doc;
+    value_t *value = doc->force(vm, doc, v->as.lazy.token);
+    if (!value) return NULL;
+    v->as.lazy.value = value;
+    v->as.lazy.doc = NULL;
+    lazy_doc_release(vm, doc);
+    return value;
+}
+
+void lazy_doc_release(vm_t *vm, lazy_doc_t *doc) {
+    if (!doc || --doc->refcount > 0) return;
+    value_release(vm, doc->text);
+    vm_free(vm, VTYPE_LAZY, doc->index, doc->nindex * sizeof(uint32_t));
+    vm_free(vm, VTYPE_LAZY, doc, sizeof(lazy_doc_t));
+}
+
+static void string_free_data(vm_t *vm, value_t *v) {
+    if (v->flags & VALUE_MAPPED) {
+        munmap(v->as.string.data, v->as.string.len);
+    } else {
+        vm_free(vm, VTYPE_STRING, v->as.string.data, v->as.string.len + 1);
+    }
+}
+
 value_t *value_symbol(vm_t *vm, const char *s) {
+    return value_symbol_n(vm, s, strlen(s));
+}
+
+value_t *value_symbol_n(vm_t *vm, const char *s, size_t len) {
     value_t *v = value_alloc(vm, VTYPE_SYMBOL);
     if (!v) return NULL;
-    v->as.symbol = strdup(s);
+    v->as.symbol.name = vm_alloc(vm, VTYPE_SYMBOL, len + 1);
+    if (!v->as.symbol.name) {
+        value_dealloc(vm, v);
+        return NULL;
+    }
+    memcpy(v->as.symbol.name, s, len);
+    v->as.symbol.name[len] = '\0';
+    v->as.symbol.hash = hash_bytes(s, len);
     return v;
 }
 
@@ -75,7 +277,6 @@ value_t *value_hash(vm_t *vm) {
     v->as.hash.keys = NULL;
     v->as.hash.values = NULL;
     v->as.hash.size = 0;
-    v->as.hash.capacity = 0;
     return v;
 }
 
@@ -98,22 +299,155 @@ value_t *value_native(vm_t *vm, value_t *(*func)(vm_t *, value_t *)) {
     return v;
 }
 
+value_t *value_record_type(vm_t *vm, value_t *name, value_t **fields, size_t nfields) {
+    value_t *v = value_alloc(vm, VTYPE_RECORD_TYPE);
+    if (!v) return NULL;
+    v->as.record_type.fields = vm_alloc(vm, VTYPE_RECORD_TYPE, (nfields ? nfields : 1) * sizeof(value_t *));
+    if (!v->as.record_type.fields) {
+        value_dealloc(vm, v);
+        return NULL;
+    }
+    v->as.record_type.name = name;
+    v->as.record_type.nfields = nfields;
+    value_retain(name);
+    for (size_t i = 0; i < nfields; i++) {
+        v->as.record_type.fields[i] = fields[i];
+        value_retain(fields[i]);
+    }
+    return v;
+}
+
+// Slots start out null; the constructor fills the ones it takes.
+value_t *value_record(vm_t *vm, value_t *type) {
+    if (!value_is_record_type(type)) return NULL;
+    value_t *v = value_alloc(vm, VTYPE_RECORD);
+    if (!v) return NULL;
+    size_t n = type->as.record_type.nfields;
+    v->as.record.slots = vm_alloc(vm, VTYPE_RECORD, (n ? n : 1) * sizeof(value_t *));
+    if (!v->as.record.slots) {
+        value_dealloc(vm, v);
+        return NULL;
+    }
+    v->as.record.nslots = n;
+    for (size_t i = 0; i < n; i++) {
+        v->as.record.slots[i] = value_null(vm);
+    }
+    v->as.record.type = type;
+    value_retain(type);
+    return v;
+}
+
+value_t *value_record_proc(vm_t *vm, value_t *type, record_proc_t kind, uint32_t index) {
+    value_t *v = value_alloc(vm, VTYPE_RECORD_PROC);
+    if (!v) return NULL;
+    v->as.record_proc.type = type;
+    v->as.record_proc.kind = kind;
+    v->as.record_proc.index = index;
+    v->as.record_proc.args = NULL;
+    value_retain(type);
+    return v;
+}
+
 void value_retain(value_t *v) {
     if (!v) return;
+    if (v->flags & (VALUE_IMMORTAL | VALUE_ARENA)) {
+        if (v->flags & VALUE_ARENA) value_arena_of(v)->refcount++;
+        return;
+    }
     v->refcount++;
+    // Leaves a black header untouched, so that worker threads comparing
+    // shape keys outside the arena lock never see it written.
+    if (v->color != GC_BLACK) v->color = GC_BLACK;
+}
+
+// Only containers can close a cycle; everything else is freed by its
+// refcount alone.
+static inline int value_may_cycle(value_t *v) {
+    switch (v->type) {
+        case VTYPE_PAIR:
+        case VTYPE_VECTOR:
+        case VTYPE_HASH:
+        case VTYPE_LAMBDA:
+        case VTYPE_RECORD:
+        case VTYPE_LAZY:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// Drops a reference that is known not to be the last one, such as the
+// caller's reference to a fresh value it just stored in a live container.
+// Unlike value_release() this does not make v a possible cycle root.
+void value_disown(value_t *v) {
+    if (!v || (v->flags & VALUE_IMMORTAL)) return;
+    if (v->flags & VALUE_ARENA) {
+        value_arena_of(v)->refcount--;
+    } else {
+        v->refcount--;
+    }
 }
 
 void value_release(vm_t *vm, value_t *v) {
-    if (!v || v->refcount == 99999) return;
+    if (!v) return;
+    if (v->flags & (VALUE_IMMORTAL | VALUE_ARENA)) {
+        if (v->flags & VALUE_ARENA) {
+            value_arena_t *a = value_arena_of(v);
+            if (--a->refcount == 0) value_arena_free(a);
+        }
+        return;
+    }
     v->refcount--;
-    if (v->refcount > 0) return;
+    if (v->refcount > 0) {
+        // A decrement that does not free may have left a cycle behind.
+        if (v->color != GC_PURPLE && value_may_cycle(v)) {
+            v->color = GC_PURPLE;
+            if (vm && !(v->flags & VALUE_BUFFERED)) gc_buffer(vm, v);
+        }
+        return;
+    }
 
+    if (vm) {
+        gc_defer(vm, v);
+    } else {
+        value_destroy(vm, v);
+    }
+}
+
+// The byte counts handed back here match the sizes allocated, so the VM's
+// memory accounting balances.
+static void vector_free_elements(vm_t *vm, value_t *v) {
+    vm_free(vm, VTYPE_VECTOR, v->as.vector.elements, v->as.vector.capacity * sizeof(value_t *));
+}
+
+static void record_free_slots(vm_t *vm, value_t *v) {
+    size_t n = v->as.record.nslots;
+    vm_free(vm, VTYPE_RECORD, v->as.record.slots, (n ? n : 1) * sizeof(value_t *));
+}
+
+static void record_type_free_fields(vm_t *vm, value_t *v) {
+    size_t n = v->as.record_type.nfields;
+    vm_free(vm, VTYPE_RECORD_TYPE, v->as.record_type.fields, (n ? n : 1) * sizeof(value_t *));
+}
+
+// Only constructors have an argument map, with one entry per argument.
+static void record_proc_free_args(vm_t *vm, value_t *v) {
+    size_t n = v->as.record_proc.index;
+    vm_free(vm, VTYPE_RECORD_PROC, v->as.record_proc.args, (n ? n : 1) * sizeof(uint32_t));
+}
+
+// Releases the children of a value whose count reached zero and frees it.
+void value_destroy(vm_t *vm, value_t *v) {
     switch (v->type) {
         case VTYPE_STRING:
-            free(v->as.string);
+            if (v->as.string.parent) {
+                value_release(vm, v->as.string.parent);
+            } else {
+                string_free_data(vm, v);
+            }
             break;
         case VTYPE_SYMBOL:
-            free(v->as.symbol);
+            vm_free(vm, VTYPE_SYMBOL, v->as.symbol.name, strlen(v->as.symbol.name) + 1);
             break;
         case VTYPE_PAIR:
             value_release(vm, v->as.pair.car);
@@ -123,25 +457,187 @@ void value_release(vm_t *vm, value_t *v) {
             for (size_t i = 0; i < v->as.vector.size; i++) {
                 value_release(vm, v->as.vector.elements[i]);
             }
-            free(v->as.vector.elements);
+            vector_free_elements(vm, v);
             break;
         case VTYPE_HASH:
-            for (size_t i = 0; i < v->as.hash.size; i++) {
-                value_release(vm, v->as.hash.keys[i]);
-                value_release(vm, v->as.hash.values[i]);
+            if (v->as.hash.values) {
+                for (size_t i = 0; i < v->as.hash.size; i++) {
+                    value_release(vm, v->as.hash.values[i]);
+                }
+                hash_free_values(vm, v);
+            }
+            keys_release(vm, v->as.hash.keys);
+            break;
+        case VTYPE_RECORD:
+            for (size_t i = 0; i < v->as.record.nslots; i++) {
+                value_release(vm, v->as.record.slots[i]);
+            }
+            record_free_slots(vm, v);
+            value_release(vm, v->as.record.type);
+            break;
+        case VTYPE_RECORD_TYPE:
+            for (size_t i = 0; i < v->as.record_type.nfields; i++) {
+                value_release(vm, v->as.record_type.fields[i]);
             }
-            free(v->as.hash.keys);
-            free(v->as.hash.values);
+            record_type_free_fields(vm, v);
+            value_release(vm, v->as.record_type.name);
+            break;
+        case VTYPE_RECORD_PROC:
+            record_proc_free_args(vm, v);
+            value_release(vm, v->as.record_proc.type);
             break;
         case VTYPE_LAMBDA:
             value_release(vm, v->as.lambda.params);
             value_release(vm, v->as.lambda.body);
             value_release(vm, v->as.lambda.env);
             break;
+        case VTYPE_LAZY:
+            value_release(vm, v->as.lazy.value);
+            lazy_doc_release(vm, v->as.lazy.doc);
+            break;
+        case VTYPE_PATH:
+            v->as.path.destroy(vm, v->as.path.compiled);
+            break;
         default:
             break;
     }
-    free(v);
+
+    v->color = GC_BLACK;
+    v->flags &= ~VALUE_PENDING;
+    if (v->flags & VALUE_BUFFERED) {
+        // Still in the roots buffer; the collector frees the empty shell.
+        if (vm) {
+            vm->mem.live[v->type] -= sizeof(value_t);
+            vm->mem.live[VTYPE_NULL] += sizeof(value_t);
+        }
+        v->type = VTYPE_NULL;
+        return;
+    }
+    value_dealloc(vm, v);
+}
+
+static void visit_child(value_t *child, int skip, void (*visit)(value_t *, void *), void *ctx) {
+    if (child && !(child->flags & skip)) visit(child, ctx);
+}
+
+// Calls visit for every reference v owns, except those to values with a
+// flag in skip.
+static void each_child(value_t *v, int skip, void (*visit)(value_t *child, void *ctx), void *ctx) {
+    switch (v->type) {
+        case VTYPE_STRING:
+            visit_child(v->as.string.parent, skip, visit, ctx);
+            break;
+        case VTYPE_PAIR:
+            visit_child(v->as.pair.car, skip, visit, ctx);
+            visit_child(v->as.pair.cdr, skip, visit, ctx);
+            break;
+        case VTYPE_VECTOR:
+            for (size_t i = 0; i < v->as.vector.size; i++) {
+                visit_child(v->as.vector.elements[i], skip, visit, ctx);
+            }
+            break;
+        case VTYPE_HASH:
+            if (v->as.hash.values) {
+                // Shape keys belong to the shape, not to this hash.
+                for (size_t i = 0; i < v->as.hash.size; i++) {
+                    visit_child(v->as.hash.values[i], skip, visit, ctx);
+                }
+            } else if (v->as.hash.keys) {
+                hash_keys_t *keys = v->as.hash.keys;
+                for (uint32_t i = 0; i < keys->nentries; i++) {
+                    if (!keys->entries[i].key) continue;
+                    visit_child(keys->entries[i].key, skip, visit, ctx);
+                    visit_child(keys->entries[i].value, skip, visit, ctx);
+                }
+            }
+            break;
+        case VTYPE_RECORD: {
+            size_t n = v->as.record.nslots;
+            for (size_t i = 0; i < n; i++) {
+                visit_child(v->as.record.slots[i], skip, visit, ctx);
+            }
+            visit_child(v->as.record.type, skip, visit, ctx);
+            break;
+        }
+        case VTYPE_RECORD_TYPE:
+            for (size_t i = 0; i < v->as.record_type.nfields; i++) {
+                visit_child(v->as.record_type.fields[i], skip, visit, ctx);
+            }
+            visit_child(v->as.record_type.name, skip, visit, ctx);
+            break;
+        case VTYPE_RECORD_PROC:
+            visit_child(v->as.record_proc.type, skip, visit, ctx);
+            break;
+        case VTYPE_LAMBDA:
+            visit_child(v->as.lambda.params, skip, visit, ctx);
+            visit_child(v->as.lambda.body, skip, visit, ctx);
+            visit_child(v->as.lambda.env, skip, visit, ctx);
+            break;
+        case VTYPE_LAZY:
+            visit_child(v->as.lazy.value, skip, visit, ctx);
+            break;
+        default:
+            break;
+    }
+}
+
+// Calls visit for every reference v owns. Arena values never point outside
+// their arena, so they cannot be part of a cycle and the collector treats
+// them like atoms.
+void value_children(value_t *v, void (*visit)(value_t *child, void *ctx), void *ctx) {
+    each_child(v, VALUE_IMMORTAL | VALUE_ARENA, visit, ctx);
+}
+
+static void release_arena_child(value_t *child, void *ctx) {
+    if (child->flags & VALUE_ARENA) value_release(ctx, child);
+}
+
+// The collector skips arena children, so a garbage value's references into
+// arenas are still counted; it drops them with this before freeing.
+void value_release_arena_children(vm_t *vm, value_t *v) {
+    each_child(v, VALUE_IMMORTAL, release_arena_child, vm);
+}
+
+// Frees a value found to be garbage by the cycle collector. The collector
+// accounts for its children, so they are not released here.
+void value_free(vm_t *vm, value_t *v) {
+    switch (v->type) {
+        case VTYPE_STRING:
+            if (!v->as.string.parent) string_free_data(vm, v);
+            break;
+        case VTYPE_SYMBOL:
+            vm_free(vm, VTYPE_SYMBOL, v->as.symbol.name, strlen(v->as.symbol.name) + 1);
+            break;
+        case VTYPE_VECTOR:
+            vector_free_elements(vm, v);
+            break;
+        case VTYPE_HASH:
+            if (v->as.hash.values) {
+                hash_free_values(vm, v);
+                keys_release(vm, v->as.hash.keys);
+            } else {
+                keys_free(vm, v->as.hash.keys);
+            }
+            break;
+        case VTYPE_RECORD:
+            record_free_slots(vm, v);
+            break;
+        case VTYPE_RECORD_TYPE:
+            record_type_free_fields(vm, v);
+            break;
+        case VTYPE_RECORD_PROC:
+            record_proc_free_args(vm, v);
+            break;
+        case VTYPE_LAZY:
+            lazy_doc_release(vm, v->as.lazy.doc);
+            break;
+        case VTYPE_PATH:
+            v->as.path.destroy(vm, v->as.path.compiled);
+            break;
+        default:
+            break;
+    }
+    value_dealloc(vm, v);
 }
 
 int value_equal(value_t *a, value_t *b) {
@@ -157,15 +653,19 @@ int value_equal(value_t *a, value_t *b) {
         case VTYPE_NUMBER:
             return a->as.number == b->as.number;
         case VTYPE_STRING:
-            return strcmp(a->as.string, b->as.string) == 0;
+            return a->as.string.len == b->as.string.len &&
+                   memcmp(a->as.string.data, b->as.string.data, a->as.string.len) == 0;
         case VTYPE_SYMBOL:
-            return strcmp(a->as.symbol, b->as.symbol) == 0;
+            return a->as.symbol.hash == b->as.symbol.hash &&
+                   strcmp(a->as.symbol.name, b->as.symbol.name) == 0;
         default:
             return 0;
     }
 }
 
 int value_is_null(value_t *v) { return v && v->type == VTYPE_NULL; }
+int value_is_lazy(value_t *v) { return v && v->type == VTYPE_LAZY; }
+int value_is_path(value_t *v) { return v && v->type == VTYPE_PATH; }
 int value_is_bool(value_t *v) { return v && v->type == VTYPE_BOOL; }
 int value_is_number(value_t *v) { return v && v->type == VTYPE_NUMBER; }
 int value_is_string(value_t *v) { return v && v->type == VTYPE_STRING; }
@@ -175,7 +675,17 @@ int value_is_vector(value_t *v) { return v && v->type == VTYPE_VECTOR; }
 int value_is_hash(value_t *v) { return v && v->type == VTYPE_HASH; }
 int value_is_lambda(value_t *v) { return v && v->type == VTYPE_LAMBDA; }
 int value_is_native(value_t *v) { return v && v->type == VTYPE_NATIVE; }
-int value_is_callable(value_t *v) { return value_is_lambda(v) || value_is_native(v) || value_is_vector(v) || value_is_hash(v); }
+int value_is_record(value_t *v) { return v && v->type == VTYPE_RECORD; }
+int value_is_record_type(value_t *v) { return v && v->type == VTYPE_RECORD_TYPE; }
+int value_is_record_proc(value_t *v) { return v && v->type == VTYPE_RECORD_PROC; }
+int value_is_callable(value_t *v) { return value_is_lambda(v) || value_is_native(v) || value_is_vector(v) || value_is_hash(v) || value_is_record_proc(v) || value_is_lazy(v); }
+
+// True when the caller holds the only reference, so the value may be
+// updated in place where a copy is logically produced.
+int value_is_unique(value_t *v) { return v && !(v->flags & (VALUE_IMMORTAL | VALUE_ARENA)) && v->refcount == 1; }
+
+// Arena values are read-only: their containers cannot be changed in place.
+int value_in_arena(value_t *v) { return v && (v->flags & VALUE_ARENA); }
 
 int value_to_bool(value_t *v) {
     if (!v) return 0;
@@ -195,18 +705,38 @@ int value_to_double(value_t *v, double *out) {
     return 1;
 }
 
-int value_to_string(value_t *v, const char **out) {
+int value_to_string(vm_t *vm, value_t *v, const char **out) {
     if (!v || !value_is_string(v)) return 0;
-    if (out) *out = v->as.string;
+    const char *s = value_cstr(vm, v);
+    if (!s) return 0;
+    if (out) *out = s;
     return 1;
 }
 
+// Slices are not NUL-terminated; turn one into an owned copy the first
+// time a C string is needed and drop the reference to its parent.
+const char *value_cstr(vm_t *vm, value_t *v) {
+    if (!value_is_string(v)) return NULL;
+    if (!v->as.string.parent) return v->as.string.data;
+
+    char *buf = vm_alloc(vm, VTYPE_STRING, v->as.string.len + 1);
+    if (!buf) return NULL;
+    memcpy(buf, v->as.string.data, v->as.string.len);
+    buf[v->as.string.len] = '\0';
+
+    value_release(vm, v->as.string.parent);
+    v->as.string.data = buf;
+    v->as.string.parent = NULL;
+    return buf;
+}
+
 value_t *vector_push(vm_t *vm, value_t *vec, value_t *item) {
-    if (!value_is_vector(vec)) return NULL;
+    if (!value_is_vector(vec) || value_in_arena(vec)) return NULL;
 
     if (vec->as.vector.size >= vec->as.vector.capacity) {
         size_t new_cap = vec->as.vector.capacity == 0 ? 8 : vec->as.vector.capacity * 2;
-        value_t **new_elems = realloc(vec->as.vector.elements, new_cap * sizeof(value_t *));
+        value_t **new_elems = vm_realloc(vm, VTYPE_VECTOR, vec->as.vector.elements,
+                                         vec->as.vector.capacity * sizeof(value_t *), new_cap * sizeof(value_t *));
         if (!new_elems) return NULL;
         vec->as.vector.elements = new_elems;
         vec->as.vector.capacity = new_cap;
@@ -227,101 +757,1192 @@ size_t vector_len(value_t *vec) {
     return vec->as.vector.size;
 }
 
-static size_t hash_find_slot(value_t *hash, value_t *key) {
-    if (!value_is_hash(hash)) return (size_t)-1;
-    if (hash->as.hash.capacity == 0) return (size_t)-1;
+// Builds a vector of n items, taking over the caller's reference to each.
+// On failure the caller still owns them.
+value_t *value_vector_take(vm_t *vm, value_t **items, size_t n) {
+    value_t *vec = value_vector(vm);
+    if (!vec || n == 0) return vec;
 
-    uint64_t hash_val = 0;
-    if (value_is_string(key)) {
-        for (const char *s = key->as.string; *s; s++) {
-            hash_val = hash_val * 31 + (uint8_t)*s;
+    vec->as.vector.elements = vm_alloc(vm, VTYPE_VECTOR, n * sizeof(value_t *));
+    if (!vec->as.vector.elements) {
+        value_release(vm, vec);
+        return NULL;
+    }
+    memcpy(vec->as.vector.elements, items, n * sizeof(value_t *));
+    vec->as.vector.size = n;
+    vec->as.vector.capacity = n;
+    return vec;
+}
+
+value_t *vector_copy(vm_t *vm, value_t *vec) {
+    if (!value_is_vector(vec)) return NULL;
+
+    value_t *copy = value_vector(vm);
+    size_t n = vec->as.vector.size;
+    if (!copy || n == 0) return copy;
+
+    copy->as.vector.elements = vm_alloc(vm, VTYPE_VECTOR, n * sizeof(value_t *));
+    if (!copy->as.vector.elements) {
+        value_release(vm, copy);
+        return NULL;
+    }
+    for (size_t i = 0; i < n; i++) {
+        copy->as.vector.elements[i] = vec->as.vector.elements[i];
+        value_retain(copy->as.vector.elements[i]);
+    }
+    copy->as.vector.size = n;
+    copy->as.vector.capacity = n;
+    return copy;
+}
+
+/*
+ * Hashes keep their entries in a dense array in insertion order, so
+ * iteration and JSON output only touch live entries and preserve the order
+ * keys were added. A separate open-addressing index maps hashes to entry
+ * positions in the style of Swiss tables: each index slot has a control
+ * byte that is either EMPTY, DELETED or the low 7 bits of the key's hash,
+ * and lookups compare a whole group of control bytes at once, touching only
+ * the entries whose tag matches. Entries cache the full hash so probes and
+ * rehashes never recompute it.
+ */
+
+#define CTRL_EMPTY   ((uint8_t)0x80)
+#define CTRL_DELETED ((uint8_t)0xFE)
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+
+#define HASH_GROUP 16
+
+static inline uint32_t group_match(const uint8_t *ctrl, uint8_t tag) {
+    __m128i group = _mm_loadu_si128((const __m128i *)ctrl);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)tag)));
+}
+
+// EMPTY and DELETED are the only control bytes with the top bit set.
+static inline uint32_t group_match_free(const uint8_t *ctrl) {
+    return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)ctrl));
+}
+#else
+#define HASH_GROUP 8
+
+static inline uint32_t group_match(const uint8_t *ctrl, uint8_t tag) {
+    uint32_t mask = 0;
+    for (int i = 0; i < HASH_GROUP; i++) {
+        if (ctrl[i] == tag) mask |= 1u << i;
+    }
+    return mask;
+}
+
+static inline uint32_t group_match_free(const uint8_t *ctrl) {
+    uint32_t mask = 0;
+    for (int i = 0; i < HASH_GROUP; i++) {
+        if (ctrl[i] & 0x80) mask |= 1u << i;
+    }
+    return mask;
+}
+#endif
+
+#define HASH_MIN_CAPACITY 8
+
+static uint64_t hash_seed[2];
+static pthread_once_t hash_seeded = PTHREAD_ONCE_INIT;  // readers hash on worker threads
+
+static void hash_seed_init(void) {
+    FILE *f = fopen("/dev/urandom", "rb");
+    if (!f || fread(hash_seed, sizeof(hash_seed), 1, f) != 1) {
+        hash_seed[0] = (uint64_t)time(NULL) ^ (uint64_t)(uintptr_t)&hash_seed;
+        hash_seed[1] = (uint64_t)clock() * 0x9E3779B97F4A7C15ULL ^ (uint64_t)(uintptr_t)f;
+    }
+    if (f) fclose(f);
+}
+
+#define ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+#define SIPROUND do { \
+    v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32); \
+    v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2; \
+    v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0; \
+    v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32); \
+} while (0)
+
+// SipHash-1-3 with a per-process random key, so scripts fed hostile JSON
+// keys cannot force every insert into the same probe chain.
+uint64_t hash_bytes(const void *data, size_t len) {
+    pthread_once(&hash_seeded, hash_seed_init);
+
+    const uint8_t *in = data;
+    uint64_t v0 = 0x736f6d6570736575ULL ^ hash_seed[0];
+    uint64_t v1 = 0x646f72616e646f6dULL ^ hash_seed[1];
+    uint64_t v2 = 0x6c7967656e657261ULL ^ hash_seed[0];
+    uint64_t v3 = 0x7465646279746573ULL ^ hash_seed[1];
+    uint64_t b = (uint64_t)len << 56;
+
+    const uint8_t *end = in + (len & ~(size_t)7);
+    for (; in != end; in += 8) {
+        uint64_t m = 0;
+        for (int i = 0; i < 8; i++) m |= (uint64_t)in[i] << (8 * i);
+        v3 ^= m;
+        SIPROUND;
+        v0 ^= m;
+    }
+
+    for (size_t i = 0; i < (len & 7); i++) {
+        b |= (uint64_t)in[i] << (8 * i);
+    }
+
+    v3 ^= b;
+    SIPROUND;
+    v0 ^= b;
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+static inline uint8_t hash_tag(uint64_t h) {
+    return (uint8_t)(h & 0x7F);
+}
+
+// Number of entries a table with this many index slots can hold.
+static inline size_t hash_usable(size_t capacity) {
+    return capacity - capacity / 8;
+}
+
+static inline uint32_t *keys_indices(hash_keys_t *keys) {
+    return (uint32_t *)(keys->entries + hash_usable(keys->capacity));
+}
+
+static inline uint8_t *keys_ctrl(hash_keys_t *keys) {
+    return (uint8_t *)(keys_indices(keys) + keys->capacity);
+}
+
+static inline size_t keys_bytes(size_t capacity) {
+    return sizeof(hash_keys_t) +
+           hash_usable(capacity) * sizeof(hash_entry_t) +
+           capacity * sizeof(uint32_t) +
+           capacity + HASH_GROUP - 1;
+}
+
+static hash_keys_t *keys_init(hash_keys_t *keys, size_t capacity, int is_shape) {
+    memset(keys, 0, sizeof(hash_keys_t));
+    keys->refcount = 1;
+    keys->is_shape = is_shape;
+    keys->capacity = (uint32_t)capacity;
+    memset(keys_ctrl(keys), CTRL_EMPTY, capacity + HASH_GROUP - 1);
+    return keys;
+}
+
+static hash_keys_t *keys_alloc(vm_t *vm, size_t capacity, int is_shape) {
+    hash_keys_t *keys = vm_alloc(vm, VTYPE_HASH, keys_bytes(capacity));
+    return keys ? keys_init(keys, capacity, is_shape) : NULL;
+}
+
+static size_t keys_capacity_for(size_t n) {
+    size_t cap = HASH_MIN_CAPACITY;
+    while (hash_usable(cap) < n) cap *= 2;
+    return cap;
+}
+
+// Group loads may run past the last slot, so the first HASH_GROUP - 1
+// control bytes are mirrored after the end of the index.
+static inline void keys_set_ctrl(hash_keys_t *keys, size_t i, uint8_t c) {
+    uint8_t *ctrl = keys_ctrl(keys);
+    size_t cap = keys->capacity;
+    ctrl[i] = c;
+    for (size_t j = i + cap; j < cap + HASH_GROUP - 1; j += cap) {
+        ctrl[j] = c;
+    }
+}
+
+// Returns the entry position holding key, or -1.
+static size_t keys_find(hash_keys_t *keys, value_t *key, uint64_t h) {
+    uint32_t *indices = keys_indices(keys);
+    uint8_t *ctrl = keys_ctrl(keys);
+    size_t mask = keys->capacity - 1;
+    uint8_t tag = hash_tag(h);
+    size_t pos = (h >> 7) & mask;
+    size_t step = 0;
+
+    while (1) {
+        uint32_t match = group_match(ctrl + pos, tag);
+        while (match) {
+            size_t i = (pos + __builtin_ctz(match)) & mask;
+            hash_entry_t *e = &keys->entries[indices[i]];
+            if (e->hash == h && value_equal(e->key, key)) return indices[i];
+            match &= match - 1;
         }
-    } else if (value_is_symbol(key)) {
-        for (const char *s = key->as.symbol; *s; s++) {
-            hash_val = hash_val * 31 + (uint8_t)*s;
+        if (group_match(ctrl + pos, CTRL_EMPTY)) return (size_t)-1;
+
+        step += HASH_GROUP;
+        pos = (pos + step) & mask;
+    }
+}
+
+// Returns the index slot that points at entry position idx.
+static size_t keys_slot_of(hash_keys_t *keys, uint64_t h, size_t idx) {
+    uint32_t *indices = keys_indices(keys);
+    uint8_t *ctrl = keys_ctrl(keys);
+    size_t mask = keys->capacity - 1;
+    uint8_t tag = hash_tag(h);
+    size_t pos = (h >> 7) & mask;
+    size_t step = 0;
+
+    while (1) {
+        uint32_t match = group_match(ctrl + pos, tag);
+        while (match) {
+            size_t i = (pos + __builtin_ctz(match)) & mask;
+            if (indices[i] == idx) return i;
+            match &= match - 1;
         }
-    } else if (value_is_number(key)) {
-        hash_val = key->as.number;
+        step += HASH_GROUP;
+        pos = (pos + step) & mask;
+    }
+}
+
+// Appends an entry and indexes it; the caller makes sure there is room.
+static void keys_append(hash_keys_t *keys, value_t *key, value_t *val, uint64_t h) {
+    uint8_t *ctrl = keys_ctrl(keys);
+    size_t mask = keys->capacity - 1;
+    size_t pos = (h >> 7) & mask;
+    size_t step = 0;
+    uint32_t match;
+
+    while (!(match = group_match_free(ctrl + pos))) {
+        step += HASH_GROUP;
+        pos = (pos + step) & mask;
+    }
+
+    size_t slot = (pos + __builtin_ctz(match)) & mask;
+    keys_set_ctrl(keys, slot, hash_tag(h));
+    keys_indices(keys)[slot] = keys->nentries;
+
+    hash_entry_t *e = &keys->entries[keys->nentries++];
+    e->key = key;
+    e->value = val;
+    e->hash = h;
+}
+
+static void keys_release(vm_t *vm, hash_keys_t *keys) {
+    if (!keys || --keys->refcount > 0) return;
+
+    if (keys->is_shape) {
+        // Transitions are weak: unlink this shape from its parent.
+        hash_keys_t *parent = keys->parent;
+        if (parent) {
+            for (uint32_t i = 0; i < parent->nedges; i++) {
+                if (parent->edges[i].child == keys) {
+                    parent->edges[i] = parent->edges[--parent->nedges];
+                    break;
+                }
+            }
+        }
+        for (uint32_t i = 0; i < keys->nentries; i++) {
+            value_release(vm, keys->entries[i].key);
+        }
+        vm_free(vm, VTYPE_HASH, keys->edges, keys->edges_cap * sizeof(shape_edge_t));
+        keys_free(vm, keys);
+        keys_release(vm, parent);
+        return;
+    }
+
+    for (uint32_t i = 0; i < keys->nentries; i++) {
+        if (!keys->entries[i].key) continue;
+        value_release(vm, keys->entries[i].key);
+        value_release(vm, keys->entries[i].value);
+    }
+    keys_free(vm, keys);
+}
+
+// Frees a keys table without releasing the keys and values it holds.
+static void keys_free(vm_t *vm, hash_keys_t *keys) {
+    if (keys) vm_free(vm, VTYPE_HASH, keys, keys_bytes(keys->capacity));
+}
+
+hash_keys_t *hash_shape_root(vm_t *vm) {
+    return keys_alloc(vm, HASH_MIN_CAPACITY, 1);
+}
+
+void hash_shape_release(vm_t *vm, hash_keys_t *shape) {
+    keys_release(vm, shape);
+}
+
+/*
+ * Shapes: hashes built with the same key sequence share one immutable keys
+ * table and keep only a values array. Each shape remembers the shapes that
+ * extend it by one key, so records parsed from JSON walk the same chain
+ * instead of building private tables. Long or highly branching chains are
+ * not worth sharing; hashes that would create them (and hashes that lose a
+ * key) switch to a private table.
+ */
+
+#define HASH_SHAPE_MAX_KEYS  32
+#define HASH_SHAPE_MAX_EDGES 32
+#define HASH_INTERN_MAX_LEN  64
+
+// Returns a new reference to the shape that extends shape by key, or NULL
+// when the hash should stop sharing.
+static hash_keys_t *shape_extend(vm_t *vm, hash_keys_t *shape, value_t *key, uint64_t h) {
+    for (uint32_t i = 0; i < shape->nedges; i++) {
+        shape_edge_t *edge = &shape->edges[i];
+        if (edge->hash == h && value_equal(edge->key, key)) {
+            edge->child->refcount++;
+            return edge->child;
+        }
+    }
+
+    if (shape->nentries >= HASH_SHAPE_MAX_KEYS || shape->nedges >= HASH_SHAPE_MAX_EDGES) return NULL;
+
+    if (shape->nedges == shape->edges_cap) {
+        uint32_t cap = shape->edges_cap ? shape->edges_cap * 2 : 4;
+        shape_edge_t *edges = vm_realloc(vm, VTYPE_HASH, shape->edges, shape->edges_cap * sizeof(shape_edge_t),
+                                         cap * sizeof(shape_edge_t));
+        if (!edges) return NULL;
+        shape->edges = edges;
+        shape->edges_cap = cap;
+    }
+
+    // Shapes outlive any one document, so they keep their own copy of a
+    // key that lives in an arena.
+    if (value_in_arena(key)) {
+        key = value_is_string(key) ? value_string_n(vm, key->as.string.data, key->as.string.len)
+                                   : value_number(vm, key->as.number);
+        if (!key) return NULL;
     } else {
-        return (size_t)-1;
+        value_retain(key);
     }
 
-    size_t idx = hash_val % hash->as.hash.capacity;
-    size_t start_idx = idx;
+    hash_keys_t *child = keys_alloc(vm, keys_capacity_for(shape->nentries + 1), 1);
+    if (!child) {
+        value_release(vm, key);
+        return NULL;
+    }
 
-    while (1) {
-        if (hash->as.hash.keys[idx] && value_equal(hash->as.hash.keys[idx], key)) return idx;
-        if (hash->as.hash.keys[idx] == NULL) return idx;
+    for (uint32_t i = 0; i < shape->nentries; i++) {
+        hash_entry_t *e = &shape->entries[i];
+        keys_append(child, e->key, NULL, e->hash);
+        value_retain(e->key);
+    }
+    keys_append(child, key, NULL, h);
+
+    child->parent = shape;
+    shape->refcount++;
+
+    shape_edge_t *edge = &shape->edges[shape->nedges++];
+    edge->key = key;
+    edge->hash = h;
+    edge->child = child;
+    return child;
+}
 
-        idx = (idx + 1) % hash->as.hash.capacity;
-        if (idx == start_idx) return (size_t)-1;
+static inline size_t shape_values_cap(size_t n) {
+    size_t cap = 4;
+    while (cap < n) cap *= 2;
+    return cap;
+}
+
+// A shaped hash's values array always holds shape_values_cap(size) slots.
+static void hash_free_values(vm_t *vm, value_t *hash) {
+    vm_free(vm, VTYPE_HASH, hash->as.hash.values, shape_values_cap(hash->as.hash.size) * sizeof(value_t *));
+}
+
+// Moves a shaped hash onto a private table with room for extra more keys.
+static int hash_unshare(vm_t *vm, value_t *hash, size_t extra) {
+    hash_keys_t *shape = hash->as.hash.keys;
+    hash_keys_t *keys = keys_alloc(vm, keys_capacity_for(hash->as.hash.size + extra), 0);
+    if (!keys) return 0;
+
+    for (uint32_t i = 0; i < shape->nentries; i++) {
+        hash_entry_t *e = &shape->entries[i];
+        keys_append(keys, e->key, hash->as.hash.values[i], e->hash);
+        value_retain(e->key);
     }
+
+    hash_free_values(vm, hash);
+    hash->as.hash.values = NULL;
+    hash->as.hash.keys = keys;
+    keys_release(vm, shape);
+    return 1;
+}
+
+// Rebuilds a private table with room for size * 2 entries, squeezing out
+// removed ones.
+static int hash_resize(vm_t *vm, value_t *hash) {
+    hash_keys_t *old = hash->as.hash.keys;
+    hash_keys_t *keys = keys_alloc(vm, keys_capacity_for(hash->as.hash.size * 2), 0);
+    if (!keys) return 0;
+
+    for (uint32_t i = 0; i < old->nentries; i++) {
+        hash_entry_t *e = &old->entries[i];
+        if (e->key) keys_append(keys, e->key, e->value, e->hash);
+    }
+
+    keys_free(vm, old);
+    hash->as.hash.keys = keys;
+    return 1;
+}
+
+static int hash_key(value_t *key, uint64_t *out) {
+    if (value_is_string(key)) {
+        *out = hash_bytes(key->as.string.data, key->as.string.len);
+    } else if (value_is_symbol(key)) {
+        *out = key->as.symbol.hash;
+    } else if (value_is_number(key)) {
+        *out = hash_bytes(&key->as.number, sizeof(key->as.number));
+    } else {
+        return 0;
+    }
+    return 1;
 }
 
 value_t *hash_set(vm_t *vm, value_t *hash, value_t *key, value_t *val) {
-    if (!value_is_hash(hash)) return NULL;
+    if (!value_is_hash(hash) || value_in_arena(hash)) return NULL;
 
-    if (hash->as.hash.size >= hash->as.hash.capacity * 3 / 4) {
-        size_t old_cap = hash->as.hash.capacity;
-        value_t **old_keys = hash->as.hash.keys;
-        value_t **old_vals = hash->as.hash.values;
-
-        size_t new_cap = hash->as.hash.capacity == 0 ? 8 : hash->as.hash.capacity * 2;
-        value_t **new_keys = calloc(new_cap, sizeof(value_t *));
-        value_t **new_vals = calloc(new_cap, sizeof(value_t *));
-        if (!new_keys || !new_vals) {
-            free(new_keys);
-            free(new_vals);
+    hash_keys_t *keys = hash->as.hash.keys;
+    if (!keys) {
+        keys = vm && vm->hash_root ? vm->hash_root : NULL;
+        if (keys) {
+            keys->refcount++;
+        } else if (!(keys = keys_alloc(vm, HASH_MIN_CAPACITY, 0))) {
             return NULL;
         }
+        hash->as.hash.keys = keys;
+    }
 
-        hash->as.hash.keys = new_keys;
-        hash->as.hash.values = new_vals;
-        hash->as.hash.capacity = new_cap;
-        hash->as.hash.size = 0;
-
-        for (size_t i = 0; i < old_cap; i++) {
-            if (old_keys[i]) {
-                // reinsert
-                value_t *key = old_keys[i];
-                value_t *val = old_vals[i];
-                size_t slot = hash_find_slot(hash, key);
-                if (slot != (size_t)-1 && hash->as.hash.keys[slot] == NULL) {
-                    hash->as.hash.keys[slot] = key;
-                    hash->as.hash.values[slot] = val;
-                    hash->as.hash.size++;
-                }
+    // A key some hash already extended this shape by is not in it yet, and
+    // an interned one is found by pointer without hashing it.
+    hash_keys_t *child = NULL;
+    if (keys->is_shape) {
+        for (uint32_t i = 0; i < keys->nedges; i++) {
+            if (keys->edges[i].key == key) {
+                child = keys->edges[i].child;
+                child->refcount++;
+                break;
             }
         }
+    }
 
-        free(old_keys);
-        free(old_vals);
+    uint64_t h = 0;
+    if (!child) {
+        if (!hash_key(key, &h)) return NULL;
+
+        size_t idx = keys_find(keys, key, h);
+        if (idx != (size_t)-1) {
+            value_t **slot = keys->is_shape ? &hash->as.hash.values[idx] : &keys->entries[idx].value;
+            value_retain(val);
+            value_release(vm, *slot);
+            *slot = val;
+            return hash;
+        }
+        if (keys->is_shape) child = shape_extend(vm, keys, key, h);
     }
 
-    size_t slot = hash_find_slot(hash, key);
-    if (slot == (size_t)-1) {
-        // table full, could resize here, but for now
-        return NULL;
+    if (keys->is_shape) {
+        if (child) {
+            size_t n = hash->as.hash.size;
+            if (n == 0 || (n >= 4 && (n & (n - 1)) == 0)) {
+                value_t **values = vm_realloc(vm, VTYPE_HASH, hash->as.hash.values,
+                                              n ? shape_values_cap(n) * sizeof(value_t *) : 0,
+                                              shape_values_cap(n + 1) * sizeof(value_t *));
+                if (!values) {
+                    keys_release(vm, child);
+                    return NULL;
+                }
+                hash->as.hash.values = values;
+            }
+            hash->as.hash.values[n] = val;
+            hash->as.hash.size++;
+            hash->as.hash.keys = child;
+            keys_release(vm, keys);
+            value_retain(val);
+            return hash;
+        }
+        if (!hash_unshare(vm, hash, 1)) return NULL;
+        keys = hash->as.hash.keys;
     }
 
-    if (hash->as.hash.keys[slot] == NULL) {
-        hash->as.hash.keys[slot] = key;
-        value_retain(key);
-        hash->as.hash.size++;
-    } else {
-        value_release(vm, hash->as.hash.values[slot]);
+    if (keys->nentries >= hash_usable(keys->capacity)) {
+        if (!hash_resize(vm, hash)) return NULL;
+        keys = hash->as.hash.keys;
     }
 
-    hash->as.hash.values[slot] = val;
+    keys_append(keys, key, val, h);
+    value_retain(key);
     value_retain(val);
+    hash->as.hash.size++;
     return hash;
 }
 
 value_t *hash_get(vm_t *vm, value_t *hash, value_t *key) {
+    if (!value_is_hash(hash) || !hash->as.hash.keys) return NULL;
+
+    uint64_t h;
+    if (!hash_key(key, &h)) return NULL;
+
+    hash_keys_t *keys = hash->as.hash.keys;
+    size_t idx = keys_find(keys, key, h);
+    if (idx == (size_t)-1) return NULL;
+
+    return keys->is_shape ? hash->as.hash.values[idx] : keys->entries[idx].value;
+}
+
+// Lookup through a monomorphic inline cache: when the hash has the shape
+// the cache saw last time and the key is the same object, the answer is a
+// plain indexed load.
+value_t *hash_get_cached(vm_t *vm, value_t *hash, value_t *key, hash_ic_t *ic) {
     if (!value_is_hash(hash)) return NULL;
 
-    size_t slot = hash_find_slot(hash, key);
-    if (slot == (size_t)-1 || !hash->as.hash.keys[slot]) return NULL;
+    hash_keys_t *keys = hash->as.hash.keys;
+    if (keys && keys == ic->shape && key == ic->key) {
+        return hash->as.hash.values[ic->index];
+    }
+
+    uint64_t h;
+    if (!keys || !hash_key(key, &h)) return NULL;
+
+    size_t idx = keys_find(keys, key, h);
+    if (idx == (size_t)-1) return NULL;
+
+    if (!keys->is_shape) return keys->entries[idx].value;
+
+    hash_ic_clear(vm, ic);
+    keys->refcount++;
+    value_retain(key);
+    ic->shape = keys;
+    ic->key = key;
+    ic->index = (uint32_t)idx;
+    return hash->as.hash.values[idx];
+}
+
+void hash_ic_clear(vm_t *vm, hash_ic_t *ic) {
+    keys_release(vm, ic->shape);
+    value_release(vm, ic->key);
+    ic->shape = NULL;
+    ic->key = NULL;
+    ic->index = 0;
+}
+
+// Returns a new reference to a string key holding s, shared with earlier
+// calls for the same bytes while it stays in the VM's direct-mapped table.
+// Shapes extended by an interned key then match later ones by pointer.
+value_t *hash_intern_key(vm_t *vm, const char *s, size_t len) {
+    if (!vm || len > HASH_INTERN_MAX_LEN) return value_string_n(vm, s, len);
+
+    value_t **slot = &vm->key_intern[hash_bytes(s, len) & (VM_KEY_INTERN_SIZE - 1)];
+    value_t *key = *slot;
+    if (key && key->as.string.len == len && memcmp(key->as.string.data, s, len) == 0) {
+        value_retain(key);
+        return key;
+    }
+
+    key = value_string_n(vm, s, len);
+    if (!key) return NULL;
+    value_release(vm, *slot);
+    value_retain(key);
+    *slot = key;
+    return key;
+}
+
+int hash_remove(vm_t *vm, value_t *hash, value_t *key) {
+    if (!value_is_hash(hash) || !hash->as.hash.keys || value_in_arena(hash)) return 0;
+
+    uint64_t h;
+    if (!hash_key(key, &h)) return 0;
+
+    hash_keys_t *keys = hash->as.hash.keys;
+    size_t idx = keys_find(keys, key, h);
+    if (idx == (size_t)-1) return 0;
+
+    if (keys->is_shape) {
+        if (!hash_unshare(vm, hash, 0)) return 0;
+        keys = hash->as.hash.keys;
+    }
+
+    // The entry stays as a hole until the next resize so that the order of
+    // the remaining entries is untouched.
+    hash_entry_t *e = &keys->entries[idx];
+    keys_set_ctrl(keys, keys_slot_of(keys, h, idx), CTRL_DELETED);
+    value_release(vm, e->key);
+    value_release(vm, e->value);
+    e->key = NULL;
+    e->value = NULL;
+    hash->as.hash.size--;
+    return 1;
+}
+
+// Moves the value stored under key out of the hash, leaving null in its
+// place, and returns it along with the hash's reference. Returns NULL if
+// the key is absent.
+value_t *hash_take(vm_t *vm, value_t *hash, value_t *key) {
+    if (!value_is_hash(hash) || !hash->as.hash.keys || value_in_arena(hash)) return NULL;
+
+    uint64_t h;
+    if (!hash_key(key, &h)) return NULL;
+
+    hash_keys_t *keys = hash->as.hash.keys;
+    size_t idx = keys_find(keys, key, h);
+    if (idx == (size_t)-1) return NULL;
+
+    value_t **slot = keys->is_shape ? &hash->as.hash.values[idx] : &keys->entries[idx].value;
+    value_t *val = *slot;
+    *slot = value_null(vm);
+    return val;
+}
+
+// Copies a hash without re-inserting every entry: shaped hashes share
+// their shape, private tables are copied wholesale.
+value_t *hash_copy(vm_t *vm, value_t *hash) {
+    if (!value_is_hash(hash)) return NULL;
+
+    value_t *copy = value_hash(vm);
+    hash_keys_t *keys = hash->as.hash.keys;
+    if (!copy || !keys) return copy;
+
+    if (keys->is_shape) {
+        size_t n = hash->as.hash.size;
+        if (n > 0) {
+            copy->as.hash.values = vm_alloc(vm, VTYPE_HASH, shape_values_cap(n) * sizeof(value_t *));
+            if (!copy->as.hash.values) {
+                value_release(vm, copy);
+                return NULL;
+            }
+            memcpy(copy->as.hash.values, hash->as.hash.values, n * sizeof(value_t *));
+        }
+        keys->refcount++;
+        copy->as.hash.keys = keys;
+    } else {
+        size_t bytes = keys_bytes(keys->capacity);
+        copy->as.hash.keys = vm_alloc(vm, VTYPE_HASH, bytes);
+        if (!copy->as.hash.keys) {
+            value_release(vm, copy);
+            return NULL;
+        }
+        memcpy(copy->as.hash.keys, keys, bytes);
+        copy->as.hash.keys->refcount = 1;
+    }
+    copy->as.hash.size = hash->as.hash.size;
+
+    size_t iter = 0;
+    value_t *key, *val;
+    while (hash_next(copy, &iter, &key, &val)) {
+        if (!keys->is_shape) value_retain(key);
+        value_retain(val);
+    }
+    return copy;
+}
+
+// Iterates live entries in insertion order: start with *iter = 0 and call
+// until it returns 0.
+int hash_next(value_t *hash, size_t *iter, value_t **key, value_t **val) {
+    if (!value_is_hash(hash) || !hash->as.hash.keys) return 0;
+
+    hash_keys_t *keys = hash->as.hash.keys;
+    while (*iter < keys->nentries) {
+        size_t i = (*iter)++;
+        hash_entry_t *e = &keys->entries[i];
+        if (!e->key) continue;
+        if (key) *key = e->key;
+        if (val) *val = keys->is_shape ? hash->as.hash.values[i] : e->value;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Value arenas: a whole document (a parsed JSON response, say) placed in a
+ * few large blocks. Values inside never count references to each other;
+ * the arena keeps one count for every reference from outside, and the last
+ * release frees all blocks at once instead of walking the document. Arena
+ * values are read-only, which is what makes skipping the counts safe. A
+ * hash uses the VM's shapes like any other, with the arena holding one
+ * reference per shape.
+ */
+
+#define ARENA_MIN_BLOCK 4096
+#define ARENA_MAX_BLOCK (4u << 20)
+
+/*
+ * An arena filled by a worker thread (see value_arena_detach()) takes its
+ * group's lock around everything that touches the VM: block allocation,
+ * errors and the shape tree. Each block is charged to the VM, untyped, as
+ * it is made; its values are only tallied by type until
+ * value_arena_merge() moves them into an arena of the VM's own thread. A
+ * refused block stops the group, and every arena in it then fails its next
+ * value.
+ */
+static void *arena_malloc(value_arena_t *a, size_t size) {
+    arena_group_t *g = a->group;
+    if (!g) {
+        void *p = gc_malloc(a->vm, size);
+        if (!p) vm_set_error(a->vm, VERR_RUNTIME, "out of memory");
+        return p;
+    }
+
+    pthread_mutex_lock(&g->lock);
+    void *p = NULL;
+    if (!g->stop && vm_mem_charge(a->vm, VTYPE_NULL, size)) {
+        p = gc_malloc(a->vm, size);
+        if (p) {
+            a->held += size;
+        } else {
+            vm_mem_uncharge(a->vm, VTYPE_NULL, size);
+            vm_set_error(a->vm, VERR_RUNTIME, "out of memory");
+        }
+    }
+    if (!p) __atomic_store_n(&g->stop, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&g->lock);
+    return p;
+}
+
+static int arena_charge(value_arena_t *a, vtype_t type, size_t size) {
+    if (a->group ? __atomic_load_n(&a->group->stop, __ATOMIC_RELAXED) : !vm_mem_charge(a->vm, type, size)) return 0;
+    a->bytes[type] += size;
+    return 1;
+}
+
+static int arena_add_block(value_arena_t *a, size_t need) {
+    size_t size = a->block_size;
+    while (size < need + sizeof(arena_block_t)) size *= 2;
+
+    arena_block_t *block = arena_malloc(a, size);
+    if (!block) return 0;
+    block->h.arena = a;
+    block->h.next = a->blocks;
+    block->h.size = size;
+    a->blocks = block;
+    a->cell_next = (value_t *)(block + 1);
+    a->byte_next = (char *)block + size;
+    if (a->block_size < ARENA_MAX_BLOCK) a->block_size *= 2;
+    return 1;
+}
+
+// Starts an arena sized for a document of about size_hint bytes. The caller
+// holds the arena's one reference until it hands it on with the root value.
+value_arena_t *value_arena_create(vm_t *vm, size_t size_hint) {
+    value_arena_t *a = gc_malloc(vm, sizeof(value_arena_t));
+    if (!a) {
+        vm_set_error(vm, VERR_RUNTIME, "out of memory");
+        return NULL;
+    }
+    memset(a, 0, sizeof(value_arena_t));
+    a->refcount = 1;
+    a->vm = vm;
+    a->block_size = ARENA_MIN_BLOCK;
+    while (a->block_size < size_hint * 2 && a->block_size < ARENA_MAX_BLOCK) a->block_size *= 2;
+    if (!arena_add_block(a, 0)) {
+        gc_free(vm, a);
+        return NULL;
+    }
+    return a;
+}
+
+void value_arena_retain(value_arena_t *a) {
+    a->refcount++;
+}
+
+void value_arena_release(value_arena_t *a) {
+    if (a && --a->refcount == 0) value_arena_free(a);
+}
+
+// Empties an arena for the next document once only the caller's reference
+// is left, keeping the block being filled and the shapes seen so far.
+// Returns 0 if values in it are still referenced.
+int value_arena_reset(value_arena_t *a) {
+    if (a->refcount != 1) return 0;
+    arena_block_t *keep = a->blocks;
+    while (keep->h.next) {
+        arena_block_t *next = keep->h.next->h.next;
+        gc_free(a->vm, keep->h.next);
+        keep->h.next = next;
+    }
+    for (int t = 0; t < VTYPE_COUNT; t++) {
+        vm_mem_uncharge(a->vm, (vtype_t)t, a->bytes[t]);
+        a->bytes[t] = 0;
+    }
+    a->cell_next = (value_t *)(keep + 1);
+    a->byte_next = (char *)keep + keep->h.size;
+    return 1;
+}
+
+// Hands an arena to a worker thread, which may then fill it while the VM's
+// thread waits. Every worker of one VM must share the group. Returns 0
+// when the VM's memory limit refuses the block the arena starts with.
+static int value_arena_detach(value_arena_t *a, arena_group_t *g) {
+    if (!vm_mem_charge(a->vm, VTYPE_NULL, a->blocks->h.size)) return 0;
+    a->held = a->blocks->h.size;
+    a->group = g;
+    return 1;
+}
+
+// Moves the blocks, shapes and memory of a detached arena into dst, which
+// belongs to the VM's thread, and frees src. Returns 0, leaving src as it
+// was, when out of memory.
+static int value_arena_merge(value_arena_t *dst, value_arena_t *src) {
+    vm_t *vm = dst->vm;
+    if (dst->nshapes + src->nshapes > dst->shapes_cap) {
+        size_t cap = dst->nshapes + src->nshapes;
+        hash_keys_t **shapes = gc_realloc(vm, dst->shapes, dst->shapes_cap * sizeof(hash_keys_t *),
+                                          cap * sizeof(hash_keys_t *));
+        if (!shapes) {
+            vm_set_error(vm, VERR_RUNTIME, "out of memory");
+            return 0;
+        }
+        dst->shapes = shapes;
+        dst->shapes_cap = cap;
+    }
+    memcpy(dst->shapes + dst->nshapes, src->shapes, src->nshapes * sizeof(hash_keys_t *));
+    dst->nshapes += src->nshapes;
+
+    // The values fit in the blocks already charged, so charging them by
+    // type instead cannot pass the limit.
+    vm_mem_uncharge(vm, VTYPE_NULL, src->held);
+    for (int t = 0; t < VTYPE_COUNT; t++) {
+        vm_mem_charge(vm, (vtype_t)t, src->bytes[t]);
+        dst->bytes[t] += src->bytes[t];
+    }
+
+    // Cells find their arena through their block, so relabelling the
+    // blocks moves them. They go behind the block dst is filling.
+    arena_block_t *last = src->blocks;
+    for (arena_block_t *b = src->blocks; b; b = b->h.next) {
+        b->h.arena = dst;
+        last = b;
+    }
+    last->h.next = dst->blocks->h.next;
+    dst->blocks->h.next = src->blocks;
+
+    gc_free(vm, src->shapes);
+    gc_free(vm, src);
+    return 1;
+}
+
+static void value_arena_free(value_arena_t *a) {
+    vm_t *vm = a->vm;
+    for (size_t i = 0; i < a->nshapes; i++) {
+        keys_release(vm, a->shapes[i]);
+    }
+    gc_free(vm, a->shapes);
+    if (a->group) {
+        vm_mem_uncharge(vm, VTYPE_NULL, a->held);
+    } else {
+        for (int t = 0; t < VTYPE_COUNT; t++) vm_mem_uncharge(vm, (vtype_t)t, a->bytes[t]);
+    }
+    while (a->blocks) {
+        arena_block_t *next = a->blocks->h.next;
+        gc_free(vm, a->blocks);
+        a->blocks = next;
+    }
+    gc_free(vm, a);
+}
+
+/*
+ * Parallel building, for large JSON arrays and data files: each range is
+ * built on a thread of its own into a detached arena, and once all are
+ * done the arenas are merged into dst and the values they built gathered,
+ * in range order, into one vector.
+ */
+
+typedef struct arena_range {
+    value_range_fn build;
+    void *ctx;
+    size_t index;
+    value_arena_t *arena;
+    value_t **items;
+    size_t nitems;
+    int ok;
+    pthread_t thread;
+} arena_range_t;
+
+static void *arena_range_run(void *arg) {
+    arena_range_t *r = arg;
+    r->ok = r->build(r->ctx, r->index, r->arena, &r->items, &r->nitems);
+    return NULL;
+}
+
+// Builds n ranges, range i into an arena sized for hints[i] bytes, and
+// returns the vector of their values. Returns NULL with the VM's error set
+// when memory runs out, or with no error when a range failed, in which
+// case the caller should build the input again on one thread to report it.
+value_t *value_arena_parallel(value_arena_t *dst, size_t n, const size_t *hints, value_range_fn build, void *ctx) {
+    vm_t *vm = dst->vm;
+    arena_range_t *ranges = gc_malloc(vm, n * sizeof(arena_range_t));
+    if (!ranges) {
+        vm_set_error(vm, VERR_RUNTIME, "out of memory");
+        return NULL;
+    }
+    arena_group_t group;
+    pthread_mutex_init(&group.lock, NULL);
+    group.stop = 0;
+    size_t made = 0;
+    for (; made < n; made++) {
+        arena_range_t *r = &ranges[made];
+        memset(r, 0, sizeof(*r));
+        r->build = build;
+        r->ctx = ctx;
+        r->index = made;
+        r->arena = value_arena_create(vm, hints[made]);
+        if (!r->arena) break;
+        if (!value_arena_detach(r->arena, &group)) {
+            value_arena_release(r->arena);
+            break;
+        }
+    }
+
+    // This thread takes the first range; a thread that cannot be started
+    // leaves its range to be built here as well.
+    int ok = made == n;
+    for (size_t i = 1; ok && i < n; i++) {
+        if (pthread_create(&ranges[i].thread, NULL, arena_range_run, &ranges[i]) != 0) ranges[i].thread = 0;
+    }
+    if (ok) arena_range_run(&ranges[0]);
+    for (size_t i = 1; ok && i < n; i++) {
+        if (ranges[i].thread) {
+            pthread_join(ranges[i].thread, NULL);
+        } else {
+            arena_range_run(&ranges[i]);
+        }
+    }
+    pthread_mutex_destroy(&group.lock);
+
+    size_t total = 0;
+    for (size_t i = 0; i < made; i++) {
+        ok = ok && ranges[i].ok;
+        total += ranges[i].nitems;
+    }
+
+    value_t **items = ok ? gc_malloc(vm, (total ? total : 1) * sizeof(value_t *)) : NULL;
+    size_t merged = 0;
+    if (items) {
+        for (total = 0; merged < n; merged++) {
+            arena_range_t *r = &ranges[merged];
+            if (!value_arena_merge(dst, r->arena)) break;
+            memcpy(items + total, r->items, r->nitems * sizeof(value_t *));
+            total += r->nitems;
+        }
+    } else if (ok) {
+        vm_set_error(vm, VERR_RUNTIME, "out of memory");
+    }
+    value_t *result = items && merged == n ? value_arena_vector(dst, items, total) : NULL;
+
+    for (size_t i = 0; i < made; i++) {
+        if (i >= merged) value_arena_release(ranges[i].arena);
+        gc_free(NULL, ranges[i].items);
+    }
+    gc_free(vm, items);
+    gc_free(vm, ranges);
+    return result;
+}
+
+static value_t *arena_cell(value_arena_t *a, vtype_t type) {
+    if ((char *)(a->cell_next + 1) > a->byte_next && !arena_add_block(a, sizeof(value_t))) return NULL;
+    if (!arena_charge(a, type, sizeof(value_t))) return NULL;
+
+    value_t *v = a->cell_next++;
+    memset(v, 0, sizeof(value_t));
+    v->type = type;
+    v->flags = VALUE_ARENA;
+    v->refcount = (int)(v - (value_t *)a->blocks);
+    return v;
+}
+
+// Buffers fill the current block from its end. One too big for a block
+// gets a block of its own, linked behind the current one.
+static void *arena_bytes(value_arena_t *a, vtype_t type, size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    if (!arena_charge(a, type, size)) return NULL;
+
+    if (size > a->block_size / 4) {
+        arena_block_t *block = arena_malloc(a, sizeof(arena_block_t) + size);
+        if (!block) return NULL;
+        block->h.arena = a;
+        block->h.size = sizeof(arena_block_t) + size;
+        block->h.next = a->blocks->h.next;
+        a->blocks->h.next = block;
+        return block + 1;
+    }
+    if (a->byte_next - size < (char *)a->cell_next && !arena_add_block(a, size)) return NULL;
+    a->byte_next -= size;
+    return a->byte_next;
+}
+
+value_t *value_arena_number(value_arena_t *a, uint64_t n) {
+    value_t *v = arena_cell(a, VTYPE_NUMBER);
+    if (v) v->as.number = n;
+    return v;
+}
+
+value_t *value_arena_double(value_arena_t *a, double d) {
+    value_t *v = arena_cell(a, VTYPE_NUMBER);
+    if (v) {
+        v->as.floating = d;
+        v->flags |= VALUE_DOUBLE;
+    }
+    return v;
+}
+
+// Copies len bytes of s into the arena. With s NULL the caller fills in the
+// data and may shorten the string, as long as it keeps it NUL-terminated.
+value_t *value_arena_string(value_arena_t *a, const char *s, size_t len) {
+    char *data = arena_bytes(a, VTYPE_STRING, len + 1);
+    value_t *v = data ? arena_cell(a, VTYPE_STRING) : NULL;
+    if (!v) return NULL;
+    if (s) memcpy(data, s, len);
+    data[len] = '\0';
+    v->as.string.data = data;
+    v->as.string.len = len;
+    return v;
+}
+
+value_t *value_arena_symbol(value_arena_t *a, const char *s, size_t len) {
+    char *name = arena_bytes(a, VTYPE_SYMBOL, len + 1);
+    value_t *v = name ? arena_cell(a, VTYPE_SYMBOL) : NULL;
+    if (!v) return NULL;
+    memcpy(name, s, len);
+    name[len] = '\0';
+    v->as.symbol.name = name;
+    v->as.symbol.hash = hash_bytes(s, len);
+    return v;
+}
 
-    return hash->as.hash.values[slot];
+// car and cdr must be values of the same arena, or immortal. The pair is
+// the builder's to finish: a list is made by setting each tail's cdr.
+value_t *value_arena_pair(value_arena_t *a, value_t *car, value_t *cdr) {
+    value_t *v = arena_cell(a, VTYPE_PAIR);
+    if (v) {
+        v->as.pair.car = car;
+        v->as.pair.cdr = cdr;
+    }
+    return v;
+}
+
+// Items must be values of the same arena, or immortal.
+value_t *value_arena_vector(value_arena_t *a, value_t **items, size_t n) {
+    value_t **elements = n ? arena_bytes(a, VTYPE_VECTOR, n * sizeof(value_t *)) : NULL;
+    if (n && !elements) return NULL;
+    value_t *v = arena_cell(a, VTYPE_VECTOR);
+    if (!v) return NULL;
+    if (n) memcpy(elements, items, n * sizeof(value_t *));
+    v->as.vector.elements = elements;
+    v->as.vector.size = n;
+    v->as.vector.capacity = n;
+    return v;
+}
+
+static int arena_hold_shape(value_arena_t *a, hash_keys_t *shape) {
+    // Documents tend to repeat a few shapes; look at the recent ones only.
+    for (size_t i = a->nshapes, seen = 0; i-- > 0 && seen < 8; seen++) {
+        if (a->shapes[i] == shape) {
+            keys_release(a->vm, shape);
+            return 1;
+        }
+    }
+    if (a->nshapes == a->shapes_cap) {
+        size_t cap = a->shapes_cap ? a->shapes_cap * 2 : 8;
+        hash_keys_t **shapes = gc_realloc(a->vm, a->shapes, a->shapes_cap * sizeof(hash_keys_t *),
+                                          cap * sizeof(hash_keys_t *));
+        if (!shapes) {
+            keys_release(a->vm, shape);
+            vm_set_error(a->vm, VERR_RUNTIME, "out of memory");
+            return 0;
+        }
+        a->shapes = shapes;
+        a->shapes_cap = cap;
+    }
+    a->shapes[a->nshapes++] = shape;
+    return 1;
+}
+
+// Copies a key into the arena unless it already lives there.
+static value_t *arena_key(value_arena_t *a, value_t *key) {
+    if (key->flags & (VALUE_IMMORTAL | VALUE_ARENA)) return key;
+    if (key->type == VTYPE_STRING) return value_arena_string(a, key->as.string.data, key->as.string.len);
+    value_t *copy = arena_cell(a, key->type);
+    if (copy) copy->as = key->as;
+    return copy;
+}
+
+// Builds a hash from n key/value pairs. Values must be of the arena or
+// immortal; keys may be any strings or numbers and stay the caller's. A
+// repeated key keeps its first position and its last value, as with
+// hash_set().
+value_t *value_arena_hash(value_arena_t *a, value_t **keys, value_t **vals, size_t n) {
+    vm_t *vm = a->vm;
+    value_t *v = arena_cell(a, VTYPE_HASH);
+    if (!v || n == 0) return v;
+
+    value_t **values = arena_bytes(a, VTYPE_HASH, shape_values_cap(n) * sizeof(value_t *));
+    if (!values) return NULL;
+
+    // Records in a document mostly repeat a recent shape with the keys in
+    // the same order, which can be checked without walking the tree.
+    for (size_t s = a->nshapes, seen = 0; s-- > 0 && seen < 4; seen++) {
+        hash_keys_t *recent = a->shapes[s];
+        if (recent->nentries != n) continue;
+        size_t i = 0;
+        for (; i < n; i++) {
+            hash_entry_t *e = &recent->entries[i];
+            uint64_t h;
+            if (e->key != keys[i] && (!hash_key(keys[i], &h) || e->hash != h || !value_equal(e->key, keys[i]))) break;
+            values[i] = vals[i];
+        }
+        if (i == n) {
+            v->as.hash.keys = recent;
+            v->as.hash.values = values;
+            v->as.hash.size = n;
+            return v;
+        }
+    }
+
+    if (a->group) pthread_mutex_lock(&a->group->lock);
+    hash_keys_t *shape = vm ? vm->hash_root : NULL;
+    size_t size = 0;
+    for (size_t i = 0; i < n && shape; i++) {
+        uint64_t h;
+        if (!hash_key(keys[i], &h)) continue;
+        size_t idx = keys_find(shape, keys[i], h);
+        if (idx != (size_t)-1) {
+            values[idx] = vals[i];
+            continue;
+        }
+        hash_keys_t *child = shape_extend(vm, shape, keys[i], h);
+        if (shape != vm->hash_root) keys_release(vm, shape);
+        shape = child;
+        values[size++] = vals[i];
+    }
+
+    int held = shape && shape != vm->hash_root ? arena_hold_shape(a, shape) : 1;
+    if (a->group) pthread_mutex_unlock(&a->group->lock);
+    if (shape) {
+        if (shape == vm->hash_root) {
+            return v;
+        }
+        if (!held) return NULL;
+        v->as.hash.keys = shape;
+        v->as.hash.values = values;
+        v->as.hash.size = size;
+        return v;
+    }
+
+    // Too many keys to share a shape: a private table in the arena.
+    size_t capacity = keys_capacity_for(n);
+    hash_keys_t *table = arena_bytes(a, VTYPE_HASH, keys_bytes(capacity));
+    if (!table) return NULL;
+    keys_init(table, capacity, 0);
+    size = 0;
+    for (size_t i = 0; i < n; i++) {
+        uint64_t h;
+        if (!hash_key(keys[i], &h)) continue;
+        size_t idx = keys_find(table, keys[i], h);
+        if (idx != (size_t)-1) {
+            table->entries[idx].value = vals[i];
+        } else {
+            value_t *key = arena_key(a, keys[i]);
+            if (!key) return NULL;
+            keys_append(table, key, vals[i], h);
+            size++;
+        }
+    }
+    v->as.hash.keys = table;
+    v->as.hash.size = size;
+    return v;
 }
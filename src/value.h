@@ -2,6 +2,7 @@
 #define VALUE_H
 
 #include <stdint.h>
+#include <pthread.h>
 #include <stddef.h>
 
 typedef struct vm vm_t;
@@ -17,17 +18,63 @@ typedef enum {
     VTYPE_HASH,
     VTYPE_LAMBDA,
     VTYPE_NATIVE,
+    VTYPE_RECORD,
+    VTYPE_RECORD_TYPE,
+    VTYPE_RECORD_PROC,
+    VTYPE_LAZY,
+    VTYPE_PATH,
 } vtype_t;
 
+#define VTYPE_COUNT (VTYPE_PATH + 1)
+
+typedef enum {
+    RECORD_CONSTRUCTOR,
+    RECORD_PREDICATE,
+    RECORD_ACCESSOR,
+    RECORD_MODIFIER,
+} record_proc_t;
+
+typedef struct hash_entry {
+    struct value *key;
+    struct value *value;
+    uint64_t hash;
+} hash_entry_t;
+
+typedef struct hash_keys hash_keys_t;
+typedef struct value_arena value_arena_t;
+typedef struct lazy_doc lazy_doc_t;
+typedef struct json_path json_path_t;
+
+// value_t flags
+#define VALUE_IMMORTAL 0x01  // statically allocated; never counted or freed
+#define VALUE_BUFFERED 0x02  // queued as a possible cycle root (see gc.c)
+#define VALUE_PENDING  0x04  // dead, waiting for its children to be released
+#define VALUE_POOLED   0x08  // allocated from the VM's value pool
+#define VALUE_LAST_USE 0x10  // symbol: last read of a local, moves the value
+#define VALUE_ANALYZED 0x20  // lambda body: last uses have been marked
+#define VALUE_ARENA    0x40  // lives in a value arena; read-only, counted per arena
+#define VALUE_MAPPED   0x80  // string: data is a file mapping, unmapped on free
+#define VALUE_DOUBLE   0x100 // number: as.floating holds the value
+
 typedef struct value {
-    vtype_t type;
+    vtype_t type : 8;
+    unsigned int color : 2;  // cycle collector mark
+    unsigned int flags : 22;
     int refcount;
     union {
         int boolean;
         uint64_t number;
         double floating;
-        char *string;
-        char *symbol;
+        struct {
+            char *data;
+            size_t len;
+            struct value *parent;
+        } string;
+        struct {
+            char *name;
+            uint64_t hash;
+            uint32_t depth;  // last uses: frames between the read and its binding
+        } symbol;
         struct {
             struct value *car;
             struct value *cdr;
@@ -38,10 +85,9 @@ typedef struct value {
             size_t capacity;
         } vector;
         struct {
-            struct value **keys;
-            struct value **values;
-            size_t size;
-            size_t capacity;
+            hash_keys_t *keys;     // private table, or a shared shape
+            struct value **values; // one per shape key; NULL for private tables
+            size_t size;           // live entries
         } hash;
         struct {
             struct value *params;
@@ -49,26 +95,101 @@ typedef struct value {
             struct value *env;
         } lambda;
         struct value *(*native_func)(vm_t *vm, struct value *args);
+        struct {
+            struct value *type;
+            struct value **slots;
+            size_t nslots;    // the type's field count, kept for freeing
+        } record;
+        struct {
+            struct value *name;
+            struct value **fields;
+            size_t nfields;
+        } record_type;
+        struct {
+            struct value *type;
+            record_proc_t kind;
+            uint32_t index;   // field slot, or argument count for constructors
+            uint32_t *args;   // constructors: the slot each argument fills
+        } record_proc;
+        struct {
+            lazy_doc_t *doc;      // dropped once forced
+            uint32_t token;       // where the value starts in doc's index
+            struct value *value;  // the forced value, or NULL
+        } lazy;
+        struct {
+            json_path_t *compiled;
+            void (*destroy)(vm_t *vm, json_path_t *compiled);
+        } path;
     } as;
 } value_t;
 
+// Shared by the lazy values of one document. The loader that made it turns
+// a token into a value, one level deep, when a lazy value is first used.
+struct lazy_doc {
+    int refcount;
+    struct value *text;       // the document's bytes, as a string
+    uint32_t *index;          // token starts in text
+    size_t nindex;
+    struct value *(*force)(vm_t *vm, lazy_doc_t *doc, uint32_t token);
+};
+
 value_t *value_null(vm_t *vm);
 value_t *value_bool(vm_t *vm, int b);
 value_t *value_number(vm_t *vm, uint64_t n);
 value_t *value_double(vm_t *vm, double d);
 value_t *value_string(vm_t *vm, const char *s);
+value_t *value_string_n(vm_t *vm, const char *s, size_t len);
+value_t *value_string_take(vm_t *vm, char *buf, size_t len);
+value_t *value_string_slice(vm_t *vm, value_t *str, size_t offset, size_t len);
 value_t *value_symbol(vm_t *vm, const char *s);
+value_t *value_symbol_n(vm_t *vm, const char *s, size_t len);
 value_t *value_pair(vm_t *vm, value_t *car, value_t *cdr);
 value_t *value_vector(vm_t *vm);
 value_t *value_hash(vm_t *vm);
 value_t *value_lambda(vm_t *vm, value_t *params, value_t *body, value_t *env);
 value_t *value_native(vm_t *vm, value_t *(*func)(vm_t *, value_t *));
+value_t *value_record_type(vm_t *vm, value_t *name, value_t **fields, size_t nfields);
+value_t *value_record(vm_t *vm, value_t *type);
+value_t *value_record_proc(vm_t *vm, value_t *type, record_proc_t kind, uint32_t index);
+value_t *value_vector_take(vm_t *vm, value_t **items, size_t n);
+value_t *value_string_mapped(vm_t *vm, char *data, size_t len);
+value_t *value_lazy(vm_t *vm, lazy_doc_t *doc, uint32_t token);
+value_t *value_path(vm_t *vm, json_path_t *compiled, void (*destroy)(vm_t *vm, json_path_t *compiled));
+value_t *value_force(vm_t *vm, value_t *v);
+void lazy_doc_release(vm_t *vm, lazy_doc_t *doc);
+
+value_arena_t *value_arena_create(vm_t *vm, size_t size_hint);
+void value_arena_retain(value_arena_t *a);
+void value_arena_release(value_arena_t *a);
+int value_arena_reset(value_arena_t *a);
+
+// Builds range i of a parallel job into arena, a detached arena of its
+// own that it may fill on a worker thread, and hands over the values it
+// built, in order, as *items (from gc_malloc(NULL)) and *nitems, even when
+// it fails. Returns 0 on an error.
+typedef int (*value_range_fn)(void *ctx, size_t i, value_arena_t *arena, value_t ***items, size_t *nitems);
+value_t *value_arena_parallel(value_arena_t *dst, size_t n, const size_t *hints, value_range_fn build, void *ctx);
+
+value_t *value_arena_number(value_arena_t *a, uint64_t n);
+value_t *value_arena_double(value_arena_t *a, double d);
+value_t *value_arena_string(value_arena_t *a, const char *s, size_t len);
+value_t *value_arena_symbol(value_arena_t *a, const char *s, size_t len);
+value_t *value_arena_pair(value_arena_t *a, value_t *car, value_t *cdr);
+value_t *value_arena_vector(value_arena_t *a, value_t **items, size_t n);
+value_t *value_arena_hash(value_arena_t *a, value_t **keys, value_t **vals, size_t n);
 
 void value_retain(value_t *v);
 void value_release(vm_t *vm, value_t *v);
+void value_disown(value_t *v);
+void value_destroy(vm_t *vm, value_t *v);
+void value_children(value_t *v, void (*visit)(value_t *child, void *ctx), void *ctx);
+void value_free(vm_t *vm, value_t *v);
+void value_release_arena_children(vm_t *vm, value_t *v);
 int value_equal(value_t *a, value_t *b);
 
 int value_is_null(value_t *v);
+int value_is_lazy(value_t *v);
+int value_is_path(value_t *v);
 int value_is_bool(value_t *v);
 int value_is_number(value_t *v);
 int value_is_string(value_t *v);
@@ -78,18 +199,42 @@ int value_is_vector(value_t *v);
 int value_is_hash(value_t *v);
 int value_is_lambda(value_t *v);
 int value_is_native(value_t *v);
+int value_is_record(value_t *v);
+int value_is_record_type(value_t *v);
+int value_is_record_proc(value_t *v);
 int value_is_callable(value_t *v);
+int value_is_unique(value_t *v);
+int value_in_arena(value_t *v);
 
 int value_to_bool(value_t *v);
 int value_to_number(value_t *v, uint64_t *out);
 int value_to_double(value_t *v, double *out);
-int value_to_string(value_t *v, const char **out);
+int value_to_string(vm_t *vm, value_t *v, const char **out);
+const char *value_cstr(vm_t *vm, value_t *v);
 
 value_t *vector_push(vm_t *vm, value_t *vec, value_t *item);
 value_t *vector_get(vm_t *vm, value_t *vec, size_t index);
 size_t vector_len(value_t *vec);
+value_t *vector_copy(vm_t *vm, value_t *vec);
 
 value_t *hash_set(vm_t *vm, value_t *hash, value_t *key, value_t *val);
 value_t *hash_get(vm_t *vm, value_t *hash, value_t *key);
 
+typedef struct hash_ic {
+    hash_keys_t *shape;
+    value_t *key;
+    uint32_t index;
+} hash_ic_t;
+
+value_t *hash_get_cached(vm_t *vm, value_t *hash, value_t *key, hash_ic_t *ic);
+void hash_ic_clear(vm_t *vm, hash_ic_t *ic);
+value_t *hash_intern_key(vm_t *vm, const char *s, size_t len);
+hash_keys_t *hash_shape_root(vm_t *vm);
+void hash_shape_release(vm_t *vm, hash_keys_t *shape);
+int hash_remove(vm_t *vm, value_t *hash, value_t *key);
+value_t *hash_take(vm_t *vm, value_t *hash, value_t *key);
+value_t *hash_copy(vm_t *vm, value_t *hash);
+int hash_next(value_t *hash, size_t *iter, value_t **key, value_t **val);
+uint64_t hash_bytes(const void *data, size_t len);
+
 #endif
\ No newline at end of file
@@ -3,29 +3,81 @@
 #include <string.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <unistd.h>
+
+// Frees every value the VM allocated.
+static void vm_teardown(vm_t *vm) {
+    value_release(vm, vm->global_env);
+    for (size_t i = 0; i < VM_HASH_IC_SIZE; i++) {
+        hash_ic_clear(vm, &vm->hash_ic[i]);
+    }
+    for (size_t i = 0; i < VM_KEY_INTERN_SIZE; i++) {
+        value_release(vm, vm->key_intern[i]);
+        vm->key_intern[i] = NULL;
+    }
+    gc_collect(vm);
+    hash_shape_release(vm, vm->hash_root);
+    gc_destroy(vm);
+    vm->global_env = NULL;
+    vm->hash_root = NULL;
+}
+
+static int vm_setup(vm_t *vm, const gc_allocator_t *alloc) {
+    gc_init(&vm->gc);
+    if (alloc) vm->gc.alloc = *alloc;
+    vm->hash_root = hash_shape_root(vm);
+    vm->global_env = value_hash(vm);
+    if (!vm->hash_root || !vm->global_env) {
+        vm_teardown(vm);
+        return 0;
+    }
+    return 1;
+}
 
 vm_t *vm_create(void) {
     vm_t *vm = calloc(1, sizeof(vm_t));
     if (!vm) return NULL;
 
-    vm->global_env = value_hash(vm);
-    if (!vm->global_env) {
+    if (!vm_setup(vm, NULL)) {
         free(vm);
         return NULL;
     }
-    value_retain(vm->global_env);
-
     return vm;
 }
 
 void vm_destroy(vm_t *vm) {
     if (!vm) return;
 
-    value_release(vm, vm->global_env);
+    // An allocator that cannot free individual blocks is an arena the host
+    // drops as a whole, so there is nothing to walk.
+    if (!vm->gc.alloc.malloc_fn || vm->gc.alloc.free_fn) {
+        vm_teardown(vm);
+    } else {
+        gc_set_reclaimer(vm, 0);
+    }
     free(vm->error_message);
     free(vm);
 }
 
+// Moves the VM onto another allocator. Everything allocated so far is freed
+// and the global environment starts out empty again, so hosts switch right
+// after creating the VM, before holding any values. Returns 0 if the new
+// allocator fails, leaving the VM on the C library's.
+int vm_set_allocator(vm_t *vm, const gc_allocator_t *alloc) {
+    if (alloc && alloc->malloc_fn && !alloc->realloc_fn) return 0;
+
+    size_t limit = vm->mem.limit;
+    vm_teardown(vm);
+    vm->mem = (vm_mem_stats_t){0};
+    vm->mem.limit = limit;
+    if (vm_setup(vm, alloc)) return 1;
+
+    vm->mem = (vm_mem_stats_t){0};
+    vm->mem.limit = limit;
+    vm_setup(vm, NULL);
+    return 0;
+}
+
 void vm_set_error(vm_t *vm, verror_t code, const char *fmt, ...) {
     if (!vm) return;
     vm->error_code = code;
@@ -68,16 +120,68 @@ int vm_check_interrupt(vm_t *vm) {
     return 0;
 }
 
-value_t *vm_env_lookup(vm_t *vm, value_t *env, value_t *key) {
-    if (!value_is_hash(env)) return NULL;
+// The threads to use for one large job: vm->threads, or one per CPU, but
+// never more than max.
+int vm_thread_count(vm_t *vm, int max) {
+    long n = vm && vm->threads > 0 ? vm->threads : sysconf(_SC_NPROCESSORS_ONLN);
+    return n < 1 ? 1 : n > max ? max : (int)n;
+}
 
-    value_t *val = hash_get(vm, env, key);
-    if (val) return val;
+int vm_mem_over_limit(vm_t *vm, size_t size) {
+    vm->mem.refused++;
+    vm_set_error(vm, VERR_RUNTIME, "memory limit exceeded (%zu of %zu bytes in use, %zu requested)",
+                 vm->mem.total, vm->mem.limit, size);
+    return 0;
+}
 
-    return NULL;
+// Buffers owned by values go through these so they count against the
+// VM's memory limit. The frees may be handed to the reclaimer thread.
+void *vm_alloc(vm_t *vm, vtype_t type, size_t size) {
+    if (!vm_mem_charge(vm, type, size)) return NULL;
+    void *p = gc_malloc(vm, size);
+    if (!p) {
+        vm_mem_uncharge(vm, type, size);
+        vm_set_error(vm, VERR_RUNTIME, "out of memory");
+    }
+    return p;
+}
+
+void *vm_realloc(vm_t *vm, vtype_t type, void *p, size_t old_size, size_t new_size) {
+    if (new_size > old_size && !vm_mem_charge(vm, type, new_size - old_size)) return NULL;
+    void *q = gc_realloc(vm, p, old_size, new_size);
+    if (!q) {
+        if (new_size > old_size) vm_mem_uncharge(vm, type, new_size - old_size);
+        vm_set_error(vm, VERR_RUNTIME, "out of memory");
+        return NULL;
+    }
+    if (new_size < old_size) vm_mem_uncharge(vm, type, old_size - new_size);
+    return q;
+}
+
+void vm_free(vm_t *vm, vtype_t type, void *p, size_t size) {
+    if (!p) return;
+    vm_mem_uncharge(vm, type, size);
+    gc_free(vm, p);
+}
+
+/*
+ * An environment is the global hash, or a frame: a pair of a hash holding
+ * the frame's own bindings and the environment it extends. Frames only
+ * count a reference to their parent, so a call costs its own bindings
+ * rather than a copy of every binding in scope.
+ */
+value_t *vm_env_lookup(vm_t *vm, value_t *env, value_t *key) {
+    while (value_is_pair(env)) {
+        value_t *val = hash_get(vm, env->as.pair.car, key);
+        if (val) return val;
+        env = env->as.pair.cdr;
+    }
+    if (!value_is_hash(env)) return NULL;
+    return hash_get(vm, env, key);
 }
 
 value_t *vm_env_define(vm_t *vm, value_t *env, value_t *key, value_t *val) {
+    if (value_is_pair(env)) env = env->as.pair.car;
     if (!value_is_hash(env)) return NULL;
     return hash_set(vm, env, key, val);
 }
@@ -87,47 +191,395 @@ value_t *vm_env_set(vm_t *vm, value_t *env, value_t *key, value_t *val) {
 }
 
 value_t *vm_env_extend(vm_t *vm, value_t *env, value_t *keys, value_t *vals) {
-    value_t *new_env = value_hash(vm);
-    if (!new_env) return NULL;
-
-    if (env) {
-        for (size_t i = 0; i < env->as.hash.size; i++) {
-            if (env->as.hash.keys[i]) {
-                hash_set(vm, new_env, env->as.hash.keys[i], env->as.hash.values[i]);
-            }
-        }
-    }
+    value_t *frame = value_hash(vm);
+    if (!frame) return NULL;
 
     value_t *k = keys;
     value_t *v = vals;
     while (!value_is_null(k) && !value_is_null(v)) {
         if (value_is_pair(k)) {
-            vm_env_define(vm, new_env, k->as.pair.car, v->as.pair.car);
+            vm_env_define(vm, frame, k->as.pair.car, v->as.pair.car);
             k = k->as.pair.cdr;
             v = v->as.pair.cdr;
         } else {
-            vm_env_define(vm, new_env, k, v);
+            vm_env_define(vm, frame, k, v);
             break;
         }
     }
 
+    if (!env) return frame;
+    value_t *new_env = value_pair(vm, frame, env);
+    if (new_env) {
+        value_disown(frame);
+    } else {
+        value_release(vm, frame);
+    }
     return new_env;
 }
 
+// Moves the value of a local out of the frame depth levels up; see
+// vm_mark_last_uses(). Returns NULL when the binding is not there.
+static value_t *vm_env_take(vm_t *vm, value_t *env, value_t *key, uint32_t depth) {
+    while (depth-- > 0 && value_is_pair(env)) env = env->as.pair.cdr;
+    if (!value_is_pair(env)) return NULL;
+    return hash_take(vm, env->as.pair.car, key);
+}
+
+/*
+ * Last-use analysis in the style of Perceus. Within one call of a lambda,
+ * a read of a parameter or let binding that no later step of the call can
+ * repeat hands the frame's reference to the caller instead of taking a new
+ * one, so a value passed along this way stays uniquely referenced and
+ * functional updates like vector-set can reuse it. The body is walked
+ * backwards in evaluation order; the first read of each binding met that
+ * way is its last use. Bodies that create closures or define names are
+ * left alone, since something else could read the frame later.
+ */
+typedef struct {
+    vm_t *vm;
+    value_t **names;
+    uint32_t *levels;   // frame each binding lives in, counted from the lambda's
+    uint8_t *seen;      // a later read of the binding exists
+    size_t n, cap;
+    uint32_t level;
+} last_use_t;
+
+static int lu_is(value_t *v, const char *name) {
+    return value_is_symbol(v) && strcmp(v->as.symbol.name, name) == 0;
+}
+
+static int lu_captures(value_t *expr) {
+    while (value_is_pair(expr)) {
+        value_t *head = expr->as.pair.car;
+        if (lu_is(head, "lambda") || lu_is(head, "define") || lu_is(head, "define-record-type")) return 1;
+        if (lu_captures(head)) return 1;
+        expr = expr->as.pair.cdr;
+    }
+    return 0;
+}
+
+static int lu_bind(last_use_t *lu, value_t *name) {
+    if (!value_is_symbol(name)) return 1;
+    if (lu->n == lu->cap) {
+        size_t cap = lu->cap ? lu->cap * 2 : 16;
+        value_t **names = gc_realloc(lu->vm, lu->names, lu->cap * sizeof(*names), cap * sizeof(*names));
+        if (names) lu->names = names;
+        uint32_t *levels = gc_realloc(lu->vm, lu->levels, lu->cap * sizeof(*levels), cap * sizeof(*levels));
+        if (levels) lu->levels = levels;
+        uint8_t *seen = gc_realloc(lu->vm, lu->seen, lu->cap, cap);
+        if (seen) lu->seen = seen;
+        if (!names || !levels || !seen) return 0;
+        lu->cap = cap;
+    }
+    lu->names[lu->n] = name;
+    lu->levels[lu->n] = lu->level;
+    lu->seen[lu->n] = 0;
+    lu->n++;
+    return 1;
+}
+
+static int lu_expr(last_use_t *lu, value_t *expr);
+
+// Walks the expressions of a list from last to first.
+static int lu_reverse(last_use_t *lu, value_t *list) {
+    if (!value_is_pair(list)) return 1;
+    return lu_reverse(lu, list->as.pair.cdr) && lu_expr(lu, list->as.pair.car);
+}
+
+static int lu_let_inits(last_use_t *lu, value_t *bindings) {
+    if (!value_is_pair(bindings)) return 1;
+    if (!lu_let_inits(lu, bindings->as.pair.cdr)) return 0;
+    value_t *binding = bindings->as.pair.car;
+    if (!value_is_pair(binding) || !value_is_pair(binding->as.pair.cdr)) return 1;
+    return lu_expr(lu, binding->as.pair.cdr->as.pair.car);
+}
+
+static int lu_expr(last_use_t *lu, value_t *expr) {
+    if (value_is_symbol(expr)) {
+        for (size_t i = lu->n; i-- > 0;) {
+            if (strcmp(lu->names[i]->as.symbol.name, expr->as.symbol.name) != 0) continue;
+            if (!lu->seen[i]) {
+                lu->seen[i] = 1;
+                expr->flags |= VALUE_LAST_USE;
+                expr->as.symbol.depth = lu->level - lu->levels[i];
+            }
+            break;
+        }
+        return 1;
+    }
+    if (!value_is_pair(expr)) return 1;
+
+    value_t *head = expr->as.pair.car;
+    value_t *rest = expr->as.pair.cdr;
+
+    if (lu_is(head, "quote")) return 1;
+
+    if (lu_is(head, "if") && value_is_pair(rest) && value_is_pair(rest->as.pair.cdr)) {
+        // Either branch may run next, so each starts from what follows the
+        // if, and the test sees a read in either one.
+        value_t *then_expr = rest->as.pair.cdr->as.pair.car;
+        value_t *else_rest = rest->as.pair.cdr->as.pair.cdr;
+        uint8_t *after = gc_malloc(lu->vm, lu->n + 1);
+        uint8_t *in_else = gc_malloc(lu->vm, lu->n + 1);
+        int ok = after && in_else;
+        if (ok) {
+            memcpy(after, lu->seen, lu->n);
+            ok = !value_is_pair(else_rest) || lu_expr(lu, else_rest->as.pair.car);
+        }
+        if (ok) {
+            memcpy(in_else, lu->seen, lu->n);
+            memcpy(lu->seen, after, lu->n);
+            ok = lu_expr(lu, then_expr);
+        }
+        if (ok) {
+            for (size_t i = 0; i < lu->n; i++) lu->seen[i] |= in_else[i];
+            ok = lu_expr(lu, rest->as.pair.car);
+        }
+        gc_free(lu->vm, after);
+        gc_free(lu->vm, in_else);
+        return ok;
+    }
+
+    if (lu_is(head, "let") && value_is_pair(rest)) {
+        size_t base = lu->n;
+        lu->level++;
+        for (value_t *b = rest->as.pair.car; value_is_pair(b); b = b->as.pair.cdr) {
+            if (value_is_pair(b->as.pair.car) && !lu_bind(lu, b->as.pair.car->as.pair.car)) return 0;
+        }
+        int ok = lu_reverse(lu, rest->as.pair.cdr);
+        lu->n = base;
+        lu->level--;
+        return ok && lu_let_inits(lu, rest->as.pair.car);
+    }
+
+    return lu_reverse(lu, expr);
+}
+
+// Marks the last uses of a lambda's locals, once per body.
+static void vm_mark_last_uses(vm_t *vm, value_t *params, value_t *body) {
+    if (!value_is_pair(body) || (body->flags & VALUE_ANALYZED)) return;
+    body->flags |= VALUE_ANALYZED;
+    if (lu_captures(body)) return;
+
+    last_use_t lu = { vm };
+    int ok = 1;
+    while (ok && value_is_pair(params)) {
+        ok = lu_bind(&lu, params->as.pair.car);
+        params = params->as.pair.cdr;
+    }
+    if (ok && lu_bind(&lu, params)) lu_reverse(&lu, body);
+    gc_free(vm, lu.names);
+    gc_free(vm, lu.levels);
+    gc_free(vm, lu.seen);
+}
+
+static size_t list_length(value_t *list) {
+    size_t n = 0;
+    while (value_is_pair(list)) {
+        n++;
+        list = list->as.pair.cdr;
+    }
+    return n;
+}
+
+static int record_field_index(value_t *type, value_t *name, uint32_t *out) {
+    for (size_t i = 0; i < type->as.record_type.nfields; i++) {
+        if (value_equal(type->as.record_type.fields[i], name)) {
+            *out = (uint32_t)i;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int record_define_proc(vm_t *vm, value_t *env, value_t *name, value_t *type, record_proc_t kind, uint32_t index) {
+    if (!value_is_symbol(name)) {
+        vm_set_error(vm, VERR_SYNTAX, "define-record-type: expected procedure name");
+        return 0;
+    }
+    value_t *proc = value_record_proc(vm, type, kind, index);
+    if (!proc) return 0;
+    vm_env_define(vm, env, name, proc);
+    value_release(vm, proc);
+    return 1;
+}
+
+// (define-record-type name (constructor field ...) predicate
+//   (field accessor [modifier]) ...)
+static value_t *vm_define_record_type(vm_t *vm, value_t *rest, value_t *env) {
+    if (list_length(rest) < 3) {
+        vm_set_error(vm, VERR_SYNTAX, "define-record-type: expected name, constructor and predicate");
+        return NULL;
+    }
+
+    value_t *name = rest->as.pair.car;
+    value_t *ctor = rest->as.pair.cdr->as.pair.car;
+    value_t *pred = rest->as.pair.cdr->as.pair.cdr->as.pair.car;
+    value_t *specs = rest->as.pair.cdr->as.pair.cdr->as.pair.cdr;
+
+    if (!value_is_symbol(name) || !value_is_pair(ctor) || !value_is_symbol(ctor->as.pair.car)) {
+        vm_set_error(vm, VERR_SYNTAX, "define-record-type: malformed type or constructor");
+        return NULL;
+    }
+
+    size_t nfields = list_length(specs);
+    value_t **fields = gc_malloc(vm, (nfields ? nfields : 1) * sizeof(value_t *));
+    if (!fields) {
+        vm_set_error(vm, VERR_RUNTIME, "define-record-type: out of memory");
+        return NULL;
+    }
+
+    value_t *spec = specs;
+    for (size_t i = 0; i < nfields; i++, spec = spec->as.pair.cdr) {
+        value_t *field = spec->as.pair.car;
+        if (!value_is_pair(field) || !value_is_symbol(field->as.pair.car)) {
+            gc_free(vm, fields);
+            vm_set_error(vm, VERR_SYNTAX, "define-record-type: malformed field spec");
+            return NULL;
+        }
+        fields[i] = field->as.pair.car;
+    }
+
+    value_t *type = value_record_type(vm, name, fields, nfields);
+    gc_free(vm, fields);
+    if (!type) return NULL;
+
+    value_t *ctor_proc = value_record_proc(vm, type, RECORD_CONSTRUCTOR, 0);
+    size_t nargs = list_length(ctor->as.pair.cdr);
+    uint32_t *args = ctor_proc ? vm_alloc(vm, VTYPE_RECORD_PROC, (nargs ? nargs : 1) * sizeof(uint32_t)) : NULL;
+    if (!args) {
+        value_release(vm, ctor_proc);
+        value_release(vm, type);
+        vm_set_error(vm, VERR_RUNTIME, "define-record-type: out of memory");
+        return NULL;
+    }
+    ctor_proc->as.record_proc.args = args;
+    ctor_proc->as.record_proc.index = (uint32_t)nargs;
+
+    value_t *arg = ctor->as.pair.cdr;
+    for (size_t i = 0; i < nargs; i++, arg = arg->as.pair.cdr) {
+        if (!record_field_index(type, arg->as.pair.car, &args[i])) {
+            value_release(vm, ctor_proc);
+            value_release(vm, type);
+            vm_set_error(vm, VERR_SYNTAX, "define-record-type: constructor argument is not a field");
+            return NULL;
+        }
+    }
+
+    vm_env_define(vm, env, name, type);
+    vm_env_define(vm, env, ctor->as.pair.car, ctor_proc);
+    value_release(vm, ctor_proc);
+
+    int ok = record_define_proc(vm, env, pred, type, RECORD_PREDICATE, 0);
+
+    spec = specs;
+    for (uint32_t i = 0; ok && i < nfields; i++, spec = spec->as.pair.cdr) {
+        value_t *procs = spec->as.pair.car->as.pair.cdr;
+        if (value_is_pair(procs)) {
+            ok = record_define_proc(vm, env, procs->as.pair.car, type, RECORD_ACCESSOR, i);
+            procs = procs->as.pair.cdr;
+        }
+        if (ok && value_is_pair(procs)) {
+            ok = record_define_proc(vm, env, procs->as.pair.car, type, RECORD_MODIFIER, i);
+        }
+    }
+
+    value_release(vm, type);
+    if (!ok) return NULL;
+    value_retain(name);
+    return name;
+}
+
+// Record procedures: accessors and modifiers are a type check followed by
+// an indexed slot load or store.
+static value_t *vm_apply_record_proc(vm_t *vm, value_t *proc, value_t *args) {
+    value_t *type = proc->as.record_proc.type;
+    value_t *rec = value_is_pair(args) ? args->as.pair.car : NULL;
+    const char *type_name = type->as.record_type.name->as.symbol.name;
+
+    switch (proc->as.record_proc.kind) {
+        case RECORD_CONSTRUCTOR: {
+            uint32_t nargs = proc->as.record_proc.index;
+            if (list_length(args) != nargs) {
+                vm_set_error(vm, VERR_ARGS, "%s: constructor expected %u arguments", type_name, nargs);
+                return NULL;
+            }
+            rec = value_record(vm, type);
+            if (!rec) return NULL;
+            for (uint32_t i = 0; i < nargs; i++, args = args->as.pair.cdr) {
+                value_t **slot = &rec->as.record.slots[proc->as.record_proc.args[i]];
+                value_retain(args->as.pair.car);
+                value_release(vm, *slot);
+                *slot = args->as.pair.car;
+            }
+            return rec;
+        }
+        case RECORD_PREDICATE:
+            if (!rec) {
+                vm_set_error(vm, VERR_ARGS, "%s: predicate expected 1 argument", type_name);
+                return NULL;
+            }
+            return value_bool(vm, value_is_record(rec) && rec->as.record.type == type);
+        case RECORD_ACCESSOR:
+            if (!value_is_record(rec) || rec->as.record.type != type) {
+                vm_set_error(vm, VERR_TYPE, "%s: accessor expected a %s record", type_name, type_name);
+                return NULL;
+            }
+            value_retain(rec->as.record.slots[proc->as.record_proc.index]);
+            return rec->as.record.slots[proc->as.record_proc.index];
+        case RECORD_MODIFIER: {
+            if (!value_is_record(rec) || rec->as.record.type != type || !value_is_pair(args->as.pair.cdr)) {
+                vm_set_error(vm, VERR_TYPE, "%s: modifier expected a %s record and a value", type_name, type_name);
+                return NULL;
+            }
+            value_t *val = args->as.pair.cdr->as.pair.car;
+            value_t **slot = &rec->as.record.slots[proc->as.record_proc.index];
+            value_retain(val);
+            value_release(vm, *slot);
+            *slot = val;
+            value_retain(val);
+            return val;
+        }
+    }
+    return NULL;
+}
+
+// Evaluates a body, returning a new reference to the last result.
+static value_t *vm_eval_body(vm_t *vm, value_t *body, value_t *env) {
+    value_t *result = value_null(vm);
+    while (!value_is_null(body)) {
+        value_release(vm, result);
+        result = vm_eval(vm, body->as.pair.car, env);
+        if (!result) return NULL;
+        body = body->as.pair.cdr;
+    }
+    return result;
+}
+
+// Returns a new reference; callers release the result when done with it.
 value_t *vm_eval(vm_t *vm, value_t *expr, value_t *env) {
     if (vm_check_interrupt(vm)) return NULL;
 
+    if (vm->gc.npending && vm->gc.budget) gc_reclaim(vm, vm->gc.budget);
+    if (vm->gc.threshold && vm->gc.nroots >= vm->gc.threshold) gc_collect(vm);
+
     if (!expr) return value_null(vm);
 
     if (!value_is_pair(expr)) {
         if (value_is_symbol(expr)) {
+            if (expr->flags & VALUE_LAST_USE) {
+                value_t *val = vm_env_take(vm, env, expr, expr->as.symbol.depth);
+                if (val) return val;
+            }
             value_t *val = vm_env_lookup(vm, env, expr);
             if (!val) {
                 vm_set_error(vm, VERR_UNBOUND, "unbound symbol");
                 return NULL;
             }
+            value_retain(val);
             return val;
         }
+        value_retain(expr);
         return expr;
     }
 
@@ -135,13 +587,14 @@ value_t *vm_eval(vm_t *vm, value_t *expr, value_t *env) {
     value_t *rest = expr->as.pair.cdr;
 
     if (value_is_symbol(first)) {
-        const char *name = first->as.symbol;
+        const char *name = first->as.symbol.name;
 
         if (strcmp(name, "quote") == 0) {
             if (!value_is_pair(rest)) {
                 vm_set_error(vm, VERR_ARGS, "quote: expected argument");
                 return NULL;
             }
+            value_retain(rest->as.pair.car);
             return rest->as.pair.car;
         }
 
@@ -152,11 +605,9 @@ value_t *vm_eval(vm_t *vm, value_t *expr, value_t *env) {
             value_t *then_expr = rest->as.pair.cdr->as.pair.car;
             value_t *else_expr = rest->as.pair.cdr->as.pair.cdr->as.pair.car;
 
-            if (value_to_bool(test)) {
-                return vm_eval(vm, then_expr, env);
-            } else {
-                return vm_eval(vm, else_expr, env);
-            }
+            int truth = value_to_bool(test);
+            value_release(vm, test);
+            return vm_eval(vm, truth ? then_expr : else_expr, env);
         }
 
         if (strcmp(name, "define") == 0) {
@@ -173,23 +624,33 @@ value_t *vm_eval(vm_t *vm, value_t *expr, value_t *env) {
                 value_t *params = name_val->as.pair.cdr;
                 value_t *body = rest->as.pair.cdr;
 
+                vm_mark_last_uses(vm, params, body);
                 value_t *lambda = value_lambda(vm, params, body, env);
                 if (!lambda) return NULL;
 
                 vm_env_define(vm, env, func_name, lambda);
+                value_release(vm, lambda);
+                value_retain(func_name);
                 return func_name;
             } else {
                 value_t *val = vm_eval(vm, val_expr, env);
                 if (!val) return NULL;
 
                 vm_env_define(vm, env, name_val, val);
+                value_release(vm, val);
+                value_retain(name_val);
                 return name_val;
             }
         }
 
+        if (strcmp(name, "define-record-type") == 0) {
+            return vm_define_record_type(vm, rest, env);
+        }
+
         if (strcmp(name, "lambda") == 0) {
             value_t *params = rest->as.pair.car;
             value_t *body = rest->as.pair.cdr;
+            vm_mark_last_uses(vm, params, body);
             return value_lambda(vm, params, body, env);
         }
 
@@ -209,10 +670,21 @@ value_t *vm_eval(vm_t *vm, value_t *expr, value_t *env) {
                 value_t *k = binding->as.pair.car;
                 value_t *v_expr = binding->as.pair.cdr->as.pair.car;
                 value_t *v = vm_eval(vm, v_expr, env);
-                if (!v) return NULL;
+                if (!v) {
+                    value_release(vm, keys);
+                    value_release(vm, vals);
+                    return NULL;
+                }
 
                 *last_key = value_pair(vm, k, value_null(vm));
                 *last_val = value_pair(vm, v, value_null(vm));
+                if (!*last_key || !*last_val) {
+                    value_release(vm, v);
+                    value_release(vm, keys);
+                    value_release(vm, vals);
+                    return NULL;
+                }
+                value_disown(v);
                 last_key = &((*last_key)->as.pair.cdr);
                 last_val = &((*last_val)->as.pair.cdr);
 
@@ -222,18 +694,9 @@ value_t *vm_eval(vm_t *vm, value_t *expr, value_t *env) {
             value_t *new_env = vm_env_extend(vm, env, keys, vals);
             value_release(vm, keys);
             value_release(vm, vals);
+            if (!new_env) return NULL;
 
-            value_t *result = value_null(vm);
-            value_t *expr_list = body;
-            while (!value_is_null(expr_list)) {
-                result = vm_eval(vm, expr_list->as.pair.car, new_env);
-                if (!result) {
-                    value_release(vm, new_env);
-                    return NULL;
-                }
-                expr_list = expr_list->as.pair.cdr;
-            }
-
+            value_t *result = vm_eval_body(vm, body, new_env);
             value_release(vm, new_env);
             return result;
         }
@@ -242,7 +705,10 @@ value_t *vm_eval(vm_t *vm, value_t *expr, value_t *env) {
     value_t *func = vm_eval(vm, first, env);
     if (!func) return NULL;
 
-    if (vm_check_interrupt(vm)) return NULL;
+    if (vm_check_interrupt(vm)) {
+        value_release(vm, func);
+        return NULL;
+    }
 
     value_t *args = value_null(vm);
     value_t **last = &args;
@@ -252,59 +718,87 @@ value_t *vm_eval(vm_t *vm, value_t *expr, value_t *env) {
         value_t *arg = vm_eval(vm, arg_exprs->as.pair.car, env);
         if (!arg) {
             value_release(vm, args);
+            value_release(vm, func);
             return NULL;
         }
         *last = value_pair(vm, arg, value_null(vm));
+        if (!*last) {
+            value_release(vm, arg);
+            value_release(vm, args);
+            value_release(vm, func);
+            return NULL;
+        }
+        value_disown(arg);
         last = &((*last)->as.pair.cdr);
         arg_exprs = arg_exprs->as.pair.cdr;
     }
 
     value_t *result = NULL;
+    // A lazy value is called as the vector or hash it stands for.
+    value_t *target = value_force(vm, func);
 
-    if (value_is_native(func)) {
+    if (!target) {
+        // Building the lazy value failed and set the error.
+    } else if (value_is_native(func)) {
         result = func->as.native_func(vm, args);
     } else if (value_is_lambda(func)) {
         value_t *new_env = vm_env_extend(vm, func->as.lambda.env, func->as.lambda.params, args);
+        // The frame holds the arguments now; dropping the list here keeps
+        // a value passed in uniquely referenced by the frame alone.
         value_release(vm, args);
-
-        value_t *expr_list = func->as.lambda.body;
-        value_t *last_result = value_null(vm);
-        while (!value_is_null(expr_list)) {
-            last_result = vm_eval(vm, expr_list->as.pair.car, new_env);
-            if (!last_result) {
-                value_release(vm, new_env);
-                return NULL;
-            }
-            expr_list = expr_list->as.pair.cdr;
+        args = NULL;
+        if (new_env) {
+            result = vm_eval_body(vm, func->as.lambda.body, new_env);
+            value_release(vm, new_env);
         }
-
-        value_release(vm, new_env);
-        result = last_result;
-    } else if (value_is_vector(func)) {
+    } else if (value_is_vector(target)) {
         value_t *index = args->as.pair.car;
         if (!value_is_number(index)) {
             vm_set_error(vm, VERR_TYPE, "vector index must be number");
-            value_release(vm, args);
-            return NULL;
-        }
-        result = vector_get(vm, func, (size_t)index->as.number);
-        if (!result) {
-            vm_set_error(vm, VERR_RUNTIME, "vector index out of bounds");
+        } else {
+            result = vector_get(vm, target, (size_t)index->as.number);
+            if (!result) {
+                vm_set_error(vm, VERR_RUNTIME, "vector index out of bounds");
+            }
+            value_retain(result);
         }
-        value_release(vm, args);
-    } else if (value_is_hash(func)) {
+    } else if (value_is_hash(target)) {
+        // Call sites like (obj "field") keep an inline cache of the shape
+        // they last saw.
         value_t *key = args->as.pair.car;
-        result = hash_get(vm, func, key);
+        hash_ic_t *ic = &vm->hash_ic[((uintptr_t)expr >> 5) & (VM_HASH_IC_SIZE - 1)];
+        result = hash_get_cached(vm, target, key, ic);
         if (!result) {
             vm_set_error(vm, VERR_RUNTIME, "hash key not found");
         }
-        value_release(vm, args);
+        value_retain(result);
+    } else if (value_is_record_proc(func)) {
+        result = vm_apply_record_proc(vm, func, args);
     } else {
         vm_set_error(vm, VERR_TYPE, "not callable");
-        value_release(vm, args);
+    }
+
+    value_release(vm, args);
+    value_release(vm, func);
+    return result;
+}
+
+// Calls a procedure on an evaluated argument list, for natives that take
+// callbacks. Both stay owned by the caller; returns a new reference.
+value_t *vm_apply(vm_t *vm, value_t *func, value_t *args) {
+    if (vm_check_interrupt(vm)) return NULL;
+
+    if (value_is_native(func)) return func->as.native_func(vm, args);
+    if (value_is_record_proc(func)) return vm_apply_record_proc(vm, func, args);
+    if (!value_is_lambda(func)) {
+        vm_set_error(vm, VERR_TYPE, "not callable");
         return NULL;
     }
 
+    value_t *env = vm_env_extend(vm, func->as.lambda.env, func->as.lambda.params, args);
+    if (!env) return NULL;
+    value_t *result = vm_eval_body(vm, func->as.lambda.body, env);
+    value_release(vm, env);
     return result;
 }
 
@@ -312,4 +806,6 @@ void vm_register_native(vm_t *vm, const char *name, value_t *(*func)(vm_t *, val
     value_t *sym = value_symbol(vm, name);
     value_t *native = value_native(vm, func);
     vm_env_define(vm, vm->global_env, sym, native);
+    value_release(vm, sym);
+    value_release(vm, native);
 }
\ No newline at end of file
@@ -2,6 +2,7 @@
 #define VM_H
 
 #include "value.h"
+#include "gc.h"
 
 typedef enum {
     VERR_NONE,
@@ -13,15 +14,35 @@ typedef enum {
     VERR_INTERRUPTED,
 } verror_t;
 
+#define VM_HASH_IC_SIZE 256
+#define VM_KEY_INTERN_SIZE 1024
+
+// Memory held by a VM's values: 32-byte cells plus the buffers they own.
+// Shape tables are counted as hash memory.
+typedef struct vm_mem_stats {
+    size_t live[VTYPE_COUNT];  // bytes by value type
+    size_t total;
+    size_t peak;
+    size_t limit;              // allocations that would exceed this fail; 0 is unlimited
+    uint64_t refused;          // allocations refused by the limit
+} vm_mem_stats_t;
+
 struct vm {
     value_t *global_env;
     verror_t error_code;
     char *error_message;
     int interrupt_flag;
+    hash_keys_t *hash_root;
+    hash_ic_t hash_ic[VM_HASH_IC_SIZE];
+    value_t *key_intern[VM_KEY_INTERN_SIZE];  // JSON object keys (see hash_intern_key)
+    gc_t gc;
+    vm_mem_stats_t mem;
+    int threads;         // workers for large JSON and data files; 0 is one per CPU
 };
 
 vm_t *vm_create(void);
 void vm_destroy(vm_t *vm);
+int vm_set_allocator(vm_t *vm, const gc_allocator_t *alloc);
 
 void vm_set_error(vm_t *vm, verror_t code, const char *fmt, ...);
 void vm_clear_error(vm_t *vm);
@@ -31,12 +52,38 @@ verror_t vm_error_code(vm_t *vm);
 void vm_interrupt(vm_t *vm);
 int vm_check_interrupt(vm_t *vm);
 
+int vm_thread_count(vm_t *vm, int max);
+
+int vm_mem_over_limit(vm_t *vm, size_t size);
+
+// Counts size bytes against the VM's memory limit. Returns 0, with a
+// VERR_RUNTIME error set, when the limit would be exceeded.
+static inline int vm_mem_charge(vm_t *vm, vtype_t type, size_t size) {
+    if (!vm) return 1;
+    if (vm->mem.limit && vm->mem.total + size > vm->mem.limit) return vm_mem_over_limit(vm, size);
+    vm->mem.live[type] += size;
+    vm->mem.total += size;
+    if (vm->mem.total > vm->mem.peak) vm->mem.peak = vm->mem.total;
+    return 1;
+}
+
+static inline void vm_mem_uncharge(vm_t *vm, vtype_t type, size_t size) {
+    if (!vm) return;
+    vm->mem.live[type] -= size;
+    vm->mem.total -= size;
+}
+
+void *vm_alloc(vm_t *vm, vtype_t type, size_t size);
+void *vm_realloc(vm_t *vm, vtype_t type, void *p, size_t old_size, size_t new_size);
+void vm_free(vm_t *vm, vtype_t type, void *p, size_t size);
+
 value_t *vm_env_lookup(vm_t *vm, value_t *env, value_t *key);
 value_t *vm_env_define(vm_t *vm, value_t *env, value_t *key, value_t *val);
 value_t *vm_env_set(vm_t *vm, value_t *env, value_t *key, value_t *val);
 value_t *vm_env_extend(vm_t *vm, value_t *env, value_t *keys, value_t *vals);
 
 value_t *vm_eval(vm_t *vm, value_t *expr, value_t *env);
+value_t *vm_apply(vm_t *vm, value_t *func, value_t *args);
 
 void vm_register_native(vm_t *vm, const char *name, value_t *(*func)(vm_t *, value_t *));
 void vm_register_builtins(vm_t *vm);
@@ -0,0 +1,79 @@
+#include "pscm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// json-open builds nested containers only when they are used, and writes
+// unused ones out as they stand, so it must reject invalid JSON anywhere
+// in the file when it opens it.
+
+static const char *invalid[] = {
+    "[nu+6]",
+    "{\"a\":tru}",
+    "{\"a\":[nu+6]}",
+    "[[1 2]]",
+    "[[1,]]",
+    "[{\"a\" 1}]",
+    "[{\"a\":1,}]",
+    "[{\"a\":[1}]}]",
+    "[[\"\\u12\"]]",
+    "[[1]] x",
+};
+
+static const char *valid[] = {
+    "[[]]",
+    "[{}]",
+    "{\"a\":[1,{\"b\":[true,false,null,-1.5e3,\"x\\\"y\\u00e9\"]}],\"c\":{}}",
+};
+
+// Opens text with json-open and writes it back; returns 1 on success.
+static int json_open_text(vm_t *vm, const char *path, const char *text) {
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        fprintf(stderr, "Failed to create %s\n", path);
+        exit(1);
+    }
+    fputs(text, f);
+    fclose(f);
+
+    char code[256];
+    snprintf(code, sizeof(code), "(json-stringify (json-open \"%s\"))", path);
+    value_t *result;
+    if (!scheme_eval_string(vm, code, &result)) return 0;
+    scheme_release(vm, result);
+    return 1;
+}
+
+int main() {
+    vm_t *vm = scheme_create();
+    if (!vm) {
+        fprintf(stderr, "Failed to create VM\n");
+        return 1;
+    }
+
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/pscm-json-open-%d.json", (int)getpid());
+
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+        if (json_open_text(vm, path, invalid[i])) {
+            fprintf(stderr, "FAIL: json-open accepted %s\n", invalid[i]);
+            failed++;
+        }
+        scheme_clear_error(vm);
+    }
+    for (size_t i = 0; i < sizeof(valid) / sizeof(valid[0]); i++) {
+        if (!json_open_text(vm, path, valid[i])) {
+            fprintf(stderr, "FAIL: json-open rejected %s: %s\n", valid[i], scheme_error_message(vm));
+            failed++;
+        }
+        scheme_clear_error(vm);
+    }
+
+    unlink(path);
+    scheme_destroy(vm);
+    if (failed) return 1;
+    printf("json-open: all tests passed\n");
+    return 0;
+}